@@ -1,4 +1,10 @@
 set -euo pipefail
 
-cc -std=c11 -O2 -Wall -Wextra -Werror -pedantic hw5-asm.c -o hw5-asm -lm
-cc -std=c11 -O2 -Wall -Wextra -Werror -pedantic hw5-sim.c -o hw5-sim -lm
\ No newline at end of file
+cc -std=c11 -O2 -Wall -Wextra -Werror -pedantic hw5-asm.c -o hw5-asm -lm -pthread
+cc -std=c11 -O2 -Wall -Wextra -Werror -pedantic -DTINKER_LINKER=1 hw5-asm.c -o hw5-ld -lm -pthread
+cc -std=c11 -O2 -Wall -Wextra -Werror -pedantic -Wno-unused-function -DTINKER_LIBRARY=1 -c hw5-asm.c -o tinkerasm.o
+ar rcs libtinkerasm.a tinkerasm.o
+cc -std=c11 -O2 -Wall -Wextra -Werror -pedantic hw5-sim.c -o hw5-sim -lm
+cc -std=c11 -O2 -Wall -Wextra -Werror -pedantic -Wno-unused-function -DTINKER_LIBRARY=1 -c hw5-sim.c -o tinkersim.o
+ar rcs libtinkersim.a tinkersim.o
+cc -std=c11 -O2 -Wall -Wextra -Werror -pedantic tinker.c libtinkerasm.a libtinkersim.a -o tinker -lm -pthread
@@ -1,3 +1,7 @@
+#if defined(__linux__)
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -5,73 +9,388 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <setjmp.h>
+
+#if !defined(TINKER_NO_THREADS) && (defined(__unix__) || defined(__APPLE__))
+#define TINKER_THREADS 1
+#include <pthread.h>
+#else
+#define TINKER_THREADS 0
+#endif
+
+#if defined(__linux__)
+#define TINKER_MAPPED_SOURCE 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define TINKER_MAPPED_SOURCE 0
+#endif
+
+/*
+ * build.sh compiles this file again with -DTINKER_LINKER=1 for hw5-ld and
+ * with -DTINKER_LIBRARY=1, which leaves out main (and so, unused, the
+ * file-only paths), for libtinkerasm.
+ */
+#ifndef TINKER_LINKER
+#define TINKER_LINKER 0
+#endif
+
+#ifndef TINKER_LIBRARY
+#define TINKER_LIBRARY 0
+#endif
+
+#include "tinker-isa.h"
+#include "tinker-asm.h"
 
 static const uint64_t programCodeBase = 0x2000ULL;
 static const uint64_t programDataBase = 0x10000ULL;
 
+/*
+ * -j workers catch their first error here instead of exiting, so the main
+ * thread can report whichever failure comes first in source order.
+ */
+typedef struct
+{
+    jmp_buf jump;
+    char *message;
+    uint32_t line;
+} BuildFailure;
+
+static _Thread_local BuildFailure *buildFailure = NULL;
+
 static void failBuild(const char *message)
 {
+    if (buildFailure != NULL)
+    {
+        buildFailure->message = (char *)malloc(strlen(message) + 1);
+        if (buildFailure->message != NULL)
+        {
+            strcpy(buildFailure->message, message);
+        }
+
+        longjmp(buildFailure->jump, 1);
+    }
+
     fprintf(stderr, "Error: %s\n", message);
     exit(1);
 }
 
 static void failBuildWithName(const char *format, const char *name)
 {
+    if (buildFailure != NULL)
+    {
+        size_t size = strlen(format) + strlen(name) + 1;
+
+        buildFailure->message = (char *)malloc(size);
+        if (buildFailure->message != NULL)
+        {
+            snprintf(buildFailure->message, size, format, name);
+        }
+
+        longjmp(buildFailure->jump, 1);
+    }
+
     fprintf(stderr, "Error: ");
     fprintf(stderr, format, name);
     fprintf(stderr, "\n");
     exit(1);
 }
 
-static char *duplicateText(const char *text)
+/* Hands a failure caught by a nested BuildFailure on to the enclosing one. */
+static void passBuildFailure(char *message)
 {
-    size_t length = strlen(text);
-    char *copy = (char *)malloc(length + 1);
-    if (copy == NULL)
+    if (buildFailure != NULL)
     {
-        failBuild("out of memory");
+        buildFailure->message = message;
+        longjmp(buildFailure->jump, 1);
     }
-    memcpy(copy, text, length + 1);
-    return copy;
+
+    failBuild((message != NULL) ? message : "out of memory");
 }
 
-static char *duplicateTextN(const char *text, size_t length)
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    uint64_t bytes[];
+} ArenaBlock;
+
+typedef struct
+{
+    ArenaBlock *head;
+    size_t blockBytes;
+} Arena;
+
+static _Thread_local Arena assemblyArena = {NULL, 1u << 20};
+static _Thread_local Arena lineArena = {NULL, 1u << 16};
+
+static ArenaBlock *newArenaBlock(size_t size)
 {
-    char *copy = (char *)malloc(length + 1);
-    if (copy == NULL)
+    ArenaBlock *block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + size);
+    if (block == NULL)
     {
         failBuild("out of memory");
     }
+
+    block->next = NULL;
+    block->used = 0;
+    block->size = size;
+    return block;
+}
+
+static void *arenaAllocate(Arena *arena, size_t bytes)
+{
+    size_t aligned = (bytes + 7u) & ~(size_t)7u;
+    ArenaBlock *block = arena->head;
+
+    if (aligned > arena->blockBytes / 4)
+    {
+        ArenaBlock *own = newArenaBlock(aligned);
+
+        if (block == NULL)
+        {
+            arena->head = own;
+        }
+        else
+        {
+            own->next = block->next;
+            block->next = own;
+        }
+
+        own->used = aligned;
+        return own->bytes;
+    }
+
+    if (block == NULL || block->size - block->used < aligned)
+    {
+        block = newArenaBlock(arena->blockBytes);
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    block->used += aligned;
+    return (unsigned char *)block->bytes + block->used - aligned;
+}
+
+static void arenaReset(Arena *arena)
+{
+    ArenaBlock *block = NULL;
+
+    if (arena->head == NULL)
+    {
+        return;
+    }
+
+    block = arena->head->next;
+    while (block != NULL)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    arena->head->next = NULL;
+    arena->head->used = 0;
+}
+
+static void arenaRelease(Arena *arena)
+{
+    arenaReset(arena);
+    free(arena->head);
+    arena->head = NULL;
+}
+
+static void arenaAdopt(Arena *arena, Arena *other)
+{
+    ArenaBlock *last = other->head;
+
+    if (last == NULL)
+    {
+        return;
+    }
+
+    if (arena->head == NULL)
+    {
+        arena->head = other->head;
+    }
+    else
+    {
+        while (last->next != NULL)
+        {
+            last = last->next;
+        }
+
+        last->next = arena->head->next;
+        arena->head->next = other->head;
+    }
+
+    other->head = NULL;
+}
+
+static char *arenaCopyText(Arena *arena, const char *text, size_t length)
+{
+    char *copy = (char *)arenaAllocate(arena, length + 1);
     memcpy(copy, text, length);
     copy[length] = '\0';
     return copy;
 }
 
-static void rstripWhitespace(char *text)
+static uint64_t hashText(const char *text, size_t length)
+{
+    uint64_t hash = 1469598103934665603ULL;
+    size_t i = 0;
+
+    for (i = 0; i < length; i++)
+    {
+        hash ^= (uint64_t)(unsigned char)text[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+typedef struct
+{
+    const char *text;
+    size_t length;
+    uint64_t hash;
+} InternEntry;
+
+typedef struct
+{
+    InternEntry *slots;
+    size_t slotCount;
+    size_t count;
+} InternPool;
+
+static _Thread_local InternPool labelNames;
+
+static InternEntry *findInternSlot(const InternPool *pool, const char *text, size_t length, uint64_t hash)
 {
-    size_t length = strlen(text);
-    while (length > 0)
+    size_t mask = pool->slotCount - 1;
+    size_t at = (size_t)hash & mask;
+
+    while (pool->slots[at].text != NULL)
     {
-        unsigned char ch = (unsigned char)text[length - 1];
-        if (isspace(ch))
+        const InternEntry *entry = &pool->slots[at];
+
+        if (entry->hash == hash && entry->length == length && memcmp(entry->text, text, length) == 0)
         {
-            text[length - 1] = '\0';
-            length--;
+            break;
         }
-        else
+
+        at = (at + 1) & mask;
+    }
+
+    return &pool->slots[at];
+}
+
+static void growInternPool(InternPool *pool)
+{
+    InternEntry *old = pool->slots;
+    size_t oldCount = pool->slotCount;
+    size_t i = 0;
+
+    pool->slotCount = (oldCount == 0) ? 256 : oldCount * 2;
+    pool->slots = (InternEntry *)calloc(pool->slotCount, sizeof(InternEntry));
+    if (pool->slots == NULL)
+    {
+        failBuild("out of memory");
+    }
+
+    for (i = 0; i < oldCount; i++)
+    {
+        if (old[i].text != NULL)
         {
-            break;
+            *findInternSlot(pool, old[i].text, old[i].length, old[i].hash) = old[i];
         }
     }
+
+    free(old);
+}
+
+static const char *internText(const char *text, size_t length)
+{
+    InternPool *pool = &labelNames;
+    uint64_t hash = hashText(text, length);
+    InternEntry *slot = NULL;
+
+    if ((pool->count + 1) * 2 > pool->slotCount)
+    {
+        growInternPool(pool);
+    }
+
+    slot = findInternSlot(pool, text, length, hash);
+    if (slot->text == NULL)
+    {
+        slot->text = arenaCopyText(&assemblyArena, text, length);
+        slot->length = length;
+        slot->hash = hash;
+        pool->count++;
+    }
+
+    return slot->text;
+}
+
+static void releaseInternPool(InternPool *pool)
+{
+    free(pool->slots);
+    pool->slots = NULL;
+    pool->slotCount = 0;
+    pool->count = 0;
+}
+
+/*
+ * A source line is a view into the input without its newline. Trimming
+ * ends it at a NUL byte or ';' comment and drops trailing whitespace.
+ */
+typedef struct
+{
+    const char *text;
+    size_t length;
+} SourceLine;
+
+static bool nextSourceLine(const char **cursor, const char *end, SourceLine *line)
+{
+    const char *newline = NULL;
+
+    if (*cursor >= end)
+    {
+        return false;
+    }
+
+    newline = (const char *)memchr(*cursor, '\n', (size_t)(end - *cursor));
+    line->text = *cursor;
+    line->length = (size_t)(((newline != NULL) ? newline : end) - *cursor);
+    *cursor = (newline != NULL) ? newline + 1 : end;
+
+    return true;
 }
 
-static void stripSemicolonComment(char *text)
+static SourceLine trimSourceLine(SourceLine line)
 {
-    char *semicolon = strchr(text, ';');
-    if (semicolon != NULL)
+    const char *stop = (const char *)memchr(line.text, '\0', line.length);
+
+    if (stop != NULL)
+    {
+        line.length = (size_t)(stop - line.text);
+    }
+
+    stop = (const char *)memchr(line.text, ';', line.length);
+    if (stop != NULL)
+    {
+        line.length = (size_t)(stop - line.text);
+    }
+
+    while (line.length > 0 && isspace((unsigned char)line.text[line.length - 1]))
     {
-        *semicolon = '\0';
+        line.length--;
     }
+
+    return line;
 }
 
 static const char *skipLeadingWhitespace(const char *text)
@@ -84,9 +403,11 @@ static const char *skipLeadingWhitespace(const char *text)
     return p;
 }
 
-static bool hasPrefix(const char *text, const char *prefix)
+static bool lineHasPrefix(SourceLine line, const char *prefix)
 {
-    return strncmp(text, prefix, strlen(prefix)) == 0;
+    size_t length = strlen(prefix);
+
+    return line.length >= length && memcmp(line.text, prefix, length) == 0;
 }
 
 static void writeU32LittleEndian(FILE *file, uint32_t value)
@@ -119,6 +440,20 @@ static void writeU64LittleEndian(FILE *file, uint64_t value)
     }
 }
 
+static void storeU32LittleEndian(unsigned char *bytes, uint32_t value)
+{
+    bytes[0] = (unsigned char)(value & 0xFFu);
+    bytes[1] = (unsigned char)((value >> 8) & 0xFFu);
+    bytes[2] = (unsigned char)((value >> 16) & 0xFFu);
+    bytes[3] = (unsigned char)((value >> 24) & 0xFFu);
+}
+
+static void storeU64LittleEndian(unsigned char *bytes, uint64_t value)
+{
+    storeU32LittleEndian(bytes, (uint32_t)value);
+    storeU32LittleEndian(bytes + 4, (uint32_t)(value >> 32));
+}
+
 static int readRegisterNumber(const char *token)
 {
     char *end = NULL;
@@ -232,28 +567,13 @@ typedef struct
     int count;
 } TokenList;
 
-static void freeTokenList(TokenList tokens)
-{
-    int i = 0;
-
-    for (i = 0; i < tokens.count; i++)
-    {
-        free(tokens.items[i]);
-    }
-    free(tokens.items);
-}
-
-static TokenList splitTokens(const char *line)
+static TokenList splitTokensIn(Arena *arena, const char *line)
 {
     TokenList tokens;
     size_t capacity = 8;
     const char *p = line;
 
-    tokens.items = (char **)malloc(sizeof(char *) * capacity);
-    if (tokens.items == NULL)
-    {
-        failBuild("out of memory");
-    }
+    tokens.items = (char **)arenaAllocate(arena, sizeof(char *) * capacity);
     tokens.count = 0;
 
     while (*p != '\0')
@@ -279,24 +599,13 @@ static TokenList splitTokens(const char *line)
             }
 
             length = (size_t)(p - start);
-            token = (char *)malloc(length + 1);
-            if (token == NULL)
-            {
-                failBuild("out of memory");
-            }
-
-            memcpy(token, start, length);
-            token[length] = '\0';
+            token = arenaCopyText(arena, start, length);
 
             if ((size_t)tokens.count == capacity)
             {
-                char **bigger = NULL;
+                char **bigger = (char **)arenaAllocate(arena, sizeof(char *) * capacity * 2);
+                memcpy(bigger, tokens.items, sizeof(char *) * capacity);
                 capacity *= 2;
-                bigger = (char **)realloc(tokens.items, sizeof(char *) * capacity);
-                if (bigger == NULL)
-                {
-                    failBuild("out of memory");
-                }
                 tokens.items = bigger;
             }
 
@@ -308,6 +617,11 @@ static TokenList splitTokens(const char *line)
     return tokens;
 }
 
+static TokenList splitTokens(const char *line)
+{
+    return splitTokensIn(&lineArena, line);
+}
+
 static int countCharCommas(const char *text)
 {
     int count = 0;
@@ -325,100 +639,105 @@ static int countCharCommas(const char *text)
     return count;
 }
 
-static int expectedOperandCommaCount(const char *mnemonic)
+typedef enum
 {
-    if (mnemonic == NULL)
-    {
-        return -1;
-    }
+    pseudoClr = tinkerFormatMov + 1,
+    pseudoHalt,
+    pseudoIn,
+    pseudoOut,
+    pseudoPush,
+    pseudoPop,
+    pseudoLd
+} PseudoKind;
 
-    if (strcmp(mnemonic, "") == 0)
-    {
-        return 0;
-    }
-    if (strcmp(mnemonic, "halt") == 0)
-    {
-        return 0;
-    }
+typedef struct
+{
+    const char *name;
+    int kind;
+    uint32_t opcode;
+} MnemonicInfo;
 
-    if (strcmp(mnemonic, "br") == 0)
-    {
-        return 0;
-    }
-    if (strcmp(mnemonic, "brr") == 0)
-    {
-        return 0;
-    }
-    if (strcmp(mnemonic, "call") == 0)
-    {
-        return 0;
-    }
-    if (strcmp(mnemonic, "return") == 0)
-    {
-        return 0;
-    }
+static MnemonicInfo mnemonicSlots[tinkerMnemonicSlots];
+static bool mnemonicSlotsReady = false;
 
-    if (strcmp(mnemonic, "not") == 0)
-    {
-        return 1;
-    }
-    if (strcmp(mnemonic, "addi") == 0)
-    {
-        return 1;
-    }
-    if (strcmp(mnemonic, "subi") == 0)
-    {
-        return 1;
-    }
-    if (strcmp(mnemonic, "shftri") == 0)
-    {
-        return 1;
-    }
-    if (strcmp(mnemonic, "shftli") == 0)
-    {
-        return 1;
-    }
+static MnemonicInfo *findMnemonicSlot(const char *name)
+{
+    uint32_t at = tinkerHashMnemonic(name);
 
-    if (strcmp(mnemonic, "brnz") == 0)
-    {
-        return 1;
-    }
-    if (strcmp(mnemonic, "mov") == 0)
-    {
-        return 1;
-    }
-    if (strcmp(mnemonic, "in") == 0)
+    while (mnemonicSlots[at].name != NULL && strcmp(mnemonicSlots[at].name, name) != 0)
     {
-        return 1;
-    }
-    if (strcmp(mnemonic, "out") == 0)
-    {
-        return 1;
+        at = (at + 1u) & (tinkerMnemonicSlots - 1u);
     }
 
-    if (strcmp(mnemonic, "clr") == 0)
+    return &mnemonicSlots[at];
+}
+
+static void addMnemonic(const char *name, int kind, uint32_t opcode)
+{
+    MnemonicInfo *slot = findMnemonicSlot(name);
+
+    if (slot->name == NULL)
     {
-        return 0;
+        slot->name = name;
+        slot->kind = kind;
+        slot->opcode = opcode;
     }
-    if (strcmp(mnemonic, "push") == 0)
+}
+
+static const MnemonicInfo *lookupMnemonic(const char *name)
+{
+    const MnemonicInfo *slot = NULL;
+
+    if (!mnemonicSlotsReady)
     {
-        return 0;
+#define TINKER_MNEMONIC_ENTRY(opcode, mnemonic, format, immKind, endsBlock, handler) addMnemonic(#mnemonic, format, opcode);
+        TINKER_OPCODES(TINKER_MNEMONIC_ENTRY)
+#undef TINKER_MNEMONIC_ENTRY
+        addMnemonic("clr", pseudoClr, 0);
+        addMnemonic("halt", pseudoHalt, 0);
+        addMnemonic("in", pseudoIn, 0);
+        addMnemonic("out", pseudoOut, 0);
+        addMnemonic("push", pseudoPush, 0);
+        addMnemonic("pop", pseudoPop, 0);
+        addMnemonic("ld", pseudoLd, 0);
+        mnemonicSlotsReady = true;
     }
-    if (strcmp(mnemonic, "pop") == 0)
+
+    slot = findMnemonicSlot(name);
+    return (slot->name != NULL) ? slot : NULL;
+}
+
+static int expectedOperandCommaCount(const char *mnemonic)
+{
+    const MnemonicInfo *info = NULL;
+
+    if (mnemonic == NULL)
     {
-        return 0;
+        return -1;
     }
-    if (strcmp(mnemonic, "ld") == 0)
+
+    info = lookupMnemonic(mnemonic);
+    if (info == NULL)
     {
-        return 1;
+        return 2;
     }
 
-    if (strcmp(mnemonic, "priv") == 0)
+    switch (info->kind)
     {
+    case tinkerFormatRRR:
+        return 2;
+    case tinkerFormatPriv:
         return 3;
+    case tinkerFormatRR:
+    case tinkerFormatRI:
+    case tinkerFormatMov:
+    case pseudoIn:
+    case pseudoOut:
+    case pseudoLd:
+        return 1;
+    default:
+        return 0;
     }
-
-    return 2;
 }
 
 static void enforceCommaStyle(const char *rawLine, const char *mnemonic)
@@ -449,16 +768,52 @@ typedef enum
 {
     recordInstruction,
     recordData,
-    recordLoadLabel
+    recordLoadLabel,
+    recordJumpLabel
 } RecordType;
 
+/* What produced a code record, in PseudoKind order after the first. */
+typedef enum
+{
+    originInstruction,
+    originClr,
+    originHalt,
+    originIn,
+    originOut,
+    originPush,
+    originPop,
+    originLoadImmediate,
+    originLoadLabel,
+    originLabelJump,
+    originCount
+} RecordOrigin;
+
+static const char *const originNames[originCount] = {"instruction", "clr", "halt", "in", "out", "push", "pop", "ld expansion", "ld label expansion", "ld label + br (-O)"};
+
+/*
+ * Instructions carry decoded fields; a brr to a label keeps the label and
+ * gets its displacement at encode time. recordLoadLabel uses rd, label and
+ * imm12 as the number of words reserved for it; with -O, data can name
+ * (index + 1) an earlier load of rd the label is reached from by one addi
+ * or subi. recordJumpLabel is an optimised ld + br to label: a brr while
+ * imm12 is 1, else the full pair. recordData uses data or, for a label
+ * reference, label. Code records also keep the source line, file (object
+ * index for hw5-ld) and origin for --map.
+ */
 typedef struct
 {
-    RecordType type;
+    uint8_t type;
+    uint8_t opcode;
+    uint8_t rd;
+    uint8_t rs;
+    uint8_t rt;
+    uint8_t origin;
+    uint16_t imm12;
+    uint32_t line;
+    uint16_t file;
+    const char *label;
     uint64_t address;
-    char *text;
     uint64_t data;
-    int destReg;
 } ProgramRecord;
 
 typedef struct
@@ -500,23 +855,24 @@ static void appendRecord(ProgramRecordList *list, ProgramRecord record)
 
 static void freeRecordList(ProgramRecordList *list)
 {
-    size_t i = 0;
-
-    for (i = 0; i < list->count; i++)
-    {
-        free(list->items[i].text);
-    }
-
     free(list->items);
     list->items = NULL;
     list->count = 0;
     list->capacity = 0;
 }
 
+/*
+ * Code labels also remember the record they precede, so their address can
+ * be recomputed once variable-length ld sequences are sized.
+ */
+static const size_t noCodeRecord = (size_t)-1;
+
 typedef struct
 {
-    char *name;
+    const char *name;
+    uint64_t hash;
     uint64_t address;
+    size_t codeRecord;
 } Symbol;
 
 typedef struct
@@ -524,18 +880,71 @@ typedef struct
     Symbol *items;
     size_t count;
     size_t capacity;
+    size_t *slots;
+    size_t slotCount;
 } SymbolTable;
 
-static void addSymbol(SymbolTable *table, const char *name, uint64_t address)
+static uint64_t hashSymbolName(const char *name)
 {
-    size_t i = 0;
+    return hashText(name, strlen(name));
+}
 
-    for (i = 0; i < table->count; i++)
+static size_t *findSymbolSlot(const SymbolTable *table, const char *name, uint64_t hash)
+{
+    size_t mask = table->slotCount - 1;
+    size_t at = (size_t)hash & mask;
+
+    while (table->slots[at] != 0)
     {
-        if (strcmp(table->items[i].name, name) == 0)
+        const Symbol *symbol = &table->items[table->slots[at] - 1];
+
+        if (symbol->hash == hash && strcmp(symbol->name, name) == 0)
         {
-            failBuildWithName("duplicate label %s", name);
+            break;
         }
+
+        at = (at + 1) & mask;
+    }
+
+    return &table->slots[at];
+}
+
+static void growSymbolSlots(SymbolTable *table)
+{
+    size_t newSlotCount = 0;
+    size_t i = 0;
+
+    newSlotCount = (table->slotCount == 0) ? 128 : table->slotCount * 2;
+
+    free(table->slots);
+    table->slots = (size_t *)calloc(newSlotCount, sizeof(size_t));
+    if (table->slots == NULL)
+    {
+        failBuild("out of memory");
+    }
+
+    table->slotCount = newSlotCount;
+
+    for (i = 0; i < table->count; i++)
+    {
+        *findSymbolSlot(table, table->items[i].name, table->items[i].hash) = i + 1;
+    }
+}
+
+static void addSymbol(SymbolTable *table, const char *name, uint64_t address, size_t codeRecord)
+{
+    uint64_t hash = hashSymbolName(name);
+    size_t *slot = NULL;
+
+    if ((table->count + 1) * 2 > table->slotCount)
+    {
+        growSymbolSlots(table);
+    }
+
+    slot = findSymbolSlot(table, name, hash);
+    if (*slot != 0)
+    {
+        failBuildWithName("duplicate label %s", name);
     }
 
     if (table->count == table->capacity)
@@ -562,45 +971,59 @@ static void addSymbol(SymbolTable *table, const char *name, uint64_t address)
         table->capacity = newCapacity;
     }
 
-    table->items[table->count].name = duplicateText(name);
+    table->items[table->count].name = name;
+    table->items[table->count].hash = hash;
     table->items[table->count].address = address;
+    table->items[table->count].codeRecord = codeRecord;
     table->count++;
+    *slot = table->count;
 }
 
-static bool findSymbol(const SymbolTable *table, const char *name, uint64_t *outAddress)
+static const Symbol *lookupSymbol(const SymbolTable *table, const char *name)
 {
-    size_t i = 0;
+    size_t *slot = NULL;
 
-    for (i = 0; i < table->count; i++)
+    if (table->slotCount == 0)
     {
-        if (strcmp(table->items[i].name, name) == 0)
-        {
-            *outAddress = table->items[i].address;
-            return true;
-        }
+        return NULL;
     }
 
-    return false;
+    slot = findSymbolSlot(table, name, hashSymbolName(name));
+    if (*slot == 0)
+    {
+        return NULL;
+    }
+
+    return &table->items[*slot - 1];
 }
 
-static void freeSymbolTable(SymbolTable *table)
+static bool findSymbol(const SymbolTable *table, const char *name, uint64_t *outAddress)
 {
-    size_t i = 0;
+    const Symbol *symbol = lookupSymbol(table, name);
 
-    for (i = 0; i < table->count; i++)
+    if (symbol == NULL)
     {
-        free(table->items[i].name);
+        return false;
     }
 
+    *outAddress = symbol->address;
+    return true;
+}
+
+static void freeSymbolTable(SymbolTable *table)
+{
     free(table->items);
+    free(table->slots);
     table->items = NULL;
     table->count = 0;
     table->capacity = 0;
+    table->slots = NULL;
+    table->slotCount = 0;
 }
 
 typedef struct
 {
-    char **names;
+    const char **names;
     size_t count;
     size_t capacity;
 } UnattachedLabels;
@@ -610,7 +1033,7 @@ static void addUnattachedLabel(UnattachedLabels *pending, const char *name)
     if (pending->count == pending->capacity)
     {
         size_t newCapacity = 0;
-        char **bigger = NULL;
+        const char **bigger = NULL;
 
         if (pending->capacity == 0)
         {
@@ -621,7 +1044,7 @@ static void addUnattachedLabel(UnattachedLabels *pending, const char *name)
             newCapacity = pending->capacity * 2;
         }
 
-        bigger = (char **)realloc(pending->names, newCapacity * sizeof(char *));
+        bigger = (const char **)realloc(pending->names, newCapacity * sizeof(char *));
         if (bigger == NULL)
         {
             failBuild("out of memory");
@@ -631,18 +1054,17 @@ static void addUnattachedLabel(UnattachedLabels *pending, const char *name)
         pending->capacity = newCapacity;
     }
 
-    pending->names[pending->count] = duplicateText(name);
+    pending->names[pending->count] = name;
     pending->count++;
 }
 
-static void attachPendingLabels(UnattachedLabels *pending, SymbolTable *symbols, uint64_t address)
+static void attachPendingLabels(UnattachedLabels *pending, SymbolTable *symbols, uint64_t address, size_t codeRecord)
 {
     size_t i = 0;
 
     for (i = 0; i < pending->count; i++)
     {
-        addSymbol(symbols, pending->names[i], address);
-        free(pending->names[i]);
+        addSymbol(symbols, pending->names[i], address, codeRecord);
     }
 
     pending->count = 0;
@@ -650,20 +1072,13 @@ static void attachPendingLabels(UnattachedLabels *pending, SymbolTable *symbols,
 
 static void freeUnattachedLabels(UnattachedLabels *pending)
 {
-    size_t i = 0;
-
-    for (i = 0; i < pending->count; i++)
-    {
-        free(pending->names[i]);
-    }
-
     free(pending->names);
     pending->names = NULL;
     pending->count = 0;
     pending->capacity = 0;
 }
 
-static char *readLabelDefinition(const char *line)
+static const char *readLabelDefinition(const char *line)
 {
     const char *p = line;
     const char *start = NULL;
@@ -699,50 +1114,159 @@ static char *readLabelDefinition(const char *line)
         }
     }
 
-    return duplicateTextN(start, (size_t)(p - start));
+    return internText(start, (size_t)(p - start));
 }
 
-static void addInstructionText(ProgramRecordList *code, uint64_t address, const char *text, UnattachedLabels *pending, SymbolTable *symbols)
+static ProgramRecord makeInstruction(uint32_t opcode, uint32_t rd, uint32_t rs, uint32_t rt, uint32_t imm12)
 {
     ProgramRecord record;
 
-    attachPendingLabels(pending, symbols, address);
-
+    memset(&record, 0, sizeof(record));
     record.type = recordInstruction;
-    record.address = address;
-    record.text = duplicateText(text);
-    record.data = 0;
-    record.destReg = -1;
+    record.opcode = (uint8_t)(opcode & 0x1Fu);
+    record.rd = (uint8_t)(rd & 0x1Fu);
+    record.rs = (uint8_t)(rs & 0x1Fu);
+    record.rt = (uint8_t)(rt & 0x1Fu);
+    record.imm12 = (uint16_t)(imm12 & 0xFFFu);
+
+    return record;
+}
+
+/*
+ * ld picks the shortest xor/addi/shftli sequence for a constant: the set bits
+ * are covered by as few 12-bit windows as possible, each window costing a
+ * shftli + addi after the first. A window anchored at bit 0 saves the final
+ * shftli when that does not need an extra window. Values with mostly ones are
+ * loaded as the complement followed by not. hw5-sim fuses all of these back
+ * into a single constant load.
+ */
+enum
+{
+    maxLoadWords = 12
+};
+
+static int countLoadWindows(uint64_t value, int bottom, int *outBottoms)
+{
+    int count = 0;
+
+    while (bottom < 64 && (value >> bottom) != 0)
+    {
+        while (((value >> bottom) & 1ULL) == 0)
+        {
+            bottom++;
+        }
+
+        outBottoms[count] = bottom;
+        count++;
+        bottom += 12;
+    }
+
+    return count;
+}
+
+static int planDirectLoad(uint64_t value, uint32_t rd, ProgramRecord *steps)
+{
+    int anchored[6];
+    int tight[6];
+    int *bottoms = anchored;
+    int windows = 0;
+    int tightWindows = 0;
+    int count = 0;
+    int i = 0;
+
+    steps[count++] = makeInstruction(0x02, rd, rd, rd, 0);
+
+    if (value == 0)
+    {
+        return count;
+    }
+
+    anchored[0] = 0;
+    windows = 1 + countLoadWindows(value, 12, anchored + 1);
+
+    tightWindows = countLoadWindows(value, 0, tight);
+
+    if (windows > tightWindows)
+    {
+        bottoms = tight;
+        windows = tightWindows;
+    }
+
+    steps[count++] = makeInstruction(0x19, rd, 0, 0, (uint32_t)(value >> bottoms[windows - 1]));
 
+    for (i = windows - 2; i >= 0; i--)
+    {
+        steps[count++] = makeInstruction(0x07, rd, 0, 0, (uint32_t)(bottoms[i + 1] - bottoms[i]));
+        steps[count++] = makeInstruction(0x19, rd, 0, 0, (uint32_t)((value >> bottoms[i]) & 0xFFFULL));
+    }
+
+    if (bottoms[0] != 0)
+    {
+        steps[count++] = makeInstruction(0x07, rd, 0, 0, (uint32_t)bottoms[0]);
+    }
+
+    return count;
+}
+
+static int planLoadImmediate(uint64_t value, uint32_t rd, ProgramRecord *steps)
+{
+    ProgramRecord inverted[maxLoadWords];
+    int direct = planDirectLoad(value, rd, steps);
+    int complement = planDirectLoad(~value, rd, inverted);
+
+    if (complement + 1 < direct)
+    {
+        memcpy(steps, inverted, (size_t)complement * sizeof(ProgramRecord));
+        steps[complement] = makeInstruction(0x03, rd, rd, 0, 0);
+        return complement + 1;
+    }
+
+    return direct;
+}
+
+static int loadImmediateWords(uint64_t value)
+{
+    ProgramRecord steps[maxLoadWords];
+
+    return planLoadImmediate(value, 0, steps);
+}
+
+static void addInstructionRecord(ProgramRecordList *code, uint64_t *pc, ProgramRecord record, UnattachedLabels *pending, SymbolTable *symbols)
+{
+    attachPendingLabels(pending, symbols, *pc, code->count);
+
+    record.address = *pc;
     appendRecord(code, record);
+    *pc += 4;
 }
 
-static void addLoadLabelRecord(ProgramRecordList *code, uint64_t address, int destReg, const char *labelName, UnattachedLabels *pending, SymbolTable *symbols)
+static void addLoadLabelRecord(ProgramRecordList *code, uint64_t *pc, int destReg, const char *labelName, UnattachedLabels *pending, SymbolTable *symbols)
 {
     ProgramRecord record;
 
-    attachPendingLabels(pending, symbols, address);
+    attachPendingLabels(pending, symbols, *pc, code->count);
 
+    memset(&record, 0, sizeof(record));
     record.type = recordLoadLabel;
-    record.address = address;
-    record.text = duplicateText(labelName);
-    record.data = 0;
-    record.destReg = destReg;
+    record.address = *pc;
+    record.label = internText(labelName, strlen(labelName));
+    record.rd = (uint8_t)destReg;
+    record.imm12 = (uint16_t)loadImmediateWords(programCodeBase);
 
     appendRecord(code, record);
+    *pc += 4ULL * record.imm12;
 }
 
 static void addDataValue(ProgramRecordList *data, uint64_t address, uint64_t value, UnattachedLabels *pending, SymbolTable *symbols)
 {
     ProgramRecord record;
 
-    attachPendingLabels(pending, symbols, address);
+    attachPendingLabels(pending, symbols, address, noCodeRecord);
 
+    memset(&record, 0, sizeof(record));
     record.type = recordData;
     record.address = address;
-    record.text = NULL;
     record.data = value;
-    record.destReg = -1;
 
     appendRecord(data, record);
 }
@@ -751,136 +1275,63 @@ static void addDataLabelReference(ProgramRecordList *data, uint64_t address, con
 {
     ProgramRecord record;
 
-    attachPendingLabels(pending, symbols, address);
+    attachPendingLabels(pending, symbols, address, noCodeRecord);
 
+    memset(&record, 0, sizeof(record));
     record.type = recordData;
     record.address = address;
-    record.text = duplicateText(labelName);
-    record.data = 0;
-    record.destReg = -1;
+    record.label = internText(labelName, strlen(labelName));
 
     appendRecord(data, record);
 }
 
 static void emitClearRegister(ProgramRecordList *code, uint64_t *pc, int destReg, UnattachedLabels *pending, SymbolTable *symbols)
 {
-    char line[64];
-
-    snprintf(line, sizeof(line), "xor r%d, r%d, r%d", destReg, destReg, destReg);
-    addInstructionText(code, *pc, line, pending, symbols);
-    *pc += 4;
+    addInstructionRecord(code, pc, makeInstruction(0x02, (uint32_t)destReg, (uint32_t)destReg, (uint32_t)destReg, 0), pending, symbols);
 }
 
 static void emitHaltInstruction(ProgramRecordList *code, uint64_t *pc, UnattachedLabels *pending, SymbolTable *symbols)
 {
-    addInstructionText(code, *pc, "priv r0, r0, r0, 0", pending, symbols);
-    *pc += 4;
+    addInstructionRecord(code, pc, makeInstruction(0x0F, 0, 0, 0, 0), pending, symbols);
 }
 
 static void emitInputInstruction(ProgramRecordList *code, uint64_t *pc, int destReg, int srcReg, UnattachedLabels *pending, SymbolTable *symbols)
 {
-    char line[64];
-
-    snprintf(line, sizeof(line), "priv r%d, r%d, r0, 3", destReg, srcReg);
-    addInstructionText(code, *pc, line, pending, symbols);
-    *pc += 4;
+    addInstructionRecord(code, pc, makeInstruction(0x0F, (uint32_t)destReg, (uint32_t)srcReg, 0, 3), pending, symbols);
 }
 
 static void emitOutputInstruction(ProgramRecordList *code, uint64_t *pc, int destReg, int srcReg, UnattachedLabels *pending, SymbolTable *symbols)
 {
-    char line[64];
-
-    snprintf(line, sizeof(line), "priv r%d, r%d, r0, 4", destReg, srcReg);
-    addInstructionText(code, *pc, line, pending, symbols);
-    *pc += 4;
+    addInstructionRecord(code, pc, makeInstruction(0x0F, (uint32_t)destReg, (uint32_t)srcReg, 0, 4), pending, symbols);
 }
 
 static void emitPushRegister(ProgramRecordList *code, uint64_t *pc, int srcReg, UnattachedLabels *pending, SymbolTable *symbols)
 {
-    char line[64];
-
-    snprintf(line, sizeof(line), "mov (r31)(-8), r%d", srcReg);
-    addInstructionText(code, *pc, line, pending, symbols);
-    *pc += 4;
-
-    addInstructionText(code, *pc, "subi r31, 8", pending, symbols);
-    *pc += 4;
+    addInstructionRecord(code, pc, makeInstruction(0x13, 31, (uint32_t)srcReg, 0, (uint32_t)-8 & 0xFFFu), pending, symbols);
+    addInstructionRecord(code, pc, makeInstruction(0x1B, 31, 0, 0, 8), pending, symbols);
 }
 
 static void emitPopRegister(ProgramRecordList *code, uint64_t *pc, int destReg, UnattachedLabels *pending, SymbolTable *symbols)
 {
-    char line[64];
-
-    snprintf(line, sizeof(line), "mov r%d, (r31)(0)", destReg);
-    addInstructionText(code, *pc, line, pending, symbols);
-    *pc += 4;
-
-    addInstructionText(code, *pc, "addi r31, 8", pending, symbols);
-    *pc += 4;
+    addInstructionRecord(code, pc, makeInstruction(0x10, (uint32_t)destReg, 31, 0, 0), pending, symbols);
+    addInstructionRecord(code, pc, makeInstruction(0x19, 31, 0, 0, 8), pending, symbols);
 }
 
-static void emitLoadImmediate64(ProgramRecordList *code, uint64_t *pc, int destReg, uint64_t value, UnattachedLabels *pending, SymbolTable *symbols)
+static void emitLoadImmediate(ProgramRecordList *code, uint64_t *pc, int destReg, uint64_t value, int reservedWords, UnattachedLabels *pending, SymbolTable *symbols)
 {
-    const int shiftAmounts[5] = {12, 12, 12, 12, 4};
-    const int offsets[5] = {40, 28, 16, 4, 0};
-    char line[64];
-    uint64_t top = 0;
+    ProgramRecord steps[maxLoadWords];
+    int count = planLoadImmediate(value, (uint32_t)destReg, steps);
     int i = 0;
 
-    snprintf(line, sizeof(line), "xor r%d, r%d, r%d", destReg, destReg, destReg);
-    addInstructionText(code, *pc, line, pending, symbols);
-    *pc += 4;
-
-    top = (value >> 52) & 0xFFFULL;
-    snprintf(line, sizeof(line), "addi r%d, %llu", destReg, (unsigned long long)top);
-    addInstructionText(code, *pc, line, pending, symbols);
-    *pc += 4;
-
-    for (i = 0; i < 5; i++)
+    for (i = 0; i < count; i++)
     {
-        uint64_t part = 0;
-
-        snprintf(line, sizeof(line), "shftli r%d, %d", destReg, shiftAmounts[i]);
-        addInstructionText(code, *pc, line, pending, symbols);
-        *pc += 4;
-
-        if (i == 4)
-        {
-            part = value & 0xFULL;
-        }
-        else
-        {
-            part = (value >> (uint64_t)offsets[i]) & 0xFFFULL;
-        }
-
-        snprintf(line, sizeof(line), "addi r%d, %llu", destReg, (unsigned long long)part);
-        addInstructionText(code, *pc, line, pending, symbols);
-        *pc += 4;
+        addInstructionRecord(code, pc, steps[i], pending, symbols);
     }
-}
-
-static uint32_t encodeRType(uint32_t opcode, uint32_t rd, uint32_t rs, uint32_t rt)
-{
-    uint32_t word = 0;
-
-    word |= (opcode & 0x1Fu) << 27;
-    word |= (rd & 0x1Fu) << 22;
-    word |= (rs & 0x1Fu) << 17;
-    word |= (rt & 0x1Fu) << 12;
-
-    return word;
-}
-
-static uint32_t encodeIType(uint32_t opcode, uint32_t rd, uint32_t rs, uint32_t imm12)
-{
-    uint32_t word = 0;
-
-    word |= (opcode & 0x1Fu) << 27;
-    word |= (rd & 0x1Fu) << 22;
-    word |= (rs & 0x1Fu) << 17;
-    word |= (imm12 & 0xFFFu);
 
-    return word;
+    for (; i < reservedWords; i++)
+    {
+        addInstructionRecord(code, pc, makeInstruction(0x19, (uint32_t)destReg, 0, 0, 0), pending, symbols);
+    }
 }
 
 static uint32_t encodePType(uint32_t opcode, uint32_t rd, uint32_t rs, uint32_t rt, uint32_t imm12)
@@ -972,16 +1423,31 @@ static bool readMemoryOperandParen(const char *token, int *outBaseReg, int32_t *
     return true;
 }
 
-static uint32_t assembleOneInstruction(const char *instructionText, uint64_t pc, const SymbolTable *symbols)
+static void readRegisterOperands(const TokenList *tokens, int count, int *outRegs)
+{
+    int i = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        outRegs[i] = readRegisterNumber(tokens->items[i + 1]);
+        if (outRegs[i] < 0)
+        {
+            failBuild("invalid register");
+        }
+    }
+}
+
+static ProgramRecord parseInstruction(const char *instructionText)
 {
     TokenList tokens;
     const char *mnemonic = NULL;
+    const MnemonicInfo *info = NULL;
+    int regs[3] = {0, 0, 0};
 
     tokens = splitTokens(instructionText);
 
     if (tokens.count == 0)
     {
-        freeTokenList(tokens);
         failBuild("empty instruction");
     }
 
@@ -995,191 +1461,91 @@ static uint32_t assembleOneInstruction(const char *instructionText, uint64_t pc,
     }
 
     mnemonic = tokens.items[0];
+    info = lookupMnemonic(mnemonic);
 
-    if (strcmp(mnemonic, "and") == 0 || strcmp(mnemonic, "or") == 0 || strcmp(mnemonic, "xor") == 0 ||
-        strcmp(mnemonic, "add") == 0 || strcmp(mnemonic, "sub") == 0 || strcmp(mnemonic, "mul") == 0 || strcmp(mnemonic, "div") == 0 ||
-        strcmp(mnemonic, "addf") == 0 || strcmp(mnemonic, "subf") == 0 || strcmp(mnemonic, "mulf") == 0 || strcmp(mnemonic, "divf") == 0 ||
-        strcmp(mnemonic, "shftr") == 0 || strcmp(mnemonic, "shftl") == 0)
+    if (info == NULL || info->kind > tinkerFormatMov)
     {
-        int rd = -1;
-        int rs = -1;
-        int rt = -1;
-        uint32_t opcode = 0;
+        failBuildWithName("unknown instruction mnemonic %s", mnemonic);
+    }
 
+    switch (info->kind)
+    {
+    case tinkerFormatRRR:
         if (tokens.count != 4)
         {
-            freeTokenList(tokens);
-            failBuild("R-type expects 3 registers");
+            failBuildWithName("%s expects rd, rs, rt", mnemonic);
         }
 
-        rd = readRegisterNumber(tokens.items[1]);
-        rs = readRegisterNumber(tokens.items[2]);
-        rt = readRegisterNumber(tokens.items[3]);
-
-        if (rd < 0 || rs < 0 || rt < 0)
-        {
-            freeTokenList(tokens);
-            failBuild("invalid register");
-        }
+        readRegisterOperands(&tokens, 3, regs);
+        return makeInstruction(info->opcode, (uint32_t)regs[0], (uint32_t)regs[1], (uint32_t)regs[2], 0);
 
-        if (strcmp(mnemonic, "and") == 0)
-        {
-            opcode = 0x00;
-        }
-        else if (strcmp(mnemonic, "or") == 0)
-        {
-            opcode = 0x01;
-        }
-        else if (strcmp(mnemonic, "xor") == 0)
-        {
-            opcode = 0x02;
-        }
-        else if (strcmp(mnemonic, "shftr") == 0)
-        {
-            opcode = 0x04;
-        }
-        else if (strcmp(mnemonic, "shftl") == 0)
-        {
-            opcode = 0x06;
-        }
-        else if (strcmp(mnemonic, "addf") == 0)
-        {
-            opcode = 0x14;
-        }
-        else if (strcmp(mnemonic, "subf") == 0)
-        {
-            opcode = 0x15;
-        }
-        else if (strcmp(mnemonic, "mulf") == 0)
-        {
-            opcode = 0x16;
-        }
-        else if (strcmp(mnemonic, "divf") == 0)
-        {
-            opcode = 0x17;
-        }
-        else if (strcmp(mnemonic, "add") == 0)
-        {
-            opcode = 0x18;
-        }
-        else if (strcmp(mnemonic, "sub") == 0)
-        {
-            opcode = 0x1A;
-        }
-        else if (strcmp(mnemonic, "mul") == 0)
-        {
-            opcode = 0x1C;
-        }
-        else if (strcmp(mnemonic, "div") == 0)
-        {
-            opcode = 0x1D;
-        }
-        else
+    case tinkerFormatRR:
+        if (tokens.count != 3)
         {
-            freeTokenList(tokens);
-            failBuild("unknown instruction");
+            failBuildWithName("%s expects rd, rs", mnemonic);
         }
 
-        freeTokenList(tokens);
-        return encodeRType(opcode, (uint32_t)rd, (uint32_t)rs, (uint32_t)rt);
-    }
-
-    if (strcmp(mnemonic, "not") == 0)
-    {
-        int rd = -1;
-        int rs = -1;
+        readRegisterOperands(&tokens, 2, regs);
+        return makeInstruction(info->opcode, (uint32_t)regs[0], (uint32_t)regs[1], 0, 0);
 
-        if (tokens.count != 3)
+    case tinkerFormatR:
+        if (tokens.count != 2)
         {
-            freeTokenList(tokens);
-            failBuild("not expects 2 registers");
+            failBuildWithName("%s expects rd", mnemonic);
         }
 
-        rd = readRegisterNumber(tokens.items[1]);
-        rs = readRegisterNumber(tokens.items[2]);
+        readRegisterOperands(&tokens, 1, regs);
+        return makeInstruction(info->opcode, (uint32_t)regs[0], 0, 0, 0);
 
-        if (rd < 0 || rs < 0)
+    case tinkerFormatNone:
+        if (tokens.count != 1)
         {
-            freeTokenList(tokens);
-            failBuild("invalid register");
+            failBuildWithName("%s expects no operands", mnemonic);
         }
 
-        freeTokenList(tokens);
-        return encodeRType(0x03, (uint32_t)rd, (uint32_t)rs, 0);
-    }
+        return makeInstruction(info->opcode, 0, 0, 0, 0);
 
-    if (strcmp(mnemonic, "addi") == 0 || strcmp(mnemonic, "subi") == 0 || strcmp(mnemonic, "shftri") == 0 || strcmp(mnemonic, "shftli") == 0)
+    case tinkerFormatRI:
     {
-        int rd = -1;
         uint32_t imm = 0;
-        uint32_t opcode = 0;
 
         if (tokens.count != 3)
         {
-            freeTokenList(tokens);
-            failBuild("I-type expects rd, imm");
+            failBuildWithName("%s expects rd, imm", mnemonic);
         }
 
-        rd = readRegisterNumber(tokens.items[1]);
-        if (rd < 0)
-        {
-            freeTokenList(tokens);
-            failBuild("invalid register");
-        }
+        readRegisterOperands(&tokens, 1, regs);
 
         if (!readUnsigned12(tokens.items[2], &imm))
         {
-            freeTokenList(tokens);
             failBuild("immediate must be 0..4095");
         }
 
-        if (strcmp(mnemonic, "addi") == 0)
-        {
-            opcode = 0x19;
-        }
-        else if (strcmp(mnemonic, "subi") == 0)
-        {
-            opcode = 0x1B;
-        }
-        else if (strcmp(mnemonic, "shftri") == 0)
-        {
-            opcode = 0x05;
-        }
-        else
-        {
-            opcode = 0x07;
-        }
-
-        freeTokenList(tokens);
-        return encodeIType(opcode, (uint32_t)rd, 0, imm);
+        return makeInstruction(info->opcode, (uint32_t)regs[0], 0, 0, imm);
     }
 
-    if (strcmp(mnemonic, "br") == 0)
+    case tinkerFormatPriv:
     {
-        int rd = -1;
+        uint32_t imm = 0;
 
-        if (tokens.count != 2)
+        if (tokens.count != 5)
         {
-            freeTokenList(tokens);
-            failBuild("br expects rd");
+            failBuild("priv expects rd, rs, rt, imm");
         }
 
-        rd = readRegisterNumber(tokens.items[1]);
-        if (rd < 0)
+        readRegisterOperands(&tokens, 3, regs);
+
+        if (!readUnsigned12(tokens.items[4], &imm))
         {
-            freeTokenList(tokens);
-            failBuild("invalid register");
+            failBuild("priv imm must be 0..4095");
         }
 
-        freeTokenList(tokens);
-        return encodeRType(0x08, (uint32_t)rd, 0, 0);
+        return makeInstruction(info->opcode, (uint32_t)regs[0], (uint32_t)regs[1], (uint32_t)regs[2], imm);
     }
 
-    if (strcmp(mnemonic, "brr") == 0)
-    {
+    case tinkerFormatBrr:
         if (tokens.count != 2)
         {
-            freeTokenList(tokens);
             failBuild("brr expects rd or imm/label");
         }
 
@@ -1187,35 +1553,17 @@ static uint32_t assembleOneInstruction(const char *instructionText, uint64_t pc,
             int reg = readRegisterNumber(tokens.items[1]);
             if (reg >= 0)
             {
-                freeTokenList(tokens);
-                return encodeRType(0x09, (uint32_t)reg, 0, 0);
+                return makeInstruction(info->opcode, (uint32_t)reg, 0, 0, 0);
             }
         }
 
         if (tokens.items[1][0] == ':' || tokens.items[1][0] == '@')
         {
-            uint64_t target = 0;
             const char *name = tokens.items[1] + 1;
-            int64_t delta = 0;
-            uint32_t imm12 = 0;
-
-            if (!findSymbol(symbols, name, &target))
-            {
-                freeTokenList(tokens);
-                failBuildWithName("undefined label reference %s", tokens.items[1]);
-            }
-
-            delta = (int64_t)target - (int64_t)pc;
-
-            if (delta < -2048LL || delta > 2047LL)
-            {
-                freeTokenList(tokens);
-                failBuild("brr label out of range for signed 12-bit");
-            }
+            ProgramRecord record = makeInstruction(info->opcode + 1, 0, 0, 0, 0);
 
-            imm12 = (uint32_t)((int32_t)delta) & 0xFFFu;
-            freeTokenList(tokens);
-            return ((0x0Au & 0x1Fu) << 27) | imm12;
+            record.label = internText(name, strlen(name));
+            return record;
         }
 
         {
@@ -1224,140 +1572,20 @@ static uint32_t assembleOneInstruction(const char *instructionText, uint64_t pc,
 
             if (!readSigned12(tokens.items[1], &rel))
             {
-                freeTokenList(tokens);
                 failBuild("brr immediate must fit signed 12-bit");
             }
 
             imm12 = (uint32_t)rel & 0xFFFu;
-            freeTokenList(tokens);
-            return ((0x0Au & 0x1Fu) << 27) | imm12;
+            return makeInstruction(info->opcode + 1, 0, 0, 0, imm12);
         }
-    }
 
-    if (strcmp(mnemonic, "brnz") == 0)
-    {
-        int rd = -1;
-        int rs = -1;
-
-        if (tokens.count != 3)
-        {
-            freeTokenList(tokens);
-            failBuild("brnz expects rd, rs");
-        }
-
-        rd = readRegisterNumber(tokens.items[1]);
-        rs = readRegisterNumber(tokens.items[2]);
-
-        if (rd < 0 || rs < 0)
-        {
-            freeTokenList(tokens);
-            failBuild("invalid register");
-        }
-
-        freeTokenList(tokens);
-        return encodeRType(0x0B, (uint32_t)rd, (uint32_t)rs, 0);
-    }
-
-    if (strcmp(mnemonic, "call") == 0)
-    {
-        int rd = -1;
-
-        if (tokens.count != 2)
-        {
-            freeTokenList(tokens);
-            failBuild("call expects rd");
-        }
-
-        rd = readRegisterNumber(tokens.items[1]);
-        if (rd < 0)
-        {
-            freeTokenList(tokens);
-            failBuild("invalid register");
-        }
-
-        freeTokenList(tokens);
-        return encodeRType(0x0C, (uint32_t)rd, 0, 0);
-    }
-
-    if (strcmp(mnemonic, "return") == 0)
-    {
-        if (tokens.count != 1)
-        {
-            freeTokenList(tokens);
-            failBuild("return expects no operands");
-        }
-
-        freeTokenList(tokens);
-        return (0x0Du & 0x1Fu) << 27;
-    }
-
-    if (strcmp(mnemonic, "brgt") == 0)
-    {
-        int rd = -1;
-        int rs = -1;
-        int rt = -1;
-
-        if (tokens.count != 4)
-        {
-            freeTokenList(tokens);
-            failBuild("brgt expects rd, rs, rt");
-        }
-
-        rd = readRegisterNumber(tokens.items[1]);
-        rs = readRegisterNumber(tokens.items[2]);
-        rt = readRegisterNumber(tokens.items[3]);
-
-        if (rd < 0 || rs < 0 || rt < 0)
-        {
-            freeTokenList(tokens);
-            failBuild("invalid register");
-        }
-
-        freeTokenList(tokens);
-        return encodeRType(0x0E, (uint32_t)rd, (uint32_t)rs, (uint32_t)rt);
-    }
-
-    if (strcmp(mnemonic, "priv") == 0)
-    {
-        int rd = -1;
-        int rs = -1;
-        int rt = -1;
-        uint32_t imm = 0;
-
-        if (tokens.count != 5)
-        {
-            freeTokenList(tokens);
-            failBuild("priv expects rd, rs, rt, imm");
-        }
-
-        rd = readRegisterNumber(tokens.items[1]);
-        rs = readRegisterNumber(tokens.items[2]);
-        rt = readRegisterNumber(tokens.items[3]);
-
-        if (rd < 0 || rs < 0 || rt < 0)
-        {
-            freeTokenList(tokens);
-            failBuild("invalid register");
-        }
-
-        if (!readUnsigned12(tokens.items[4], &imm))
-        {
-            freeTokenList(tokens);
-            failBuild("priv imm must be 0..4095");
-        }
-
-        freeTokenList(tokens);
-        return encodePType(0x0F, (uint32_t)rd, (uint32_t)rs, (uint32_t)rt, imm);
-    }
-
-    if (strcmp(mnemonic, "mov") == 0)
+    case tinkerFormatMov:
     {
         const char *left = NULL;
         const char *right = NULL;
 
         if (tokens.count != 3)
         {
-            freeTokenList(tokens);
             failBuild("mov expects 2 operands");
         }
 
@@ -1366,13 +1594,11 @@ static uint32_t assembleOneInstruction(const char *instructionText, uint64_t pc,
 
         if ((left[0] == 'r' || left[0] == 'R') && (strchr(left, '+') != NULL || strchr(left, '-') != NULL))
         {
-            freeTokenList(tokens);
             failBuild("mov malformed memory operand");
         }
 
         if ((right[0] == 'r' || right[0] == 'R') && (strchr(right, '+') != NULL || strchr(right, '-') != NULL))
         {
-            freeTokenList(tokens);
             failBuild("mov malformed memory operand");
         }
 
@@ -1384,19 +1610,16 @@ static uint32_t assembleOneInstruction(const char *instructionText, uint64_t pc,
 
             if (!readMemoryOperandParen(left, &base, &signedImm))
             {
-                freeTokenList(tokens);
                 failBuild("mov store malformed memory operand");
             }
 
             src = readRegisterNumber(right);
             if (src < 0)
             {
-                freeTokenList(tokens);
                 failBuild("mov store invalid source reg");
             }
 
-            freeTokenList(tokens);
-            return encodePType(0x13, (uint32_t)base, (uint32_t)src, 0, (uint32_t)signedImm & 0xFFFu);
+            return makeInstruction(info->opcode + 3, (uint32_t)base, (uint32_t)src, 0, (uint32_t)signedImm & 0xFFFu);
         }
 
         if (right[0] == '(')
@@ -1408,18 +1631,15 @@ static uint32_t assembleOneInstruction(const char *instructionText, uint64_t pc,
             dst = readRegisterNumber(left);
             if (dst < 0)
             {
-                freeTokenList(tokens);
                 failBuild("mov load invalid rd");
             }
 
             if (!readMemoryOperandParen(right, &base, &signedImm))
             {
-                freeTokenList(tokens);
                 failBuild("mov load malformed memory operand");
             }
 
-            freeTokenList(tokens);
-            return encodePType(0x10, (uint32_t)dst, (uint32_t)base, 0, (uint32_t)signedImm & 0xFFFu);
+            return makeInstruction(info->opcode, (uint32_t)dst, (uint32_t)base, 0, (uint32_t)signedImm & 0xFFFu);
         }
 
         {
@@ -1430,514 +1650,3687 @@ static uint32_t assembleOneInstruction(const char *instructionText, uint64_t pc,
             dst = readRegisterNumber(left);
             if (dst < 0)
             {
-                freeTokenList(tokens);
                 failBuild("mov invalid rd");
             }
 
             src = readRegisterNumber(right);
             if (src >= 0)
             {
-                freeTokenList(tokens);
-                return encodeRType(0x11, (uint32_t)dst, (uint32_t)src, 0);
+                return makeInstruction(info->opcode + 1, (uint32_t)dst, (uint32_t)src, 0, 0);
             }
 
             if (!readUnsigned12(right, &imm))
             {
-                freeTokenList(tokens);
                 failBuild("mov rd, L: L must be 0..4095");
             }
 
-            freeTokenList(tokens);
-            return encodeIType(0x12, (uint32_t)dst, 0, imm);
+            return makeInstruction(info->opcode + 2, (uint32_t)dst, 0, 0, imm);
         }
     }
-
-    {
-        char *mnCopy = duplicateText(mnemonic);
-        freeTokenList(tokens);
-        failBuildWithName("unknown instruction mnemonic %s", mnCopy);
     }
 
-    return 0;
+    failBuildWithName("unknown instruction mnemonic %s", mnemonic);
+
+    return makeInstruction(0, 0, 0, 0, 0);
 }
 
-static void expandLoadLabelRecords(ProgramRecordList *code, const SymbolTable *symbols)
+static uint32_t encodeInstruction(const ProgramRecord *record, const SymbolTable *symbols)
 {
-    ProgramRecordList expanded;
-    size_t i = 0;
-
-    expanded.items = NULL;
-    expanded.count = 0;
-    expanded.capacity = 0;
+    uint32_t imm12 = record->imm12;
 
-    for (i = 0; i < code->count; i++)
+    if (record->label != NULL)
     {
-        ProgramRecord record = code->items[i];
+        uint64_t target = 0;
+        int64_t delta = 0;
 
-        if (record.type != recordLoadLabel)
+        if (!findSymbol(symbols, record->label, &target))
         {
-            appendRecord(&expanded, record);
-            code->items[i].text = NULL;
+            failBuildWithName("undefined label reference :%s", record->label);
         }
-        else
-        {
-            uint64_t target = 0;
-            uint64_t localPc = 0;
-            UnattachedLabels tempPending;
-            SymbolTable tempSymbols;
-
-            if (!findSymbol(symbols, record.text, &target))
-            {
-                failBuildWithName("ld: undefined label reference %s", record.text);
-            }
-
-            localPc = record.address;
-
-            tempPending.names = NULL;
-            tempPending.count = 0;
-            tempPending.capacity = 0;
-
-            tempSymbols.items = symbols->items;
-            tempSymbols.count = symbols->count;
-            tempSymbols.capacity = symbols->capacity;
 
-            emitLoadImmediate64(&expanded, &localPc, record.destReg, target, &tempPending, &tempSymbols);
+        delta = (int64_t)target - (int64_t)record->address;
 
-            freeUnattachedLabels(&tempPending);
-            free(record.text);
+        if (delta < -2048LL || delta > 2047LL)
+        {
+            failBuild("brr label out of range for signed 12-bit");
         }
+
+        imm12 = (uint32_t)((int32_t)delta) & 0xFFFu;
     }
 
-    free(code->items);
-    *code = expanded;
+    return encodePType(record->opcode, record->rd, record->rs, record->rt, imm12);
 }
 
-static void buildFromSource(const char *inputPath, ProgramRecordList *code, ProgramRecordList *data, SymbolTable *symbols)
+/*
+ * -O peephole. A label ld followed by br on the same register becomes a
+ * single brr when the register is dead at the label, and any label ld whose
+ * register still holds an earlier label in the same block becomes one addi
+ * or subi. Both fall back to the full sequence during relaxation if the
+ * final layout puts them out of range. The analyses assume every branch
+ * target is a label.
+ */
+enum
 {
-    FILE *file = NULL;
-    char rawLine[4096];
-    AssemblyPart currentPart = partNone;
-    uint64_t codePc = programCodeBase;
-    uint64_t dataPc = programDataBase;
-    UnattachedLabels pendingLabels;
-    bool sawCodeDirective = false;
+    livenessBudget = 512
+};
 
-    file = fopen(inputPath, "r");
-    if (file == NULL)
+typedef struct
+{
+    const ProgramRecordList *code;
+    const SymbolTable *symbols;
+    uint32_t *visited;
+    uint32_t stamp;
+    size_t *stack;
+} LivenessQuery;
+
+static void readRegisterUse(const ProgramRecord *record, uint32_t *outReads, uint32_t *outWrites)
+{
+    uint32_t rd = 1u << record->rd;
+    uint32_t rs = 1u << record->rs;
+    uint32_t rt = 1u << record->rt;
+
+    *outReads = 0;
+    *outWrites = 0;
+
+    if (record->type == recordLoadLabel)
     {
-        failBuildWithName("cannot open input file %s", inputPath);
+        *outReads = (record->data != 0) ? rd : 0;
+        *outWrites = rd;
+        return;
     }
 
-    pendingLabels.names = NULL;
-    pendingLabels.count = 0;
-    pendingLabels.capacity = 0;
+    if (record->type != recordInstruction)
+    {
+        return;
+    }
 
-    while (fgets(rawLine, sizeof(rawLine), file) != NULL)
+    switch (record->opcode)
     {
-        const char *p = NULL;
+    case 0x02:
+        *outReads = (record->rs == record->rd && record->rt == record->rd) ? 0 : (rs | rt);
+        *outWrites = rd;
+        break;
+    case 0x03:
+    case 0x10:
+    case 0x11:
+        *outReads = rs;
+        *outWrites = rd;
+        break;
+    case 0x05:
+    case 0x07:
+    case 0x12:
+    case 0x19:
+    case 0x1B:
+        *outReads = rd;
+        *outWrites = rd;
+        break;
+    case 0x08:
+    case 0x09:
+    case 0x0C:
+        *outReads = rd;
+        break;
+    case 0x0A:
+        break;
+    case 0x0B:
+    case 0x13:
+        *outReads = rd | rs;
+        break;
+    case 0x0D:
+        *outReads = 1u << 31;
+        break;
+    case 0x0E:
+        *outReads = rd | rs | rt;
+        break;
+    case 0x0F:
+        *outReads = rd | rs;
+        *outWrites = (record->imm12 == 3) ? rd : 0;
+        break;
+    default:
+        *outReads = rs | rt;
+        *outWrites = rd;
+        break;
+    }
+}
 
-        rstripWhitespace(rawLine);
-        stripSemicolonComment(rawLine);
-        rstripWhitespace(rawLine);
+static size_t labelRecord(const SymbolTable *symbols, const char *label)
+{
+    const Symbol *symbol = lookupSymbol(symbols, label);
 
-        p = rawLine;
+    return (symbol != NULL) ? symbol->codeRecord : noCodeRecord;
+}
 
-        if (*p == '\0')
-        {
-            continue;
-        }
+static size_t knownBranchTarget(const ProgramRecordList *code, const SymbolTable *symbols, size_t index)
+{
+    const ProgramRecord *branch = &code->items[index];
+    const ProgramRecord *load = NULL;
 
-        if (hasPrefix(p, ".code"))
-        {
-            currentPart = partCode;
-            sawCodeDirective = true;
-            continue;
-        }
+    if (index == 0)
+    {
+        return noCodeRecord;
+    }
 
-        if (hasPrefix(p, ".data"))
-        {
-            currentPart = partData;
-            continue;
-        }
+    load = &code->items[index - 1];
+    if (load->type != recordLoadLabel || load->rd != branch->rd)
+    {
+        return noCodeRecord;
+    }
 
-        if (p[0] == ':' || p[0] == '@')
-        {
-            char *name = readLabelDefinition(p);
-            addUnattachedLabel(&pendingLabels, name);
-            free(name);
-            continue;
-        }
+    return labelRecord(symbols, load->label);
+}
 
-        if (p[0] != '\t')
-        {
-            fclose(file);
-            freeUnattachedLabels(&pendingLabels);
-            failBuild("code/data line must start with tab character");
-        }
+/*
+ * Walks every path from start until reg is read (live) or written (dead).
+ * Paths through call, return or an unknown branch target, and walks over
+ * the budget, count as live.
+ */
+static bool registerLiveAt(LivenessQuery *query, size_t start, uint32_t reg)
+{
+    const ProgramRecordList *code = query->code;
+    uint32_t bit = 1u << reg;
+    size_t depth = 0;
+    size_t steps = 0;
 
-        p = skipLeadingWhitespace(p);
+    query->stamp++;
+    query->stack[depth++] = start;
 
-        if (*p == '\0')
-        {
-            continue;
-        }
+    while (depth != 0)
+    {
+        size_t at = query->stack[--depth];
 
-        if (currentPart == partNone)
+        while (at < code->count && query->visited[at] != query->stamp)
         {
-            fclose(file);
-            freeUnattachedLabels(&pendingLabels);
-            failBuild("code/data line before any .code or .data directive");
-        }
+            const ProgramRecord *record = &code->items[at];
+            uint32_t reads = 0;
+            uint32_t writes = 0;
+            size_t target = noCodeRecord;
 
-        if (currentPart == partData)
-        {
-            if ((p[0] == ':' || p[0] == '@') && p[1] != '\0')
+            query->visited[at] = query->stamp;
+            if (++steps > livenessBudget)
             {
-                addDataLabelReference(data, dataPc, p + 1, &pendingLabels, symbols);
-                dataPc += 8;
-                continue;
+                return true;
+            }
+
+            readRegisterUse(record, &reads, &writes);
+            if ((reads & bit) != 0)
+            {
+                return true;
+            }
+
+            if ((writes & bit) != 0)
+            {
+                break;
             }
 
+            if (record->type == recordJumpLabel || (record->type == recordInstruction && record->opcode == 0x0A && record->label != NULL))
             {
-                uint64_t value = 0;
-                if (!readUnsigned64(p, &value))
+                target = labelRecord(query->symbols, record->label);
+                if (target == noCodeRecord)
                 {
-                    fclose(file);
-                    freeUnattachedLabels(&pendingLabels);
-                    failBuild("malformed data item; expected 64-bit unsigned integer");
+                    return true;
                 }
 
-                addDataValue(data, dataPc, value, &pendingLabels, symbols);
-                dataPc += 8;
+                at = target;
                 continue;
             }
-        }
-
-        {
-            TokenList tokens = splitTokens(p);
-            char mnemonic[64];
-            int i = 0;
 
-            if (tokens.count == 0)
+            if (record->type != recordInstruction)
             {
-                freeTokenList(tokens);
+                at++;
                 continue;
             }
 
-            for (i = 0; tokens.items[0][i] != '\0'; i++)
+            if (record->opcode == 0x0F && record->imm12 == 0)
             {
-                tokens.items[0][i] = (char)tolower((unsigned char)tokens.items[0][i]);
+                break;
             }
 
-            snprintf(mnemonic, sizeof(mnemonic), "%s", tokens.items[0]);
-
-            enforceCommaStyle(p, mnemonic);
-            freeTokenList(tokens);
-
-            if (strcmp(mnemonic, "clr") == 0)
+            if (record->opcode == 0x08 || record->opcode == 0x0B || record->opcode == 0x0E)
             {
-                TokenList t = splitTokens(p);
-                int rd = -1;
-
-                if (t.count != 2)
+                target = knownBranchTarget(code, query->symbols, at);
+                if (target == noCodeRecord)
                 {
-                    freeTokenList(t);
-                    fclose(file);
-                    freeUnattachedLabels(&pendingLabels);
-                    failBuild("clr expects clr rd");
+                    return true;
                 }
 
-                rd = readRegisterNumber(t.items[1]);
-                if (rd < 0)
+                if (record->opcode == 0x08)
                 {
-                    freeTokenList(t);
-                    fclose(file);
-                    freeUnattachedLabels(&pendingLabels);
-                    failBuild("clr invalid register");
+                    at = target;
+                    continue;
                 }
 
-                freeTokenList(t);
-                emitClearRegister(code, &codePc, rd, &pendingLabels, symbols);
+                query->stack[depth++] = target;
+                at++;
                 continue;
             }
 
-            if (strcmp(mnemonic, "halt") == 0)
+            if (record->opcode >= 0x09 && record->opcode <= 0x0D)
             {
-                TokenList t = splitTokens(p);
-
-                if (t.count != 1)
-                {
-                    freeTokenList(t);
-                    fclose(file);
-                    freeUnattachedLabels(&pendingLabels);
-                    failBuild("halt expects no operands");
-                }
-
-                freeTokenList(t);
-                emitHaltInstruction(code, &codePc, &pendingLabels, symbols);
-                continue;
+                return true;
             }
 
-            if (strcmp(mnemonic, "in") == 0)
-            {
-                TokenList t = splitTokens(p);
-                int rd = -1;
-                int rs = -1;
-
-                if (t.count != 3)
-                {
-                    freeTokenList(t);
-                    fclose(file);
-                    freeUnattachedLabels(&pendingLabels);
-                    failBuild("in expects in rd, rs");
-                }
+            at++;
+        }
+    }
 
-                rd = readRegisterNumber(t.items[1]);
-                rs = readRegisterNumber(t.items[2]);
+    return false;
+}
 
-                if (rd < 0 || rs < 0)
-                {
-                    freeTokenList(t);
-                    fclose(file);
-                    freeUnattachedLabels(&pendingLabels);
-                    failBuild("in invalid register");
-                }
+static void optimizeLabelBranches(ProgramRecordList *code, SymbolTable *symbols)
+{
+    LivenessQuery query;
+    bool *isTarget = NULL;
+    bool *removed = NULL;
+    size_t *newIndex = NULL;
+    size_t known[32];
+    size_t kept = 0;
+    size_t i = 0;
+    int r = 0;
 
-                freeTokenList(t);
-                emitInputInstruction(code, &codePc, rd, rs, &pendingLabels, symbols);
-                continue;
-            }
+    if (code->count == 0)
+    {
+        return;
+    }
 
-            if (strcmp(mnemonic, "out") == 0)
-            {
-                TokenList t = splitTokens(p);
-                int rd = -1;
-                int rs = -1;
+    isTarget = (bool *)calloc(code->count, sizeof(bool));
+    removed = (bool *)calloc(code->count, sizeof(bool));
+    newIndex = (size_t *)malloc(code->count * sizeof(size_t));
+    query.visited = (uint32_t *)calloc(code->count, sizeof(uint32_t));
+    query.stack = (size_t *)malloc((livenessBudget + 1) * sizeof(size_t));
+    if (isTarget == NULL || removed == NULL || newIndex == NULL || query.visited == NULL || query.stack == NULL)
+    {
+        failBuild("out of memory");
+    }
 
-                if (t.count != 3)
-                {
-                    freeTokenList(t);
-                    fclose(file);
-                    freeUnattachedLabels(&pendingLabels);
-                    failBuild("out expects out rd, rs");
-                }
+    query.code = code;
+    query.symbols = symbols;
+    query.stamp = 0;
 
-                rd = readRegisterNumber(t.items[1]);
-                rs = readRegisterNumber(t.items[2]);
+    for (i = 0; i < symbols->count; i++)
+    {
+        if (symbols->items[i].codeRecord != noCodeRecord)
+        {
+            isTarget[symbols->items[i].codeRecord] = true;
+        }
+    }
 
-                if (rd < 0 || rs < 0)
-                {
-                    freeTokenList(t);
-                    fclose(file);
-                    freeUnattachedLabels(&pendingLabels);
-                    failBuild("out invalid register");
-                }
+    for (r = 0; r < 32; r++)
+    {
+        known[r] = noCodeRecord;
+    }
 
-                freeTokenList(t);
-                emitOutputInstruction(code, &codePc, rd, rs, &pendingLabels, symbols);
-                continue;
-            }
+    for (i = 0; i < code->count; i++)
+    {
+        ProgramRecord *record = &code->items[i];
+        uint32_t reads = 0;
+        uint32_t writes = 0;
+        bool resetAll = false;
 
-            if (strcmp(mnemonic, "push") == 0)
+        if (isTarget[i])
+        {
+            for (r = 0; r < 32; r++)
             {
-                TokenList t = splitTokens(p);
-                int rd = -1;
+                known[r] = noCodeRecord;
+            }
+        }
 
-                if (t.count != 2)
-                {
-                    freeTokenList(t);
-                    fclose(file);
-                    freeUnattachedLabels(&pendingLabels);
-                    failBuild("push expects push rd");
-                }
+        if (record->type == recordLoadLabel)
+        {
+            const ProgramRecord *next = (i + 1 < code->count) ? &code->items[i + 1] : NULL;
+            size_t target = labelRecord(symbols, record->label);
 
-                rd = readRegisterNumber(t.items[1]);
-                if (rd < 0)
+            if (next != NULL && !isTarget[i + 1] && next->type == recordInstruction && next->opcode == 0x08 && next->rd == record->rd &&
+                target != noCodeRecord && !registerLiveAt(&query, target, record->rd))
+            {
+                record->type = recordJumpLabel;
+                record->origin = originLabelJump;
+                record->imm12 = 1;
+                removed[i + 1] = true;
+                resetAll = true;
+                i++;
+            }
+            else
+            {
+                if (known[record->rd] != noCodeRecord)
                 {
-                    freeTokenList(t);
-                    fclose(file);
-                    freeUnattachedLabels(&pendingLabels);
-                    failBuild("push invalid register");
+                    record->data = known[record->rd] + 1;
+                    record->imm12 = 1;
                 }
 
-                freeTokenList(t);
-                emitPushRegister(code, &codePc, rd, &pendingLabels, symbols);
-                continue;
+                known[record->rd] = i;
             }
+        }
+        else
+        {
+            readRegisterUse(record, &reads, &writes);
 
-            if (strcmp(mnemonic, "pop") == 0)
+            for (r = 0; r < 32; r++)
             {
-                TokenList t = splitTokens(p);
-                int rd = -1;
-
-                if (t.count != 2)
+                if ((writes & (1u << r)) != 0)
                 {
-                    freeTokenList(t);
-                    fclose(file);
-                    freeUnattachedLabels(&pendingLabels);
-                    failBuild("pop expects pop rd");
+                    known[r] = noCodeRecord;
                 }
+            }
 
-                rd = readRegisterNumber(t.items[1]);
-                if (rd < 0)
-                {
-                    freeTokenList(t);
-                    fclose(file);
-                    freeUnattachedLabels(&pendingLabels);
-                    failBuild("pop invalid register");
-                }
+            resetAll = (record->opcode >= 0x08 && record->opcode <= 0x0D && record->opcode != 0x0B) || (record->opcode == 0x0F && record->imm12 == 0);
+        }
 
-                freeTokenList(t);
-                emitPopRegister(code, &codePc, rd, &pendingLabels, symbols);
-                continue;
+        if (resetAll)
+        {
+            for (r = 0; r < 32; r++)
+            {
+                known[r] = noCodeRecord;
             }
+        }
+    }
 
-            if (strcmp(mnemonic, "ld") == 0)
-            {
-                TokenList t = splitTokens(p);
-                int rd = -1;
+    for (i = 0; i < code->count; i++)
+    {
+        newIndex[i] = kept;
 
-                if (t.count != 3)
-                {
-                    freeTokenList(t);
-                    fclose(file);
-                    freeUnattachedLabels(&pendingLabels);
-                    failBuild("ld expects ld rd, valueOrLabel");
-                }
+        if (removed[i])
+        {
+            continue;
+        }
 
-                rd = readRegisterNumber(t.items[1]);
-                if (rd < 0)
-                {
-                    freeTokenList(t);
-                    fclose(file);
-                    freeUnattachedLabels(&pendingLabels);
-                    failBuild("ld invalid register");
-                }
+        code->items[kept] = code->items[i];
+        if (code->items[kept].type == recordLoadLabel && code->items[kept].data != 0)
+        {
+            code->items[kept].data = newIndex[code->items[kept].data - 1] + 1;
+        }
 
-                if ((t.items[2][0] == ':' || t.items[2][0] == '@') && t.items[2][1] != '\0')
-                {
-                    addLoadLabelRecord(code, codePc, rd, t.items[2] + 1, &pendingLabels, symbols);
-                    codePc += 48;
-                    freeTokenList(t);
-                    continue;
-                }
+        kept++;
+    }
 
-                {
-                    uint64_t imm = 0;
-                    if (!readUnsigned64(t.items[2], &imm))
-                    {
-                        freeTokenList(t);
-                        fclose(file);
-                        freeUnattachedLabels(&pendingLabels);
-                        failBuild("ld invalid literal");
-                    }
-
-                    freeTokenList(t);
-                    emitLoadImmediate64(code, &codePc, rd, imm, &pendingLabels, symbols);
-                    continue;
-                }
-            }
+    code->count = kept;
 
-            addInstructionText(code, codePc, p, &pendingLabels, symbols);
-            codePc += 4;
+    for (i = 0; i < symbols->count; i++)
+    {
+        if (symbols->items[i].codeRecord != noCodeRecord)
+        {
+            symbols->items[i].codeRecord = newIndex[symbols->items[i].codeRecord];
         }
     }
 
-    fclose(file);
+    free(isTarget);
+    free(removed);
+    free(newIndex);
+    free(query.visited);
+    free(query.stack);
+}
 
-    if (pendingLabels.count != 0)
-    {
-        freeUnattachedLabels(&pendingLabels);
-        failBuild("label at end of file without following instruction/data");
-    }
+/*
+ * Label loads start at the shortest size any label address could need and
+ * only ever grow, so laying out the code and resizing them reaches a fixed
+ * point; a load whose target later needs fewer words is padded instead.
+ * The one-word -O forms stay while their displacement fits.
+ */
+static bool isLabelSequence(const ProgramRecord *record)
+{
+    return record->type == recordLoadLabel || record->type == recordJumpLabel;
+}
 
-    freeUnattachedLabels(&pendingLabels);
+static bool isShortLoad(const ProgramRecord *record)
+{
+    return record->type == recordLoadLabel && record->data != 0 && record->imm12 == 1;
+}
 
-    if (!sawCodeDirective)
+static uint64_t labelAddress(const SymbolTable *symbols, const char *label)
+{
+    uint64_t address = 0;
+
+    if (!findSymbol(symbols, label, &address))
     {
-        failBuild("program must have at least one .code directive");
+        failBuildWithName("ld: undefined label reference %s", label);
     }
 
-    expandLoadLabelRecords(code, symbols);
+    return address;
 }
 
-static uint32_t *assembleProgramWords(const ProgramRecordList *code, const SymbolTable *symbols)
+static void relaxLoadLabelRecords(ProgramRecordList *code, SymbolTable *symbols)
 {
-    uint32_t *words = NULL;
+    bool changed = true;
     size_t i = 0;
 
-    words = (uint32_t *)malloc(sizeof(uint32_t) * code->count);
-    if (words == NULL)
+    while (changed)
     {
-        failBuild("out of memory");
-    }
+        uint64_t pc = programCodeBase;
 
-    for (i = 0; i < code->count; i++)
-    {
-        if (code->items[i].type != recordInstruction)
+        changed = false;
+
+        for (i = 0; i < code->count; i++)
+        {
+            code->items[i].address = pc;
+            pc += isLabelSequence(&code->items[i]) ? 4ULL * code->items[i].imm12 : 4ULL;
+        }
+
+        for (i = 0; i < symbols->count; i++)
+        {
+            if (symbols->items[i].codeRecord != noCodeRecord)
+            {
+                symbols->items[i].address = code->items[symbols->items[i].codeRecord].address;
+            }
+        }
+
+        for (i = 0; i < code->count; i++)
+        {
+            ProgramRecord *record = &code->items[i];
+            uint64_t target = 0;
+            int64_t delta = 0;
+            int words = 0;
+
+            if (!isLabelSequence(record))
+            {
+                continue;
+            }
+
+            target = labelAddress(symbols, record->label);
+
+            if (isShortLoad(record))
+            {
+                delta = (int64_t)(target - labelAddress(symbols, code->items[record->data - 1].label));
+                if (delta >= -4095LL && delta <= 4095LL)
+                {
+                    continue;
+                }
+            }
+
+            if (record->type == recordJumpLabel && record->imm12 == 1)
+            {
+                delta = (int64_t)(target - record->address);
+                if (delta >= -2048LL && delta <= 2047LL)
+                {
+                    continue;
+                }
+            }
+
+            words = loadImmediateWords(target) + ((record->type == recordJumpLabel) ? 1 : 0);
+            if (words > record->imm12)
+            {
+                record->imm12 = (uint16_t)words;
+                changed = true;
+            }
+        }
+    }
+}
+
+static void expandLoadLabelRecords(ProgramRecordList *code, SymbolTable *symbols)
+{
+    ProgramRecordList expanded;
+    size_t loadLabels = 0;
+    size_t i = 0;
+
+    for (i = 0; i < code->count; i++)
+    {
+        if (isLabelSequence(&code->items[i]))
+        {
+            loadLabels++;
+        }
+    }
+
+    if (loadLabels == 0)
+    {
+        return;
+    }
+
+    relaxLoadLabelRecords(code, symbols);
+
+    expanded.count = 0;
+    expanded.capacity = (size_t)((code->items[code->count - 1].address - programCodeBase) / 4ULL) + maxLoadWords + 1;
+    expanded.items = (ProgramRecord *)malloc(expanded.capacity * sizeof(ProgramRecord));
+    if (expanded.items == NULL)
+    {
+        failBuild("out of memory");
+    }
+
+    for (i = 0; i < code->count; i++)
+    {
+        ProgramRecord record = code->items[i];
+        uint64_t target = 0;
+        uint64_t localPc = record.address;
+        size_t first = expanded.count;
+        UnattachedLabels tempPending;
+        SymbolTable tempSymbols;
+
+        if (!isLabelSequence(&record))
+        {
+            appendRecord(&expanded, record);
+            continue;
+        }
+
+        target = labelAddress(symbols, record.label);
+
+        if (isShortLoad(&record))
+        {
+            uint64_t base = labelAddress(symbols, code->items[record.data - 1].label);
+            ProgramRecord step = (target >= base) ? makeInstruction(0x19, record.rd, 0, 0, (uint32_t)(target - base)) : makeInstruction(0x1B, record.rd, 0, 0, (uint32_t)(base - target));
+
+            step.address = localPc;
+            step.origin = record.origin;
+            step.line = record.line;
+            step.file = record.file;
+            appendRecord(&expanded, step);
+            continue;
+        }
+
+        if (record.type == recordJumpLabel && record.imm12 == 1)
+        {
+            ProgramRecord jump = makeInstruction(0x0A, 0, 0, 0, 0);
+
+            jump.label = record.label;
+            jump.address = localPc;
+            jump.origin = record.origin;
+            jump.line = record.line;
+            jump.file = record.file;
+            appendRecord(&expanded, jump);
+            continue;
+        }
+
+        tempPending.names = NULL;
+        tempPending.count = 0;
+        tempPending.capacity = 0;
+
+        tempSymbols = *symbols;
+
+        if (record.type == recordJumpLabel)
+        {
+            emitLoadImmediate(&expanded, &localPc, record.rd, target, record.imm12 - 1, &tempPending, &tempSymbols);
+            addInstructionRecord(&expanded, &localPc, makeInstruction(0x08, record.rd, 0, 0, 0), &tempPending, &tempSymbols);
+        }
+        else
+        {
+            emitLoadImmediate(&expanded, &localPc, record.rd, target, record.imm12, &tempPending, &tempSymbols);
+        }
+
+        for (; first < expanded.count; first++)
+        {
+            expanded.items[first].origin = record.origin;
+            expanded.items[first].line = record.line;
+            expanded.items[first].file = record.file;
+        }
+
+        freeUnattachedLabels(&tempPending);
+    }
+
+    free(code->items);
+    *code = expanded;
+}
+
+typedef struct
+{
+    AssemblyPart currentPart;
+    bool sawCodeDirective;
+    uint64_t codePc;
+    uint64_t dataPc;
+    ProgramRecordList *code;
+    ProgramRecordList *data;
+    SymbolTable *symbols;
+    UnattachedLabels pendingLabels;
+    uint32_t line;
+    uint8_t origin;
+} SourceState;
+
+static void initSourceState(SourceState *state, ProgramRecordList *code, ProgramRecordList *data, SymbolTable *symbols)
+{
+    state->currentPart = partNone;
+    state->sawCodeDirective = false;
+    state->codePc = programCodeBase;
+    state->dataPc = programDataBase;
+    state->code = code;
+    state->data = data;
+    state->symbols = symbols;
+    state->pendingLabels.names = NULL;
+    state->pendingLabels.count = 0;
+    state->pendingLabels.capacity = 0;
+    state->line = 0;
+    state->origin = originInstruction;
+}
+
+static void parseSourceLine(SourceState *state, SourceLine line)
+{
+    const char *p = NULL;
+
+    line = trimSourceLine(line);
+
+    if (line.length == 0)
+    {
+        return;
+    }
+
+    if (lineHasPrefix(line, ".code"))
+    {
+        state->currentPart = partCode;
+        state->sawCodeDirective = true;
+        return;
+    }
+
+    if (lineHasPrefix(line, ".data"))
+    {
+        state->currentPart = partData;
+        return;
+    }
+
+    arenaReset(&lineArena);
+    p = arenaCopyText(&lineArena, line.text, line.length);
+
+    if (p[0] == ':' || p[0] == '@')
+    {
+        addUnattachedLabel(&state->pendingLabels, readLabelDefinition(p));
+        return;
+    }
+
+    if (p[0] != '\t')
+    {
+        failBuild("code/data line must start with tab character");
+    }
+
+    p = skipLeadingWhitespace(p);
+
+    if (*p == '\0')
+    {
+        return;
+    }
+
+    if (state->currentPart == partNone)
+    {
+        failBuild("code/data line before any .code or .data directive");
+    }
+
+    if (state->currentPart == partData)
+    {
+        if ((p[0] == ':' || p[0] == '@') && p[1] != '\0')
+        {
+            addDataLabelReference(state->data, state->dataPc, p + 1, &state->pendingLabels, state->symbols);
+            state->dataPc += 8;
+            return;
+        }
+
+        {
+            uint64_t value = 0;
+            if (!readUnsigned64(p, &value))
+            {
+                failBuild("malformed data item; expected 64-bit unsigned integer");
+            }
+
+            addDataValue(state->data, state->dataPc, value, &state->pendingLabels, state->symbols);
+            state->dataPc += 8;
+            return;
+        }
+    }
+
+    {
+        TokenList tokens = splitTokens(p);
+        char mnemonic[64];
+        const MnemonicInfo *info = NULL;
+        int kind = -1;
+        int i = 0;
+
+        if (tokens.count == 0)
+        {
+            return;
+        }
+
+        for (i = 0; tokens.items[0][i] != '\0'; i++)
+        {
+            tokens.items[0][i] = (char)tolower((unsigned char)tokens.items[0][i]);
+        }
+
+        snprintf(mnemonic, sizeof(mnemonic), "%s", tokens.items[0]);
+
+        enforceCommaStyle(p, mnemonic);
+        info = lookupMnemonic(mnemonic);
+        kind = (info != NULL) ? info->kind : -1;
+
+        if (kind >= pseudoClr)
+        {
+            state->origin = (uint8_t)(originClr + (kind - pseudoClr));
+        }
+
+        if (kind == pseudoClr)
+        {
+            TokenList t = splitTokens(p);
+            int rd = -1;
+
+            if (t.count != 2)
+            {
+                failBuild("clr expects clr rd");
+            }
+
+            rd = readRegisterNumber(t.items[1]);
+            if (rd < 0)
+            {
+                failBuild("clr invalid register");
+            }
+
+            emitClearRegister(state->code, &state->codePc, rd, &state->pendingLabels, state->symbols);
+            return;
+        }
+
+        if (kind == pseudoHalt)
+        {
+            TokenList t = splitTokens(p);
+
+            if (t.count != 1)
+            {
+                failBuild("halt expects no operands");
+            }
+
+            emitHaltInstruction(state->code, &state->codePc, &state->pendingLabels, state->symbols);
+            return;
+        }
+
+        if (kind == pseudoIn)
+        {
+            TokenList t = splitTokens(p);
+            int rd = -1;
+            int rs = -1;
+
+            if (t.count != 3)
+            {
+                failBuild("in expects in rd, rs");
+            }
+
+            rd = readRegisterNumber(t.items[1]);
+            rs = readRegisterNumber(t.items[2]);
+
+            if (rd < 0 || rs < 0)
+            {
+                failBuild("in invalid register");
+            }
+
+            emitInputInstruction(state->code, &state->codePc, rd, rs, &state->pendingLabels, state->symbols);
+            return;
+        }
+
+        if (kind == pseudoOut)
+        {
+            TokenList t = splitTokens(p);
+            int rd = -1;
+            int rs = -1;
+
+            if (t.count != 3)
+            {
+                failBuild("out expects out rd, rs");
+            }
+
+            rd = readRegisterNumber(t.items[1]);
+            rs = readRegisterNumber(t.items[2]);
+
+            if (rd < 0 || rs < 0)
+            {
+                failBuild("out invalid register");
+            }
+
+            emitOutputInstruction(state->code, &state->codePc, rd, rs, &state->pendingLabels, state->symbols);
+            return;
+        }
+
+        if (kind == pseudoPush)
+        {
+            TokenList t = splitTokens(p);
+            int rd = -1;
+
+            if (t.count != 2)
+            {
+                failBuild("push expects push rd");
+            }
+
+            rd = readRegisterNumber(t.items[1]);
+            if (rd < 0)
+            {
+                failBuild("push invalid register");
+            }
+
+            emitPushRegister(state->code, &state->codePc, rd, &state->pendingLabels, state->symbols);
+            return;
+        }
+
+        if (kind == pseudoPop)
+        {
+            TokenList t = splitTokens(p);
+            int rd = -1;
+
+            if (t.count != 2)
+            {
+                failBuild("pop expects pop rd");
+            }
+
+            rd = readRegisterNumber(t.items[1]);
+            if (rd < 0)
+            {
+                failBuild("pop invalid register");
+            }
+
+            emitPopRegister(state->code, &state->codePc, rd, &state->pendingLabels, state->symbols);
+            return;
+        }
+
+        if (kind == pseudoLd)
+        {
+            TokenList t = splitTokens(p);
+            int rd = -1;
+
+            if (t.count != 3)
+            {
+                failBuild("ld expects ld rd, valueOrLabel");
+            }
+
+            rd = readRegisterNumber(t.items[1]);
+            if (rd < 0)
+            {
+                failBuild("ld invalid register");
+            }
+
+            if ((t.items[2][0] == ':' || t.items[2][0] == '@') && t.items[2][1] != '\0')
+            {
+                state->origin = originLoadLabel;
+                addLoadLabelRecord(state->code, &state->codePc, rd, t.items[2] + 1, &state->pendingLabels, state->symbols);
+                return;
+            }
+
+            {
+                uint64_t imm = 0;
+                if (!readUnsigned64(t.items[2], &imm))
+                {
+                    failBuild("ld invalid literal");
+                }
+
+                emitLoadImmediate(state->code, &state->codePc, rd, imm, 0, &state->pendingLabels, state->symbols);
+                return;
+            }
+        }
+
+        addInstructionRecord(state->code, &state->codePc, parseInstruction(p), &state->pendingLabels, state->symbols);
+    }
+}
+
+static void assembleSourceLine(SourceState *state, SourceLine line)
+{
+    size_t first = state->code->count;
+    size_t i = 0;
+
+    state->line++;
+    state->origin = originInstruction;
+    parseSourceLine(state, line);
+
+    for (i = first; i < state->code->count; i++)
+    {
+        state->code->items[i].line = state->line;
+        state->code->items[i].origin = state->origin;
+    }
+}
+
+static bool finishBuild(SourceState *state)
+{
+    if (state->pendingLabels.count != 0)
+    {
+        freeUnattachedLabels(&state->pendingLabels);
+        failBuild("label at end of file without following instruction/data");
+    }
+
+    freeUnattachedLabels(&state->pendingLabels);
+
+    return state->sawCodeDirective;
+}
+
+static void layoutProgram(ProgramRecordList *code, SymbolTable *symbols, bool sawCodeDirective, bool optimize)
+{
+    if (!sawCodeDirective)
+    {
+        failBuild("program must have at least one .code directive");
+    }
+
+    if (optimize)
+    {
+        optimizeLabelBranches(code, symbols);
+    }
+
+    expandLoadLabelRecords(code, symbols);
+}
+
+/*
+ * The whole input is mapped (or read, for pipes and off Linux) and handed
+ * to the line parser as SourceLine views.
+ */
+typedef struct
+{
+    const char *text;
+    size_t size;
+    void *mapping;
+    char *buffer;
+    uint32_t *lineOrigins;
+    size_t lineOriginCount;
+} SourceFile;
+
+static char *readWholeFile(const char *path, size_t *outSize)
+{
+    FILE *file = NULL;
+    char *buffer = NULL;
+    size_t size = 0;
+    size_t capacity = 1u << 16;
+
+    file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        failBuildWithName("cannot open input file %s", path);
+    }
+
+    buffer = (char *)malloc(capacity);
+    while (buffer != NULL)
+    {
+        char *bigger = NULL;
+
+        size += fread(buffer + size, 1, capacity - size, file);
+        if (size < capacity)
+        {
+            break;
+        }
+
+        capacity *= 2;
+        bigger = (char *)realloc(buffer, capacity);
+        if (bigger == NULL)
+        {
+            free(buffer);
+        }
+
+        buffer = bigger;
+    }
+
+    fclose(file);
+
+    if (buffer == NULL)
+    {
+        failBuild("out of memory");
+    }
+
+    *outSize = size;
+    return buffer;
+}
+
+static void openSourceFile(const char *path, SourceFile *source)
+{
+#if TINKER_MAPPED_SOURCE
+    struct stat info;
+    int fd = open(path, O_RDONLY);
+
+    if (fd >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+    {
+        void *mapping = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (mapping != MAP_FAILED)
+        {
+            madvise(mapping, (size_t)info.st_size, MADV_SEQUENTIAL);
+            close(fd);
+
+            source->text = (const char *)mapping;
+            source->size = (size_t)info.st_size;
+            source->mapping = mapping;
+            source->buffer = NULL;
+            source->lineOrigins = NULL;
+            source->lineOriginCount = 0;
+            return;
+        }
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+#endif
+
+    source->buffer = readWholeFile(path, &source->size);
+    source->text = source->buffer;
+    source->mapping = NULL;
+    source->lineOrigins = NULL;
+    source->lineOriginCount = 0;
+}
+
+static void closeSourceFile(SourceFile *source)
+{
+#if TINKER_MAPPED_SOURCE
+    if (source->mapping != NULL)
+    {
+        munmap(source->mapping, source->size);
+    }
+#endif
+
+    free(source->buffer);
+    free(source->lineOrigins);
+    source->text = NULL;
+    source->mapping = NULL;
+    source->buffer = NULL;
+    source->lineOrigins = NULL;
+    source->lineOriginCount = 0;
+}
+
+/*
+ * .macro name params ... .endm, .rept N ... .endr and .irp param, values
+ * ... .endr are expanded as text before parsing, so -j chunks and the
+ * cache only ever see plain source. Bodies name parameters as \param and
+ * the expansion number as \@. A label defined inside a body becomes
+ * name..N in expansion N, and references to it in the same body follow.
+ * Every expanded line remembers the source line it came from for --map.
+ */
+typedef struct
+{
+    char *text;
+    size_t length;
+    size_t capacity;
+} TextBuffer;
+
+typedef struct
+{
+    TextBuffer text;
+    uint32_t *lines;
+    size_t lineCount;
+    size_t lineCapacity;
+} ExpandedText;
+
+typedef struct
+{
+    char **params;
+    int paramCount;
+    const char *body;
+    size_t bodyLength;
+} MacroDefinition;
+
+/*
+ * A .rept may not repeat more often than the code segment has words, and
+ * all expansions together may not produce more than maxExpandedBytes of
+ * text, so nested repeats fail instead of exhausting memory.
+ */
+enum
+{
+    maxMacroDepth = 64,
+    maxRepeatCount = (int)((0x10000 - 0x2000) / 4),
+    maxExpandedBytes = 64 << 20
+};
+
+/* Scratch buffers are reused across expansions, one instance per depth. */
+typedef struct
+{
+    MacroDefinition *items;
+    size_t count;
+    size_t capacity;
+    SymbolTable names;
+    uint64_t expansions;
+    uint64_t expandedBytes;
+    uint32_t line;
+    TextBuffer instances[maxMacroDepth];
+    TextBuffer substituted;
+    SourceLine *labels;
+    size_t labelCapacity;
+} MacroTable;
+
+static void appendText(TextBuffer *buffer, const char *text, size_t length)
+{
+    if (buffer->length + length + 1 > buffer->capacity)
+    {
+        size_t newCapacity = (buffer->capacity == 0) ? 4096 : buffer->capacity;
+        char *bigger = NULL;
+
+        while (buffer->length + length + 1 > newCapacity)
+        {
+            newCapacity *= 2;
+        }
+
+        bigger = (char *)realloc(buffer->text, newCapacity);
+        if (bigger == NULL)
+        {
+            failBuild("out of memory");
+        }
+
+        buffer->text = bigger;
+        buffer->capacity = newCapacity;
+    }
+
+    memcpy(buffer->text + buffer->length, text, length);
+    buffer->length += length;
+    buffer->text[buffer->length] = '\0';
+}
+
+static bool isDirectiveLine(SourceLine line, const char *name)
+{
+    size_t length = strlen(name);
+
+    return lineHasPrefix(line, name) && (line.length == length || isspace((unsigned char)line.text[length]));
+}
+
+static bool isMacroDirective(SourceLine line)
+{
+    return isDirectiveLine(line, ".macro") || isDirectiveLine(line, ".rept") || isDirectiveLine(line, ".irp") || isDirectiveLine(line, ".endm") ||
+           isDirectiveLine(line, ".endr");
+}
+
+static size_t labelNameLength(const char *text, size_t length)
+{
+    size_t i = 0;
+
+    while (i < length && (isalnum((unsigned char)text[i]) || text[i] == '_' || text[i] == '.'))
+    {
+        i++;
+    }
+
+    return i;
+}
+
+static void appendExpandedLine(ExpandedText *out, SourceLine line, uint32_t sourceLine)
+{
+    if (out->lineCount == out->lineCapacity)
+    {
+        size_t newCapacity = (out->lineCapacity == 0) ? 1024 : out->lineCapacity * 2;
+        uint32_t *bigger = (uint32_t *)realloc(out->lines, newCapacity * sizeof(uint32_t));
+
+        if (bigger == NULL)
+        {
+            failBuild("out of memory");
+        }
+
+        out->lines = bigger;
+        out->lineCapacity = newCapacity;
+    }
+
+    appendText(&out->text, line.text, line.length);
+    appendText(&out->text, "\n", 1);
+    out->lines[out->lineCount] = sourceLine;
+    out->lineCount++;
+}
+
+/* Finds the .endm or matching .endr of a body starting at *cursor. */
+static const char *findBodyEnd(const char **cursor, const char *end, bool isMacro, uint32_t *lines)
+{
+    int depth = 0;
+
+    while (*cursor < end)
+    {
+        const char *lineStart = *cursor;
+        SourceLine line;
+
+        nextSourceLine(cursor, end, &line);
+        line = trimSourceLine(line);
+        (*lines)++;
+
+        if (isMacro && isDirectiveLine(line, ".macro"))
+        {
+            failBuild("nested .macro definition");
+        }
+
+        if (isMacro && isDirectiveLine(line, ".endm"))
+        {
+            return lineStart;
+        }
+
+        if (!isMacro && (isDirectiveLine(line, ".rept") || isDirectiveLine(line, ".irp")))
+        {
+            depth++;
+        }
+        else if (!isMacro && isDirectiveLine(line, ".endr"))
+        {
+            if (depth == 0)
+            {
+                return lineStart;
+            }
+
+            depth--;
+        }
+    }
+
+    failBuild(isMacro ? ".macro without .endm" : ".rept/.irp without .endr");
+    return end;
+}
+
+static void substituteParams(TextBuffer *out, const char *body, size_t length, char **names, char **values, int count, uint64_t expansion)
+{
+    size_t i = 0;
+
+    while (i < length)
+    {
+        const char *slash = (const char *)memchr(body + i, '\\', length - i);
+        size_t nameLength = 0;
+        int p = 0;
+
+        if (slash == NULL)
+        {
+            appendText(out, body + i, length - i);
+            return;
+        }
+
+        appendText(out, body + i, (size_t)(slash - (body + i)));
+        i = (size_t)(slash - body) + 1;
+
+        if (i < length && body[i] == '@')
+        {
+            char number[24];
+
+            snprintf(number, sizeof(number), "%llu", (unsigned long long)expansion);
+            appendText(out, number, strlen(number));
+            i++;
+            continue;
+        }
+
+        nameLength = labelNameLength(body + i, length - i);
+        for (p = 0; p < count; p++)
+        {
+            if (strlen(names[p]) == nameLength && memcmp(names[p], body + i, nameLength) == 0)
+            {
+                break;
+            }
+        }
+
+        if (nameLength == 0 || p == count)
+        {
+            appendText(out, "\\", 1);
+            continue;
+        }
+
+        appendText(out, values[p], strlen(values[p]));
+        i += nameLength;
+    }
+}
+
+static bool isLocalLabel(const SourceLine *labels, size_t labelCount, const char *name, size_t length)
+{
+    size_t i = 0;
+
+    for (i = 0; i < labelCount; i++)
+    {
+        if (labels[i].length == length && memcmp(labels[i].text, name, length) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void instantiateBody(MacroTable *macros, TextBuffer *out, const char *body, size_t length, char **names, char **values, int count, uint64_t expansion)
+{
+    TextBuffer *substituted = &macros->substituted;
+    size_t labelCount = 0;
+    const char *cursor = NULL;
+    const char *end = NULL;
+    char suffix[32];
+    size_t i = 0;
+
+    substituted->length = 0;
+    substituteParams(substituted, body, length, names, values, count, expansion);
+    if (substituted->length == 0)
+    {
+        return;
+    }
+
+    cursor = substituted->text;
+    end = substituted->text + substituted->length;
+    while (cursor < end)
+    {
+        SourceLine line;
+
+        nextSourceLine(&cursor, end, &line);
+        if (line.length > 1 && (line.text[0] == ':' || line.text[0] == '@'))
+        {
+            if (labelCount == macros->labelCapacity)
+            {
+                size_t newCapacity = (macros->labelCapacity == 0) ? 16 : macros->labelCapacity * 2;
+                SourceLine *bigger = (SourceLine *)realloc(macros->labels, newCapacity * sizeof(SourceLine));
+
+                if (bigger == NULL)
+                {
+                    failBuild("out of memory");
+                }
+
+                macros->labels = bigger;
+                macros->labelCapacity = newCapacity;
+            }
+
+            macros->labels[labelCount].text = line.text + 1;
+            macros->labels[labelCount].length = labelNameLength(line.text + 1, line.length - 1);
+            labelCount++;
+        }
+    }
+
+    if (labelCount == 0)
+    {
+        appendText(out, substituted->text, substituted->length);
+        return;
+    }
+
+    snprintf(suffix, sizeof(suffix), "..%llu", (unsigned long long)expansion);
+
+    while (i < substituted->length)
+    {
+        size_t nameLength = 0;
+        char c = substituted->text[i];
+
+        appendText(out, &c, 1);
+        i++;
+
+        if (c != ':' && c != '@')
+        {
+            continue;
+        }
+
+        nameLength = labelNameLength(substituted->text + i, substituted->length - i);
+        appendText(out, substituted->text + i, nameLength);
+        if (isLocalLabel(macros->labels, labelCount, substituted->text + i, nameLength))
+        {
+            appendText(out, suffix, strlen(suffix));
+        }
+
+        i += nameLength;
+    }
+}
+
+static void expandMacroText(MacroTable *macros, ExpandedText *out, const char *text, size_t size, int depth, uint32_t line);
+
+static void expandInstance(MacroTable *macros, ExpandedText *out, const char *body, size_t length, char **names, char **values, int count, int depth, uint32_t line)
+{
+    TextBuffer *instance = NULL;
+
+    if (depth >= maxMacroDepth)
+    {
+        failBuild("macro expansion nested too deeply");
+    }
+
+    instance = &macros->instances[depth];
+    instance->length = 0;
+    macros->expansions++;
+    instantiateBody(macros, instance, body, length, names, values, count, macros->expansions);
+
+    macros->expandedBytes += instance->length;
+    if (macros->expandedBytes > maxExpandedBytes)
+    {
+        failBuild("macro expansion too large");
+    }
+
+    expandMacroText(macros, out, instance->text, instance->length, depth + 1, line);
+}
+
+static void defineMacro(MacroTable *macros, const char *directive, const char *body, size_t bodyLength)
+{
+    TokenList tokens = splitTokensIn(&assemblyArena, directive);
+    MacroDefinition *definition = NULL;
+
+    if (tokens.count < 2 || labelNameLength(tokens.items[1], strlen(tokens.items[1])) != strlen(tokens.items[1]))
+    {
+        failBuild(".macro expects a name");
+    }
+
+    if (lookupSymbol(&macros->names, tokens.items[1]) != NULL)
+    {
+        failBuildWithName("duplicate macro %s", tokens.items[1]);
+    }
+
+    if (macros->count == macros->capacity)
+    {
+        size_t newCapacity = (macros->capacity == 0) ? 16 : macros->capacity * 2;
+        MacroDefinition *bigger = (MacroDefinition *)realloc(macros->items, newCapacity * sizeof(MacroDefinition));
+
+        if (bigger == NULL)
+        {
+            failBuild("out of memory");
+        }
+
+        macros->items = bigger;
+        macros->capacity = newCapacity;
+    }
+
+    definition = &macros->items[macros->count];
+    definition->params = tokens.items + 2;
+    definition->paramCount = tokens.count - 2;
+    definition->body = arenaCopyText(&assemblyArena, body, bodyLength);
+    definition->bodyLength = bodyLength;
+
+    addSymbol(&macros->names, tokens.items[1], macros->count, noCodeRecord);
+    macros->count++;
+}
+
+static void expandRepetition(MacroTable *macros, ExpandedText *out, const char *directive, const char *body, size_t bodyLength, int depth, uint32_t line)
+{
+    TokenList tokens = splitTokensIn(&assemblyArena, directive);
+    uint64_t repeat = 0;
+    uint64_t i = 0;
+
+    if (strcmp(tokens.items[0], ".rept") == 0)
+    {
+        if (tokens.count != 2 || !isdigit((unsigned char)tokens.items[1][0]) || !readUnsigned64(tokens.items[1], &repeat))
+        {
+            failBuild(".rept expects a count");
+        }
+
+        if (repeat > maxRepeatCount)
+        {
+            failBuild(".rept count too large");
+        }
+
+        for (i = 0; i < repeat; i++)
+        {
+            expandInstance(macros, out, body, bodyLength, NULL, NULL, 0, depth, line);
+        }
+
+        return;
+    }
+
+    if (tokens.count < 2)
+    {
+        failBuild(".irp expects a parameter and values");
+    }
+
+    for (i = 2; i < (uint64_t)tokens.count; i++)
+    {
+        expandInstance(macros, out, body, bodyLength, &tokens.items[1], &tokens.items[i], 1, depth, line);
+    }
+}
+
+/*
+ * At depth 0 line counts the source lines as they are read; inside an
+ * expansion it stays the line of the directive or call being expanded.
+ */
+static void expandMacroText(MacroTable *macros, ExpandedText *out, const char *text, size_t size, int depth, uint32_t line)
+{
+    const char *cursor = text;
+    const char *end = text + size;
+
+    while (cursor < end)
+    {
+        uint32_t sourceLine = line;
+        SourceLine raw;
+        SourceLine trimmed;
+
+        nextSourceLine(&cursor, end, &raw);
+        trimmed = trimSourceLine(raw);
+        if (depth == 0)
+        {
+            line++;
+        }
+
+        macros->line = sourceLine;
+
+        if (isDirectiveLine(trimmed, ".macro") || isDirectiveLine(trimmed, ".rept") || isDirectiveLine(trimmed, ".irp"))
+        {
+            const char *directive = arenaCopyText(&assemblyArena, trimmed.text, trimmed.length);
+            const char *body = cursor;
+            const char *bodyEnd = NULL;
+            uint32_t bodyLines = 0;
+
+            bodyEnd = findBodyEnd(&cursor, end, directive[1] == 'm', &bodyLines);
+            if (depth == 0)
+            {
+                line += bodyLines;
+            }
+
+            if (directive[1] == 'm')
+            {
+                defineMacro(macros, directive, body, (size_t)(bodyEnd - body));
+            }
+            else
+            {
+                expandRepetition(macros, out, directive, body, (size_t)(bodyEnd - body), depth, sourceLine);
+            }
+
+            continue;
+        }
+
+        if (isDirectiveLine(trimmed, ".endm") || isDirectiveLine(trimmed, ".endr"))
+        {
+            failBuild(isDirectiveLine(trimmed, ".endm") ? ".endm without .macro" : ".endr without .rept/.irp");
+        }
+
+        if (macros->count != 0 && trimmed.length > 1 && trimmed.text[0] == '\t')
+        {
+            const Symbol *macro = NULL;
+            TokenList tokens;
+
+            arenaReset(&lineArena);
+            tokens = splitTokens(arenaCopyText(&lineArena, trimmed.text, trimmed.length));
+            macro = (tokens.count != 0) ? lookupSymbol(&macros->names, tokens.items[0]) : NULL;
+
+            if (macro != NULL)
+            {
+                const MacroDefinition *definition = &macros->items[macro->address];
+
+                if (tokens.count - 1 != definition->paramCount)
+                {
+                    failBuildWithName("wrong number of arguments to macro %s", tokens.items[0]);
+                }
+
+                expandInstance(macros, out, definition->body, definition->bodyLength, definition->params, tokens.items + 1, definition->paramCount, depth, sourceLine);
+                continue;
+            }
+        }
+
+        appendExpandedLine(out, raw, sourceLine);
+    }
+}
+
+typedef struct
+{
+    MacroTable macros;
+    ExpandedText out;
+    BuildFailure failure;
+} MacroExpansion;
+
+static void freeMacroTable(MacroTable *macros)
+{
+    int depth = 0;
+
+    for (depth = 0; depth < maxMacroDepth; depth++)
+    {
+        free(macros->instances[depth].text);
+    }
+
+    free(macros->items);
+    free(macros->substituted.text);
+    free(macros->labels);
+    freeSymbolTable(&macros->names);
+}
+
+static void expandFromLine(MacroExpansion *expansion, const char *text, const char *first, const char *end)
+{
+    const char *cursor = text;
+    uint32_t line = 0;
+
+    while (cursor < first)
+    {
+        SourceLine raw;
+
+        nextSourceLine(&cursor, first, &raw);
+        line++;
+        appendExpandedLine(&expansion->out, raw, line);
+    }
+
+    expandMacroText(&expansion->macros, &expansion->out, first, (size_t)(end - first), 0, line + 1);
+}
+
+static const char *findFirstMacroLine(const char *text, size_t size)
+{
+    const char *cursor = text;
+    const char *end = text + size;
+
+    while (cursor < end)
+    {
+        const char *lineStart = cursor;
+        SourceLine raw;
+
+        nextSourceLine(&cursor, end, &raw);
+        if (raw.length != 0 && raw.text[0] == '.' && isMacroDirective(trimSourceLine(raw)))
+        {
+            return lineStart;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Expansion catches its own failures to free the partial output before
+ * passing the error on, so a libtinkerasm build does not leak it.
+ */
+static void expandSourceFrom(SourceFile *source, const char *first)
+{
+    MacroExpansion *expansion = NULL;
+    BuildFailure *outerFailure = buildFailure;
+
+    expansion = (MacroExpansion *)calloc(1, sizeof(MacroExpansion));
+    if (expansion == NULL)
+    {
+        failBuild("out of memory");
+    }
+
+    buildFailure = &expansion->failure;
+    if (setjmp(expansion->failure.jump) != 0)
+    {
+        char *message = expansion->failure.message;
+
+        buildFailure = outerFailure;
+        if (outerFailure != NULL)
+        {
+            outerFailure->line = expansion->macros.line;
+        }
+
+        freeMacroTable(&expansion->macros);
+        free(expansion->out.text.text);
+        free(expansion->out.lines);
+        free(expansion);
+        passBuildFailure(message);
+    }
+
+    expandFromLine(expansion, source->text, first, source->text + source->size);
+    buildFailure = outerFailure;
+
+    freeMacroTable(&expansion->macros);
+    closeSourceFile(source);
+
+    source->buffer = expansion->out.text.text;
+    source->text = expansion->out.text.text;
+    source->size = expansion->out.text.length;
+    source->lineOrigins = expansion->out.lines;
+    source->lineOriginCount = expansion->out.lineCount;
+    free(expansion);
+}
+
+/*
+ * Replaces the source text with its expansion when any line is a macro
+ * directive; other sources are parsed straight from the mapping.
+ */
+static void expandSourceMacros(SourceFile *source)
+{
+    const char *first = findFirstMacroLine(source->text, source->size);
+
+    if (first != NULL)
+    {
+        expandSourceFrom(source, first);
+    }
+}
+
+static void mapExpandedLines(ProgramRecordList *code, const SourceFile *source)
+{
+    size_t i = 0;
+
+    for (i = 0; source->lineOrigins != NULL && i < code->count; i++)
+    {
+        if (code->items[i].line >= 1 && code->items[i].line <= source->lineOriginCount)
+        {
+            code->items[i].line = source->lineOrigins[code->items[i].line - 1];
+        }
+    }
+}
+
+static void openAssemblySource(const char *path, SourceFile *source)
+{
+    openSourceFile(path, source);
+    expandSourceMacros(source);
+}
+
+/*
+ * -j N splits the source into N chunks at line boundaries. Each chunk is
+ * parsed on its own thread with chunk-relative addresses and its own symbol
+ * table, then the chunks are stitched together in order: addresses are
+ * offset by the sizes of the chunks before them, labels left pending at a
+ * chunk's end attach to the next chunk's first record, and the first error
+ * in source order is the one reported. With --cache-dir the chunks are cut
+ * by content instead, so an edit only changes the chunk it falls in.
+ */
+typedef struct
+{
+    const char *begin;
+    const char *end;
+    const char *cacheDir;
+    const char *objectPath;
+    const char *sourceName;
+    uint64_t hashA;
+    uint64_t hashB;
+    AssemblyPart startPart;
+    AssemblyPart firstPart;
+    uint32_t startLine;
+    uint16_t file;
+    bool sawCodeDirective;
+    bool failed;
+    uint64_t codeBytes;
+    uint64_t dataBytes;
+    ProgramRecordList code;
+    ProgramRecordList data;
+    SymbolTable symbols;
+    UnattachedLabels pendingLabels;
+    Arena arena;
+    BuildFailure failure;
+} SourceChunk;
+
+typedef struct
+{
+    void *(*worker)(void *);
+    unsigned char *items;
+    size_t itemBytes;
+    int count;
+    int first;
+    int stride;
+} WorkerStripe;
+
+static void *runWorkerStripe(void *argument)
+{
+    WorkerStripe *stripe = (WorkerStripe *)argument;
+    int i = 0;
+
+    for (i = stripe->first; i < stripe->count; i += stripe->stride)
+    {
+        stripe->worker(stripe->items + (size_t)i * stripe->itemBytes);
+    }
+
+    return NULL;
+}
+
+/* Runs worker over count items, item i on thread i % threadCount. */
+static void runWorkers(void *(*worker)(void *), void *items, size_t itemBytes, int count, int threadCount)
+{
+    WorkerStripe *stripes = NULL;
+    int i = 0;
+
+    if (threadCount > count)
+    {
+        threadCount = count;
+    }
+
+    if (threadCount < 1)
+    {
+        return;
+    }
+
+    stripes = (WorkerStripe *)calloc((size_t)threadCount, sizeof(WorkerStripe));
+    if (stripes == NULL)
+    {
+        failBuild("out of memory");
+    }
+
+    for (i = 0; i < threadCount; i++)
+    {
+        stripes[i].worker = worker;
+        stripes[i].items = (unsigned char *)items;
+        stripes[i].itemBytes = itemBytes;
+        stripes[i].count = count;
+        stripes[i].first = i;
+        stripes[i].stride = threadCount;
+    }
+
+#if TINKER_THREADS
+    {
+        pthread_t *threads = (pthread_t *)calloc((size_t)threadCount, sizeof(pthread_t));
+        bool *started = (bool *)calloc((size_t)threadCount, sizeof(bool));
+
+        if (threads == NULL || started == NULL)
+        {
+            failBuild("out of memory");
+        }
+
+        for (i = 1; i < threadCount; i++)
+        {
+            started[i] = pthread_create(&threads[i], NULL, runWorkerStripe, &stripes[i]) == 0;
+        }
+
+        runWorkerStripe(&stripes[0]);
+
+        for (i = 1; i < threadCount; i++)
+        {
+            if (started[i])
+            {
+                pthread_join(threads[i], NULL);
+            }
+            else
+            {
+                runWorkerStripe(&stripes[i]);
+            }
+        }
+
+        free(threads);
+        free(started);
+    }
+#else
+    for (i = 0; i < threadCount; i++)
+    {
+        runWorkerStripe(&stripes[i]);
+    }
+#endif
+
+    free(stripes);
+}
+
+/*
+ * --cache-dir keeps each chunk's parse result on disk, keyed by a 128-bit
+ * hash of the chunk text and the section it starts in. Chunk results hold
+ * chunk-relative addresses and unresolved label names, so a cached chunk
+ * is reused wherever it lands in the file; merging, relaxation and
+ * encoding always rerun. Chunks that fail to parse are never cached. A
+ * file ends with a hash of everything before it, so a truncated or
+ * damaged file is re-parsed rather than trusted.
+ */
+static const uint64_t chunkCacheMagic = 0x31454843414B5454ULL;
+static const uint64_t chunkCacheVersion = 3;
+
+enum
+{
+    chunkCacheHeaderWords = 15,
+    cachedRecordBytes = 32,
+    cachedSymbolBytes = 20
+};
+
+static uint64_t mixHash(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDULL;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+static void hashChunkText(const char *text, size_t length, uint64_t seed, uint64_t *outA, uint64_t *outB)
+{
+    uint64_t a = mixHash(seed ^ (uint64_t)length);
+    uint64_t b = mixHash(a ^ 0x9E3779B97F4A7C15ULL);
+    size_t i = 0;
+
+    for (i = 0; i + 8 <= length; i += 8)
+    {
+        uint64_t word = 0;
+
+        memcpy(&word, text + i, 8);
+        a = (a ^ word) * 0x9E3779B97F4A7C15ULL;
+        a ^= a >> 29;
+        b = (b + word) * 0xD6E8FEB86659FD93ULL;
+        b ^= b >> 32;
+    }
+
+    for (; i < length; i++)
+    {
+        a = (a ^ (unsigned char)text[i]) * 0x100000001B3ULL;
+        b = (b + (unsigned char)text[i]) * 0xD6E8FEB86659FD93ULL;
+    }
+
+    *outA = mixHash(a ^ (b >> 1));
+    *outB = mixHash(b ^ (a << 1));
+}
+
+static void hashCachedChunk(const unsigned char *header, const unsigned char *body, uint64_t bodyBytes, uint64_t *outA, uint64_t *outB)
+{
+    uint64_t a = 0;
+    uint64_t b = 0;
+
+    hashChunkText((const char *)header, chunkCacheHeaderWords * 8, chunkCacheMagic, &a, &b);
+    hashChunkText((const char *)body, (size_t)bodyBytes, a ^ b, outA, outB);
+}
+
+static uint64_t readU64At(const unsigned char *bytes)
+{
+    uint64_t value = 0;
+    int i = 0;
+
+    for (i = 7; i >= 0; i--)
+    {
+        value = (value << 8) | bytes[i];
+    }
+
+    return value;
+}
+
+static uint32_t readU32At(const unsigned char *bytes)
+{
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static void chunkCachePath(const SourceChunk *chunk, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%016llx%016llx.tkc", chunk->cacheDir, (unsigned long long)chunk->hashA, (unsigned long long)chunk->hashB);
+}
+
+static bool cachedText(const char *strings, uint64_t stringBytes, uint32_t offset, const char **outText)
+{
+    if (offset == 0)
+    {
+        *outText = NULL;
+        return true;
+    }
+
+    if (offset > stringBytes)
+    {
+        return false;
+    }
+
+    *outText = strings + offset - 1;
+    return true;
+}
+
+static bool decodeCachedRecords(const unsigned char *at, uint64_t count, const char *strings, uint64_t stringBytes, ProgramRecordList *list)
+{
+    uint64_t i = 0;
+
+    list->items = (ProgramRecord *)malloc((size_t)(count != 0 ? count : 1) * sizeof(ProgramRecord));
+    list->count = 0;
+    list->capacity = (size_t)(count != 0 ? count : 1);
+    if (list->items == NULL)
+    {
+        failBuild("out of memory");
+    }
+
+    for (i = 0; i < count; i++, at += cachedRecordBytes)
+    {
+        ProgramRecord *record = &list->items[i];
+        uint32_t fields = readU32At(at);
+        uint32_t operands = readU32At(at + 4);
+
+        memset(record, 0, sizeof(*record));
+        record->type = (uint8_t)fields;
+        record->opcode = (uint8_t)(fields >> 8);
+        record->rd = (uint8_t)(fields >> 16);
+        record->rs = (uint8_t)(fields >> 24);
+        record->rt = (uint8_t)operands;
+        record->imm12 = (uint16_t)(operands >> 8);
+        record->origin = (uint8_t)(operands >> 24);
+        record->address = readU64At(at + 12);
+        record->data = readU64At(at + 20);
+        record->line = readU32At(at + 28);
+
+        if (record->origin >= originCount)
+        {
+            return false;
+        }
+
+        if (!cachedText(strings, stringBytes, readU32At(at + 8), &record->label))
+        {
+            return false;
+        }
+
+        list->count++;
+    }
+
+    return true;
+}
+
+static bool loadCachedChunk(SourceChunk *chunk)
+{
+    char path[4096];
+    FILE *file = NULL;
+    unsigned char headerBytes[chunkCacheHeaderWords * 8];
+    unsigned char *bytes = NULL;
+    uint64_t header[chunkCacheHeaderWords];
+    uint64_t checkA = 0;
+    uint64_t checkB = 0;
+    uint64_t recordCount = 0;
+    uint64_t bodyBytes = 0;
+    const unsigned char *at = NULL;
+    char *strings = NULL;
+    bool ok = false;
+    uint64_t i = 0;
+    int w = 0;
+
+    chunkCachePath(chunk, path, sizeof(path));
+    file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    if (fread(headerBytes, 8, chunkCacheHeaderWords, file) != chunkCacheHeaderWords)
+    {
+        fclose(file);
+        return false;
+    }
+
+    for (w = 0; w < chunkCacheHeaderWords; w++)
+    {
+        header[w] = readU64At(headerBytes + 8 * w);
+    }
+
+    recordCount = header[10] + header[11];
+    if (header[0] != chunkCacheMagic || header[1] != chunkCacheVersion || header[2] != (uint64_t)(chunk->end - chunk->begin) ||
+        header[3] != chunk->hashA || header[4] != chunk->hashB || header[9] != (uint64_t)chunk->startPart || recordCount > (1ULL << 32) || header[12] > (1ULL << 32) ||
+        header[13] > (1ULL << 32) || header[14] > (1ULL << 36) || header[14] == 0)
+    {
+        fclose(file);
+        return false;
+    }
+
+    bodyBytes = recordCount * cachedRecordBytes + header[12] * cachedSymbolBytes + header[13] * 4 + header[14];
+    bytes = (unsigned char *)malloc((size_t)bodyBytes + 16);
+    if (bytes == NULL || fread(bytes, 1, (size_t)bodyBytes + 16, file) != bodyBytes + 16 || fgetc(file) != EOF)
+    {
+        free(bytes);
+        fclose(file);
+        return false;
+    }
+
+    fclose(file);
+
+    hashCachedChunk(headerBytes, bytes, bodyBytes, &checkA, &checkB);
+    if (readU64At(bytes + bodyBytes) != checkA || readU64At(bytes + bodyBytes + 8) != checkB)
+    {
+        free(bytes);
+        return false;
+    }
+
+    strings = (char *)arenaAllocate(&assemblyArena, (size_t)header[14]);
+    memcpy(strings, bytes + bodyBytes - header[14], (size_t)header[14]);
+    if (strings[header[14] - 1] != '\0')
+    {
+        free(bytes);
+        return false;
+    }
+
+    at = bytes;
+    ok = decodeCachedRecords(at, header[10], strings, header[14], &chunk->code);
+    at += header[10] * cachedRecordBytes;
+    ok = ok && decodeCachedRecords(at, header[11], strings, header[14], &chunk->data);
+    at += header[11] * cachedRecordBytes;
+
+    chunk->symbols.items = (Symbol *)calloc((size_t)header[12] + 1, sizeof(Symbol));
+    if (chunk->symbols.items == NULL)
+    {
+        failBuild("out of memory");
+    }
+
+    chunk->symbols.capacity = (size_t)header[12] + 1;
+    for (i = 0; ok && i < header[12]; i++, at += cachedSymbolBytes)
+    {
+        Symbol *symbol = &chunk->symbols.items[i];
+        uint64_t codeRecord = readU64At(at + 12);
+
+        ok = cachedText(strings, header[14], readU32At(at), &symbol->name) && symbol->name != NULL;
+        symbol->address = readU64At(at + 4);
+        symbol->codeRecord = (codeRecord == UINT64_MAX) ? noCodeRecord : (size_t)codeRecord;
+        ok = ok && (symbol->codeRecord == noCodeRecord || symbol->codeRecord < chunk->code.count);
+        chunk->symbols.count++;
+    }
+
+    for (i = 0; ok && i < header[13]; i++, at += 4)
+    {
+        const char *name = NULL;
+
+        ok = cachedText(strings, header[14], readU32At(at), &name) && name != NULL;
+        if (ok)
+        {
+            addUnattachedLabel(&chunk->pendingLabels, name);
+        }
+    }
+
+    free(bytes);
+
+    if (!ok || header[5] > partData || (header[5] == partNone && recordCount != 0))
+    {
+        freeRecordList(&chunk->code);
+        freeRecordList(&chunk->data);
+        freeSymbolTable(&chunk->symbols);
+        freeUnattachedLabels(&chunk->pendingLabels);
+        return false;
+    }
+
+    chunk->firstPart = (AssemblyPart)header[5];
+    chunk->sawCodeDirective = header[6] != 0;
+    chunk->codeBytes = header[7];
+    chunk->dataBytes = header[8];
+
+    return true;
+}
+
+static uint32_t cachedStringOffset(const char *text, uint64_t *nextOffset)
+{
+    uint32_t offset = 0;
+
+    if (text == NULL)
+    {
+        return 0;
+    }
+
+    offset = (uint32_t)(*nextOffset + 1);
+    *nextOffset += strlen(text) + 1;
+    return offset;
+}
+
+static void writeCachedRecords(FILE *file, const ProgramRecordList *list, uint64_t *nextOffset)
+{
+    size_t i = 0;
+
+    for (i = 0; i < list->count; i++)
+    {
+        const ProgramRecord *record = &list->items[i];
+
+        writeU32LittleEndian(file, (uint32_t)record->type | ((uint32_t)record->opcode << 8) | ((uint32_t)record->rd << 16) | ((uint32_t)record->rs << 24));
+        writeU32LittleEndian(file, (uint32_t)record->rt | ((uint32_t)record->imm12 << 8) | ((uint32_t)record->origin << 24));
+        writeU32LittleEndian(file, cachedStringOffset(record->label, nextOffset));
+        writeU64LittleEndian(file, record->address);
+        writeU64LittleEndian(file, record->data);
+        writeU32LittleEndian(file, record->line);
+    }
+}
+
+static void writeCachedStrings(FILE *file, const ProgramRecordList *list)
+{
+    size_t i = 0;
+
+    for (i = 0; i < list->count; i++)
+    {
+        if (list->items[i].label != NULL)
+        {
+            fwrite(list->items[i].label, 1, strlen(list->items[i].label) + 1, file);
+        }
+    }
+}
+
+/* Reads the file written so far back and appends its hash. */
+static void appendChunkChecksum(FILE *file)
+{
+    unsigned char headerBytes[chunkCacheHeaderWords * 8];
+    unsigned char *body = NULL;
+    long end = 0;
+    uint64_t bodyBytes = 0;
+    uint64_t checkA = 0;
+    uint64_t checkB = 0;
+
+    if (fflush(file) != 0 || (end = ftell(file)) < (long)sizeof(headerBytes) || fseek(file, 0, SEEK_SET) != 0)
+    {
+        failBuild("cannot write cache file");
+    }
+
+    bodyBytes = (uint64_t)end - sizeof(headerBytes);
+    body = (unsigned char *)malloc((size_t)bodyBytes + 1);
+    if (body == NULL || fread(headerBytes, 1, sizeof(headerBytes), file) != sizeof(headerBytes) || fread(body, 1, (size_t)bodyBytes, file) != bodyBytes)
+    {
+        free(body);
+        failBuild("cannot write cache file");
+    }
+
+    hashCachedChunk(headerBytes, body, bodyBytes, &checkA, &checkB);
+    free(body);
+
+    if (fseek(file, 0, SEEK_END) != 0)
+    {
+        failBuild("cannot write cache file");
+    }
+
+    writeU64LittleEndian(file, checkA);
+    writeU64LittleEndian(file, checkB);
+}
+
+static void storeCachedChunk(const SourceChunk *chunk)
+{
+    char path[4096];
+    char temporaryPath[4200];
+    FILE *file = NULL;
+    BuildFailure failure;
+    BuildFailure *outerFailure = NULL;
+    uint64_t stringBytes = 1;
+    size_t i = 0;
+
+    for (i = 0; i < chunk->code.count; i++)
+    {
+        cachedStringOffset(chunk->code.items[i].label, &stringBytes);
+    }
+
+    for (i = 0; i < chunk->data.count; i++)
+    {
+        cachedStringOffset(chunk->data.items[i].label, &stringBytes);
+    }
+
+    for (i = 0; i < chunk->symbols.count; i++)
+    {
+        cachedStringOffset(chunk->symbols.items[i].name, &stringBytes);
+    }
+
+    for (i = 0; i < chunk->pendingLabels.count; i++)
+    {
+        cachedStringOffset(chunk->pendingLabels.names[i], &stringBytes);
+    }
+
+    if (stringBytes > UINT32_MAX)
+    {
+        return;
+    }
+
+    chunkCachePath(chunk, path, sizeof(path));
+#if TINKER_MAPPED_SOURCE
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.%ld.%p", path, (long)getpid(), (const void *)chunk);
+#else
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.%p", path, (const void *)chunk);
+#endif
+
+    file = fopen(temporaryPath, "w+b");
+    if (file == NULL)
+    {
+        return;
+    }
+
+    /* A cache that cannot be written only costs the next run a parse. */
+    outerFailure = buildFailure;
+    buildFailure = &failure;
+    failure.message = NULL;
+
+    if (setjmp(failure.jump) != 0)
+    {
+        buildFailure = outerFailure;
+        free(failure.message);
+        fclose(file);
+        remove(temporaryPath);
+        return;
+    }
+
+    writeU64LittleEndian(file, chunkCacheMagic);
+    writeU64LittleEndian(file, chunkCacheVersion);
+    writeU64LittleEndian(file, (uint64_t)(chunk->end - chunk->begin));
+    writeU64LittleEndian(file, chunk->hashA);
+    writeU64LittleEndian(file, chunk->hashB);
+    writeU64LittleEndian(file, (uint64_t)chunk->firstPart);
+    writeU64LittleEndian(file, chunk->sawCodeDirective ? 1u : 0u);
+    writeU64LittleEndian(file, chunk->codeBytes);
+    writeU64LittleEndian(file, chunk->dataBytes);
+    writeU64LittleEndian(file, (uint64_t)chunk->startPart);
+    writeU64LittleEndian(file, chunk->code.count);
+    writeU64LittleEndian(file, chunk->data.count);
+    writeU64LittleEndian(file, chunk->symbols.count);
+    writeU64LittleEndian(file, chunk->pendingLabels.count);
+    writeU64LittleEndian(file, stringBytes);
+
+    stringBytes = 1;
+    writeCachedRecords(file, &chunk->code, &stringBytes);
+    writeCachedRecords(file, &chunk->data, &stringBytes);
+
+    for (i = 0; i < chunk->symbols.count; i++)
+    {
+        const Symbol *symbol = &chunk->symbols.items[i];
+
+        writeU32LittleEndian(file, cachedStringOffset(symbol->name, &stringBytes));
+        writeU64LittleEndian(file, symbol->address);
+        writeU64LittleEndian(file, (symbol->codeRecord == noCodeRecord) ? UINT64_MAX : (uint64_t)symbol->codeRecord);
+    }
+
+    for (i = 0; i < chunk->pendingLabels.count; i++)
+    {
+        writeU32LittleEndian(file, cachedStringOffset(chunk->pendingLabels.names[i], &stringBytes));
+    }
+
+    fputc('\0', file);
+    writeCachedStrings(file, &chunk->code);
+    writeCachedStrings(file, &chunk->data);
+
+    for (i = 0; i < chunk->symbols.count; i++)
+    {
+        fwrite(chunk->symbols.items[i].name, 1, strlen(chunk->symbols.items[i].name) + 1, file);
+    }
+
+    for (i = 0; i < chunk->pendingLabels.count; i++)
+    {
+        fwrite(chunk->pendingLabels.names[i], 1, strlen(chunk->pendingLabels.names[i]) + 1, file);
+    }
+
+    appendChunkChecksum(file);
+    buildFailure = outerFailure;
+
+    if (ferror(file) != 0 || fclose(file) != 0 || rename(temporaryPath, path) != 0)
+    {
+        remove(temporaryPath);
+    }
+}
+
+static void *parseSourceChunk(void *argument)
+{
+    SourceChunk *chunk = (SourceChunk *)argument;
+    SourceState state;
+
+    initSourceState(&state, &chunk->code, &chunk->data, &chunk->symbols);
+    state.currentPart = chunk->startPart;
+    state.codePc = 0;
+    state.dataPc = 0;
+
+    if (chunk->cacheDir != NULL)
+    {
+        hashChunkText(chunk->begin, (size_t)(chunk->end - chunk->begin), (uint64_t)chunk->startPart, &chunk->hashA, &chunk->hashB);
+
+        if (loadCachedChunk(chunk))
+        {
+            chunk->arena = assemblyArena;
+            assemblyArena.head = NULL;
+            return NULL;
+        }
+    }
+
+    buildFailure = &chunk->failure;
+
+    if (setjmp(chunk->failure.jump) == 0)
+    {
+        const char *cursor = chunk->begin;
+        SourceLine line;
+
+        while (nextSourceLine(&cursor, chunk->end, &line))
+        {
+            size_t codeCount = chunk->code.count;
+            size_t dataCount = chunk->data.count;
+
+            assembleSourceLine(&state, line);
+
+            if (chunk->firstPart == partNone && chunk->code.count != codeCount)
+            {
+                chunk->firstPart = partCode;
+            }
+            else if (chunk->firstPart == partNone && chunk->data.count != dataCount)
+            {
+                chunk->firstPart = partData;
+            }
+        }
+
+        chunk->sawCodeDirective = state.sawCodeDirective;
+        chunk->codeBytes = state.codePc;
+        chunk->dataBytes = state.dataPc;
+        chunk->pendingLabels = state.pendingLabels;
+    }
+    else
+    {
+        chunk->failed = true;
+    }
+
+    buildFailure = NULL;
+
+    if (!chunk->failed && chunk->cacheDir != NULL)
+    {
+        storeCachedChunk(chunk);
+    }
+
+    arenaRelease(&lineArena);
+    releaseInternPool(&labelNames);
+    chunk->arena = assemblyArena;
+    assemblyArena.head = NULL;
+
+    return NULL;
+}
+
+static void splitSourceChunks(const char *text, size_t size, SourceChunk *chunks, int count)
+{
+    AssemblyPart part = partNone;
+    const char *cursor = text;
+    const char *end = text + size;
+    uint32_t lines = 0;
+    int next = 1;
+    int i = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        const char *begin = text + size / (size_t)count * (size_t)i;
+
+        memset(&chunks[i], 0, sizeof(chunks[i]));
+        chunks[i].startPart = partNone;
+        chunks[i].firstPart = partNone;
+        chunks[i].end = end;
+
+        if (i != 0)
+        {
+            if (begin <= chunks[i - 1].begin)
+            {
+                begin = chunks[i - 1].begin;
+            }
+            else
+            {
+                const char *newline = (const char *)memchr(begin - 1, '\n', (size_t)(end - begin) + 1);
+                begin = (newline != NULL) ? newline + 1 : end;
+            }
+
+            chunks[i - 1].end = begin;
+        }
+
+        chunks[i].begin = begin;
+    }
+
+    while (cursor < end)
+    {
+        SourceLine line;
+
+        while (next < count && chunks[next].begin == cursor)
+        {
+            chunks[next].startPart = part;
+            chunks[next].startLine = lines;
+            next++;
+        }
+
+        nextSourceLine(&cursor, end, &line);
+        line = trimSourceLine(line);
+        lines++;
+
+        if (lineHasPrefix(line, ".code"))
+        {
+            part = partCode;
+        }
+        else if (lineHasPrefix(line, ".data"))
+        {
+            part = partData;
+        }
+    }
+
+    while (next < count)
+    {
+        chunks[next].startPart = part;
+        chunks[next].startLine = lines;
+        next++;
+    }
+}
+
+enum
+{
+    minContentChunkBytes = 64 * 1024,
+    maxContentChunkBytes = 4 * 1024 * 1024
+};
+
+/*
+ * Cuts before a line chosen by its own text: a label line one time in 8,
+ * any other line one time in 1024, once the chunk holds 64 KiB. Insertions
+ * and deletions therefore move at most the cut right after them.
+ */
+static bool isContentCut(SourceLine line, size_t chunkBytes)
+{
+    uint64_t hash = 0;
+
+    if (chunkBytes < minContentChunkBytes)
+    {
+        return false;
+    }
+
+    if (chunkBytes >= maxContentChunkBytes)
+    {
+        return true;
+    }
+
+    hash = hashText(line.text, (line.length < 32) ? line.length : 32);
+
+    if (line.length != 0 && (line.text[0] == ':' || line.text[0] == '@'))
+    {
+        return (hash & 7u) == 0;
+    }
+
+    return (hash & 1023u) == 0;
+}
+
+static SourceChunk *splitContentChunks(const char *text, size_t size, int *outCount)
+{
+    SourceChunk *chunks = NULL;
+    AssemblyPart part = partNone;
+    const char *cursor = text;
+    const char *end = text + size;
+    uint32_t lines = 0;
+    int count = 0;
+    int capacity = 16;
+
+    chunks = (SourceChunk *)malloc((size_t)capacity * sizeof(SourceChunk));
+    if (chunks == NULL)
+    {
+        failBuild("out of memory");
+    }
+
+    memset(&chunks[0], 0, sizeof(chunks[0]));
+    chunks[0].begin = text;
+    chunks[0].startPart = partNone;
+    chunks[0].firstPart = partNone;
+    count = 1;
+
+    while (cursor < end)
+    {
+        const char *lineStart = cursor;
+        SourceLine line;
+
+        nextSourceLine(&cursor, end, &line);
+
+        if (isContentCut(line, (size_t)(lineStart - chunks[count - 1].begin)))
+        {
+            if (count == capacity)
+            {
+                SourceChunk *bigger = NULL;
+
+                capacity *= 2;
+                bigger = (SourceChunk *)realloc(chunks, (size_t)capacity * sizeof(SourceChunk));
+                if (bigger == NULL)
+                {
+                    failBuild("out of memory");
+                }
+
+                chunks = bigger;
+            }
+
+            chunks[count - 1].end = lineStart;
+            memset(&chunks[count], 0, sizeof(chunks[count]));
+            chunks[count].begin = lineStart;
+            chunks[count].startPart = part;
+            chunks[count].firstPart = partNone;
+            chunks[count].startLine = lines;
+            count++;
+        }
+
+        line = trimSourceLine(line);
+        lines++;
+
+        if (lineHasPrefix(line, ".code"))
+        {
+            part = partCode;
+        }
+        else if (lineHasPrefix(line, ".data"))
+        {
+            part = partData;
+        }
+    }
+
+    chunks[count - 1].end = end;
+    *outCount = count;
+    return chunks;
+}
+
+static void appendChunkRecords(ProgramRecordList *list, const ProgramRecordList *chunk, uint64_t base, uint32_t lineBase, uint16_t file)
+{
+    size_t i = 0;
+
+    for (i = 0; i < chunk->count; i++)
+    {
+        ProgramRecord record = chunk->items[i];
+
+        record.address += base;
+        record.line += lineBase;
+        record.file = file;
+        appendRecord(list, record);
+    }
+}
+
+/*
+ * Places the chunks one after another in both sections, as if their text
+ * had been assembled in order. hw5-ld merges loaded objects the same way.
+ */
+static bool mergeChunks(SourceChunk *chunks, int chunkCount, ProgramRecordList *code, ProgramRecordList *data, SymbolTable *symbols)
+{
+    SourceState state;
+    uint64_t codeBase = programCodeBase;
+    uint64_t dataBase = programDataBase;
+    size_t codeRecordBase = 0;
+    int i = 0;
+
+    initSourceState(&state, code, data, symbols);
+
+    for (i = 0; i < chunkCount; i++)
+    {
+        SourceChunk *chunk = &chunks[i];
+        size_t j = 0;
+
+        if (chunk->firstPart == partCode)
+        {
+            attachPendingLabels(&state.pendingLabels, symbols, codeBase, code->count);
+        }
+        else if (chunk->firstPart == partData)
+        {
+            attachPendingLabels(&state.pendingLabels, symbols, dataBase, noCodeRecord);
+        }
+
+        for (j = 0; j < chunk->symbols.count; j++)
+        {
+            const Symbol *symbol = &chunk->symbols.items[j];
+
+            if (symbol->codeRecord != noCodeRecord)
+            {
+                addSymbol(symbols, symbol->name, codeBase + symbol->address, codeRecordBase + symbol->codeRecord);
+            }
+            else
+            {
+                addSymbol(symbols, symbol->name, dataBase + symbol->address, noCodeRecord);
+            }
+        }
+
+        if (chunk->failed)
+        {
+            failBuild((chunk->failure.message != NULL) ? chunk->failure.message : "out of memory");
+        }
+
+        appendChunkRecords(code, &chunk->code, codeBase, chunk->startLine, chunk->file);
+        appendChunkRecords(data, &chunk->data, dataBase, 0, chunk->file);
+
+        for (j = 0; j < chunk->pendingLabels.count; j++)
+        {
+            addUnattachedLabel(&state.pendingLabels, chunk->pendingLabels.names[j]);
+        }
+
+        state.sawCodeDirective = state.sawCodeDirective || chunk->sawCodeDirective;
+        codeBase += chunk->codeBytes;
+        dataBase += chunk->dataBytes;
+        codeRecordBase += chunk->code.count;
+
+        arenaAdopt(&assemblyArena, &chunk->arena);
+        freeRecordList(&chunk->code);
+        freeRecordList(&chunk->data);
+        freeSymbolTable(&chunk->symbols);
+        freeUnattachedLabels(&chunk->pendingLabels);
+    }
+
+    return finishBuild(&state);
+}
+
+static bool buildFromChunks(const char *inputPath, int threadCount, const char *cacheDir, ProgramRecordList *code, ProgramRecordList *data, SymbolTable *symbols)
+{
+    SourceChunk *chunks = NULL;
+    int chunkCount = threadCount;
+    SourceFile source;
+    bool sawCodeDirective = false;
+    int i = 0;
+
+    /* Fill the mnemonic table before the workers share it. */
+    lookupMnemonic("");
+    openAssemblySource(inputPath, &source);
+
+    if (cacheDir != NULL)
+    {
+        chunks = splitContentChunks(source.text, source.size, &chunkCount);
+    }
+    else
+    {
+        chunks = (SourceChunk *)malloc((size_t)chunkCount * sizeof(SourceChunk));
+        if (chunks == NULL)
+        {
+            failBuild("out of memory");
+        }
+
+        splitSourceChunks(source.text, source.size, chunks, chunkCount);
+    }
+
+    for (i = 0; i < chunkCount; i++)
+    {
+        chunks[i].cacheDir = cacheDir;
+    }
+
+    runWorkers(parseSourceChunk, chunks, sizeof(SourceChunk), chunkCount, threadCount);
+    sawCodeDirective = mergeChunks(chunks, chunkCount, code, data, symbols);
+    mapExpandedLines(code, &source);
+
+    free(chunks);
+    closeSourceFile(&source);
+
+    return sawCodeDirective;
+}
+
+typedef struct
+{
+    const ProgramRecordList *code;
+    const SymbolTable *symbols;
+    uint32_t *words;
+    size_t begin;
+    size_t end;
+    bool failed;
+    BuildFailure failure;
+} EncodeSlice;
+
+static void *encodeSlice(void *argument)
+{
+    EncodeSlice *slice = (EncodeSlice *)argument;
+
+    buildFailure = &slice->failure;
+
+    if (setjmp(slice->failure.jump) == 0)
+    {
+        size_t i = 0;
+
+        for (i = slice->begin; i < slice->end; i++)
+        {
+            if (slice->code->items[i].type != recordInstruction)
+            {
+                failBuild("internal error: non-instruction in code list");
+            }
+
+            slice->words[i] = encodeInstruction(&slice->code->items[i], slice->symbols);
+        }
+    }
+    else
+    {
+        slice->failed = true;
+    }
+
+    buildFailure = NULL;
+    return NULL;
+}
+
+static void encodeWordsParallel(const ProgramRecordList *code, const SymbolTable *symbols, uint32_t *words, int threadCount)
+{
+    EncodeSlice *slices = (EncodeSlice *)calloc((size_t)threadCount, sizeof(EncodeSlice));
+    int i = 0;
+
+    if (slices == NULL)
+    {
+        failBuild("out of memory");
+    }
+
+    for (i = 0; i < threadCount; i++)
+    {
+        slices[i].code = code;
+        slices[i].symbols = symbols;
+        slices[i].words = words;
+        slices[i].begin = code->count / (size_t)threadCount * (size_t)i;
+        slices[i].end = (i + 1 == threadCount) ? code->count : code->count / (size_t)threadCount * (size_t)(i + 1);
+    }
+
+    runWorkers(encodeSlice, slices, sizeof(EncodeSlice), threadCount, threadCount);
+
+    for (i = 0; i < threadCount; i++)
+    {
+        if (slices[i].failed)
+        {
+            failBuild((slices[i].failure.message != NULL) ? slices[i].failure.message : "out of memory");
+        }
+    }
+
+    free(slices);
+}
+
+static void parseSourceText(SourceState *state, const SourceFile *source)
+{
+    const char *cursor = source->text;
+    SourceLine line;
+
+    while (nextSourceLine(&cursor, source->text + source->size, &line))
+    {
+        assembleSourceLine(state, line);
+    }
+
+    mapExpandedLines(state->code, source);
+}
+
+static bool buildFromSource(const char *inputPath, int threadCount, const char *cacheDir, ProgramRecordList *code, ProgramRecordList *data, SymbolTable *symbols)
+{
+    SourceFile source;
+    SourceState state;
+
+    if (threadCount > 1 || cacheDir != NULL)
+    {
+        return buildFromChunks(inputPath, threadCount, cacheDir, code, data, symbols);
+    }
+
+    openAssemblySource(inputPath, &source);
+    initSourceState(&state, code, data, symbols);
+    parseSourceText(&state, &source);
+    closeSourceFile(&source);
+
+    return finishBuild(&state);
+}
+
+static uint32_t *assembleProgramWords(const ProgramRecordList *code, const SymbolTable *symbols, int threadCount)
+{
+    uint32_t *words = NULL;
+    size_t i = 0;
+
+    words = (uint32_t *)malloc(sizeof(uint32_t) * code->count);
+    if (words == NULL)
+    {
+        failBuild("out of memory");
+    }
+
+    if (threadCount > 1 && code->count >= 65536)
+    {
+        encodeWordsParallel(code, symbols, words, threadCount);
+        return words;
+    }
+
+    for (i = 0; i < code->count; i++)
+    {
+        if (code->items[i].type != recordInstruction)
         {
             failBuild("internal error: non-instruction in code list");
         }
-        words[i] = assembleOneInstruction(code->items[i].text, code->items[i].address, symbols);
+
+        words[i] = encodeInstruction(&code->items[i], symbols);
     }
 
     return words;
 }
 
-static void writeOutputTko(const char *outputPath, const ProgramRecordList *code, const ProgramRecordList *data, const uint32_t *words, const SymbolTable *symbols)
+static size_t tkoImageBytes(const ProgramRecordList *code, const ProgramRecordList *data)
+{
+    return 40 + code->count * 4 + data->count * 8;
+}
+
+static void formatTkoImage(unsigned char *image, const ProgramRecordList *code, const ProgramRecordList *data, const uint32_t *words, const SymbolTable *symbols)
+{
+    unsigned char *at = image + 40;
+    size_t i = 0;
+
+    storeU64LittleEndian(image, 0);
+    storeU64LittleEndian(image + 8, programCodeBase);
+    storeU64LittleEndian(image + 16, (uint64_t)code->count * 4ULL);
+    storeU64LittleEndian(image + 24, programDataBase);
+    storeU64LittleEndian(image + 32, (uint64_t)data->count * 8ULL);
+
+    for (i = 0; i < code->count; i++)
+    {
+        storeU32LittleEndian(at, words[i]);
+        at += 4;
+    }
+
+    for (i = 0; i < data->count; i++)
+    {
+        uint64_t value = data->items[i].data;
+
+        if (data->items[i].label != NULL && !findSymbol(symbols, data->items[i].label, &value))
+        {
+            failBuildWithName("undefined label reference %s", data->items[i].label);
+        }
+
+        storeU64LittleEndian(at, value);
+        at += 8;
+    }
+}
+
+static void writeOutputTko(const char *outputPath, const ProgramRecordList *code, const ProgramRecordList *data, const uint32_t *words, const SymbolTable *symbols)
+{
+    size_t size = tkoImageBytes(code, data);
+    unsigned char *image = (unsigned char *)malloc(size);
+    FILE *file = NULL;
+    bool written = false;
+
+    if (image == NULL)
+    {
+        failBuild("out of memory");
+    }
+
+    formatTkoImage(image, code, data, words, symbols);
+
+    file = fopen(outputPath, "wb");
+    if (file == NULL)
+    {
+        failBuildWithName("cannot open output file %s", outputPath);
+    }
+
+    written = fwrite(image, 1, size, file) == size;
+    if (fclose(file) != 0 || !written)
+    {
+        failBuild("failed writing output");
+    }
+
+    free(image);
+}
+
+/*
+ * hw5-asm -c writes a relocatable object (.tko.o) that hw5-ld links with
+ * others into a program:
+ *
+ *   header   magic, version, flags (1: has .code), code words, data words,
+ *            symbols, relocations, string bytes, source name offset (u64
+ *            each)
+ *   code     u32 per instruction; a label ld is a single word holding rd
+ *            that the linker grows into the ld sequence
+ *   data     u64 per item, 0 where a label address goes
+ *   lines    u32 source line and u32 origin per code word, for --map
+ *   symbols  u32 name offset, u32 section (0 undefined, 1 code, 2 data),
+ *            u64 word index
+ *   relocs   u32 kind, u32 symbol, u64 word index
+ *   strings  NUL-terminated symbol names, then the source file name
+ *
+ * Every label is global. Objects are placed in command-line order, so
+ * linking a.tko.o b.tko.o gives the same .tko as assembling a.tk and b.tk
+ * as one file.
+ */
+static const uint64_t objectMagic = 0x314A424F4F4B5454ULL;
+static const uint64_t objectVersion = 2;
+static const uint64_t undefinedObjectSymbol = UINT64_MAX;
+
+enum
+{
+    objectHeaderWords = 9,
+    objectEntryBytes = 16
+};
+
+typedef enum
+{
+    sectionUndefined,
+    sectionCode,
+    sectionData
+} ObjectSection;
+
+typedef enum
+{
+    relocLoadLabel = 1,
+    relocBranchLabel,
+    relocDataLabel
+} RelocationKind;
+
+static uint32_t objectSymbolIndex(SymbolTable *symbols, const char *name)
+{
+    const Symbol *symbol = lookupSymbol(symbols, name);
+
+    if (symbol == NULL)
+    {
+        addSymbol(symbols, name, undefinedObjectSymbol, noCodeRecord);
+        symbol = &symbols->items[symbols->count - 1];
+    }
+
+    return (uint32_t)(symbol - symbols->items);
+}
+
+static void writeRelocation(FILE *file, uint32_t kind, uint32_t symbolIndex, uint64_t wordIndex)
+{
+    writeU32LittleEndian(file, kind);
+    writeU32LittleEndian(file, symbolIndex);
+    writeU64LittleEndian(file, wordIndex);
+}
+
+static void writeObjectFile(const char *outputPath, const char *sourcePath, const ProgramRecordList *code, const ProgramRecordList *data, SymbolTable *symbols, bool sawCodeDirective)
+{
+    FILE *file = NULL;
+    uint64_t relocationCount = 0;
+    uint64_t stringBytes = 0;
+    size_t i = 0;
+
+    for (i = 0; i < code->count; i++)
+    {
+        if (code->items[i].label != NULL)
+        {
+            objectSymbolIndex(symbols, code->items[i].label);
+            relocationCount++;
+        }
+    }
+
+    for (i = 0; i < data->count; i++)
+    {
+        if (data->items[i].label != NULL)
+        {
+            objectSymbolIndex(symbols, data->items[i].label);
+            relocationCount++;
+        }
+    }
+
+    for (i = 0; i < symbols->count; i++)
+    {
+        stringBytes += strlen(symbols->items[i].name) + 1;
+    }
+
+    stringBytes += strlen(sourcePath) + 1;
+
+    if (symbols->count > UINT32_MAX || stringBytes > UINT32_MAX)
+    {
+        failBuild("too many symbols for an object file");
+    }
+
+    file = fopen(outputPath, "wb");
+    if (file == NULL)
+    {
+        failBuildWithName("cannot open output file %s", outputPath);
+    }
+
+    writeU64LittleEndian(file, objectMagic);
+    writeU64LittleEndian(file, objectVersion);
+    writeU64LittleEndian(file, sawCodeDirective ? 1u : 0u);
+    writeU64LittleEndian(file, code->count);
+    writeU64LittleEndian(file, data->count);
+    writeU64LittleEndian(file, symbols->count);
+    writeU64LittleEndian(file, relocationCount);
+    writeU64LittleEndian(file, stringBytes);
+    writeU64LittleEndian(file, stringBytes - strlen(sourcePath) - 1);
+
+    for (i = 0; i < code->count; i++)
+    {
+        const ProgramRecord *record = &code->items[i];
+
+        if (record->type == recordLoadLabel)
+        {
+            writeU32LittleEndian(file, encodePType(0, record->rd, 0, 0, 0));
+        }
+        else
+        {
+            writeU32LittleEndian(file, encodePType(record->opcode, record->rd, record->rs, record->rt, (record->label != NULL) ? 0 : record->imm12));
+        }
+    }
+
+    for (i = 0; i < data->count; i++)
+    {
+        writeU64LittleEndian(file, (data->items[i].label != NULL) ? 0 : data->items[i].data);
+    }
+
+    for (i = 0; i < code->count; i++)
+    {
+        writeU32LittleEndian(file, code->items[i].line);
+        writeU32LittleEndian(file, code->items[i].origin);
+    }
+
+    stringBytes = 0;
+    for (i = 0; i < symbols->count; i++)
+    {
+        const Symbol *symbol = &symbols->items[i];
+
+        writeU32LittleEndian(file, (uint32_t)stringBytes);
+        stringBytes += strlen(symbol->name) + 1;
+
+        if (symbol->address == undefinedObjectSymbol)
+        {
+            writeU32LittleEndian(file, sectionUndefined);
+            writeU64LittleEndian(file, 0);
+        }
+        else if (symbol->codeRecord != noCodeRecord)
+        {
+            writeU32LittleEndian(file, sectionCode);
+            writeU64LittleEndian(file, symbol->codeRecord);
+        }
+        else
+        {
+            writeU32LittleEndian(file, sectionData);
+            writeU64LittleEndian(file, (symbol->address - programDataBase) / 8ULL);
+        }
+    }
+
+    for (i = 0; i < code->count; i++)
+    {
+        const ProgramRecord *record = &code->items[i];
+
+        if (record->label != NULL)
+        {
+            writeRelocation(file, (record->type == recordLoadLabel) ? relocLoadLabel : relocBranchLabel, objectSymbolIndex(symbols, record->label), i);
+        }
+    }
+
+    for (i = 0; i < data->count; i++)
+    {
+        if (data->items[i].label != NULL)
+        {
+            writeRelocation(file, relocDataLabel, objectSymbolIndex(symbols, data->items[i].label), i);
+        }
+    }
+
+    for (i = 0; i < symbols->count; i++)
+    {
+        fwrite(symbols->items[i].name, 1, strlen(symbols->items[i].name) + 1, file);
+    }
+
+    fwrite(sourcePath, 1, strlen(sourcePath) + 1, file);
+
+    if (fclose(file) != 0)
+    {
+        failBuildWithName("cannot write output file %s", outputPath);
+    }
+}
+
+/*
+ * Rebuilds the records hw5-asm parsed for one object, with addresses
+ * relative to the object like a parsed chunk's.
+ */
+static void readObjectChunk(SourceChunk *chunk)
+{
+    SourceFile object;
+    const unsigned char *bytes = NULL;
+    const unsigned char *linesAt = NULL;
+    const unsigned char *symbolsAt = NULL;
+    const unsigned char *relocationsAt = NULL;
+    uint64_t header[objectHeaderWords];
+    char *strings = NULL;
+    uint64_t pc = 0;
+    uint64_t i = 0;
+    bool ok = true;
+
+    openSourceFile(chunk->objectPath, &object);
+    bytes = (const unsigned char *)object.text;
+
+    for (i = 0; i < objectHeaderWords && object.size >= objectHeaderWords * 8; i++)
+    {
+        header[i] = readU64At(bytes + 8 * i);
+    }
+
+    if (object.size < objectHeaderWords * 8 || header[0] != objectMagic || header[1] != objectVersion || header[3] > (1ULL << 32) || header[4] > (1ULL << 32) ||
+        header[5] > UINT32_MAX || header[6] > (1ULL << 32) || header[7] > UINT32_MAX || header[8] >= header[7] ||
+        object.size != objectHeaderWords * 8 + header[3] * 12 + header[4] * 8 + (header[5] + header[6]) * objectEntryBytes + header[7] ||
+        bytes[object.size - 1] != '\0')
+    {
+        closeSourceFile(&object);
+        failBuildWithName("malformed object file %s", chunk->objectPath);
+    }
+
+    linesAt = bytes + objectHeaderWords * 8 + header[3] * 4 + header[4] * 8;
+    symbolsAt = linesAt + header[3] * 8;
+    relocationsAt = symbolsAt + header[5] * objectEntryBytes;
+    strings = (char *)arenaAllocate(&assemblyArena, (size_t)header[7] + 1);
+    memcpy(strings, relocationsAt + header[6] * objectEntryBytes, (size_t)header[7]);
+    chunk->sourceName = strings + header[8];
+
+    chunk->code.items = (ProgramRecord *)malloc((size_t)(header[3] + 1) * sizeof(ProgramRecord));
+    chunk->data.items = (ProgramRecord *)malloc((size_t)(header[4] + 1) * sizeof(ProgramRecord));
+    chunk->symbols.items = (Symbol *)calloc((size_t)header[5] + 1, sizeof(Symbol));
+    if (chunk->code.items == NULL || chunk->data.items == NULL || chunk->symbols.items == NULL)
+    {
+        failBuild("out of memory");
+    }
+
+    chunk->code.capacity = (size_t)header[3] + 1;
+    chunk->data.capacity = (size_t)header[4] + 1;
+    chunk->symbols.capacity = (size_t)header[5] + 1;
+
+    for (i = 0; i < header[3]; i++)
+    {
+        uint32_t word = readU32At(bytes + objectHeaderWords * 8 + 4 * i);
+        ProgramRecord record = makeInstruction(word >> 27, word >> 22, word >> 17, word >> 12, word);
+
+        record.line = readU32At(linesAt + 8 * i);
+        record.origin = (uint8_t)readU32At(linesAt + 8 * i + 4);
+        ok = ok && readU32At(linesAt + 8 * i + 4) < originCount;
+        appendRecord(&chunk->code, record);
+    }
+
+    for (i = 0; i < header[4]; i++)
+    {
+        ProgramRecord record;
+
+        memset(&record, 0, sizeof(record));
+        record.type = recordData;
+        record.address = 8ULL * i;
+        record.data = readU64At(bytes + objectHeaderWords * 8 + header[3] * 4 + 8 * i);
+        appendRecord(&chunk->data, record);
+    }
+
+    for (i = 0; ok && i < header[6]; i++)
+    {
+        const unsigned char *at = relocationsAt + i * objectEntryBytes;
+        uint32_t kind = readU32At(at);
+        uint32_t symbolIndex = readU32At(at + 4);
+        uint64_t wordIndex = readU64At(at + 8);
+        ProgramRecord *record = NULL;
+
+        ok = symbolIndex < header[5] && readU32At(symbolsAt + symbolIndex * objectEntryBytes) < header[7];
+
+        if (ok && (kind == relocLoadLabel || kind == relocBranchLabel) && wordIndex < header[3])
+        {
+            record = &chunk->code.items[wordIndex];
+        }
+        else if (ok && kind == relocDataLabel && wordIndex < header[4])
+        {
+            record = &chunk->data.items[wordIndex];
+            record->data = 0;
+        }
+        else
+        {
+            ok = false;
+            break;
+        }
+
+        if (kind == relocLoadLabel)
+        {
+            ProgramRecord placeholder = *record;
+
+            memset(record, 0, sizeof(*record));
+            record->type = recordLoadLabel;
+            record->rd = placeholder.rd;
+            record->imm12 = (uint16_t)loadImmediateWords(programCodeBase);
+            record->line = placeholder.line;
+            record->origin = placeholder.origin;
+        }
+
+        record->label = strings + readU32At(symbolsAt + symbolIndex * objectEntryBytes);
+    }
+
+    for (i = 0; i < header[3]; i++)
+    {
+        chunk->code.items[i].address = pc;
+        pc += isLabelSequence(&chunk->code.items[i]) ? 4ULL * chunk->code.items[i].imm12 : 4ULL;
+    }
+
+    for (i = 0; ok && i < header[5]; i++)
+    {
+        const unsigned char *at = symbolsAt + i * objectEntryBytes;
+        uint32_t nameOffset = readU32At(at);
+        uint32_t section = readU32At(at + 4);
+        uint64_t wordIndex = readU64At(at + 8);
+        Symbol *symbol = &chunk->symbols.items[chunk->symbols.count];
+
+        if (section == sectionUndefined)
+        {
+            continue;
+        }
+
+        ok = nameOffset < header[7] && ((section == sectionCode && wordIndex < header[3]) || (section == sectionData && wordIndex < header[4]));
+        if (!ok)
+        {
+            break;
+        }
+
+        symbol->name = strings + nameOffset;
+        symbol->codeRecord = (section == sectionCode) ? (size_t)wordIndex : noCodeRecord;
+        symbol->address = (section == sectionCode) ? chunk->code.items[wordIndex].address : 8ULL * wordIndex;
+        chunk->symbols.count++;
+    }
+
+    closeSourceFile(&object);
+
+    if (!ok)
+    {
+        failBuildWithName("malformed object file %s", chunk->objectPath);
+    }
+
+    chunk->sawCodeDirective = (header[2] & 1u) != 0;
+    chunk->codeBytes = pc;
+    chunk->dataBytes = 8ULL * header[4];
+}
+
+static void *loadObjectChunk(void *argument)
+{
+    SourceChunk *chunk = (SourceChunk *)argument;
+
+    buildFailure = &chunk->failure;
+
+    if (setjmp(chunk->failure.jump) == 0)
+    {
+        readObjectChunk(chunk);
+    }
+    else
+    {
+        chunk->failed = true;
+    }
+
+    buildFailure = NULL;
+    chunk->arena = assemblyArena;
+    assemblyArena.head = NULL;
+
+    return NULL;
+}
+
+/*
+ * Objects are read and decoded on the -j threads; the merge then resolves
+ * every label through the hashed symbol table before the usual layout and
+ * (parallel) encoding.
+ */
+static bool linkObjects(const char **objectPaths, int objectCount, int threadCount, const char **sourceNames, ProgramRecordList *code, ProgramRecordList *data, SymbolTable *symbols)
+{
+    SourceChunk *chunks = (SourceChunk *)calloc((size_t)objectCount, sizeof(SourceChunk));
+    bool sawCodeDirective = false;
+    int i = 0;
+
+    if (chunks == NULL)
+    {
+        failBuild("out of memory");
+    }
+
+    if (objectCount > UINT16_MAX)
+    {
+        failBuild("too many object files");
+    }
+
+    for (i = 0; i < objectCount; i++)
+    {
+        chunks[i].objectPath = objectPaths[i];
+        chunks[i].firstPart = partNone;
+        chunks[i].file = (uint16_t)i;
+    }
+
+    runWorkers(loadObjectChunk, chunks, sizeof(SourceChunk), objectCount, threadCount);
+
+    for (i = 0; i < objectCount; i++)
+    {
+        sourceNames[i] = chunks[i].sourceName;
+    }
+
+    sawCodeDirective = mergeChunks(chunks, objectCount, code, data, symbols);
+
+    free(chunks);
+    return sawCodeDirective;
+}
+
+/*
+ * --map writes program.tko.map next to the program for profilers:
+ *
+ *   header   magic, version, ranges, labels, files, origins, string bytes
+ *            (u64 each)
+ *   ranges   u64 address, u32 bytes, u32 line, u32 label (UINT32_MAX
+ *            before the first), u16 file, u16 origin; one per run of words
+ *            sharing all four, sorted and contiguous from the code base
+ *   labels   u64 address, u32 name offset, u32 0; code labels by address
+ *   files    u32 name offset
+ *   origins  u32 name offset, indexed by a range's origin
+ *   strings  NUL-terminated names
+ *
+ * Entries are fixed-size and 8-byte aligned, so a tool can mmap the file
+ * and binary-search the ranges for each sample address.
+ */
+static const uint64_t sourceMapMagic = 0x3150414D4F4B5454ULL;
+static const uint64_t sourceMapVersion = 1;
+
+static int compareSymbolAddresses(const void *left, const void *right)
+{
+    const Symbol *a = *(const Symbol *const *)left;
+    const Symbol *b = *(const Symbol *const *)right;
+
+    if (a->address != b->address)
+    {
+        return (a->address < b->address) ? -1 : 1;
+    }
+
+    return (a < b) ? -1 : (a > b);
+}
+
+static bool sameMapRange(const ProgramRecord *a, const ProgramRecord *b)
+{
+    return a->line == b->line && a->file == b->file && a->origin == b->origin;
+}
+
+static void writeSourceMap(const char *programPath, const ProgramRecordList *code, const SymbolTable *symbols, const char **files, size_t fileCount)
 {
+    const Symbol **labels = NULL;
+    size_t labelCount = 0;
+    size_t rangeCount = 0;
+    uint64_t stringBytes = 0;
+    size_t nextLabel = 0;
+    size_t pathLength = strlen(programPath);
+    char *mapPath = NULL;
     FILE *file = NULL;
-    uint64_t fileType = 0ULL;
-    uint64_t codeBegin = programCodeBase;
-    uint64_t codeSize = (uint64_t)code->count * 4ULL;
-    uint64_t dataBegin = programDataBase;
-    uint64_t dataSize = (uint64_t)data->count * 8ULL;
     size_t i = 0;
 
-    file = fopen(outputPath, "wb");
-    if (file == NULL)
+    labels = (const Symbol **)malloc((symbols->count + 1) * sizeof(Symbol *));
+    mapPath = (char *)malloc(pathLength + 5);
+    if (labels == NULL || mapPath == NULL)
     {
-        failBuildWithName("cannot open output file %s", outputPath);
+        failBuild("out of memory");
+    }
+
+    for (i = 0; i < symbols->count; i++)
+    {
+        if (symbols->items[i].codeRecord != noCodeRecord)
+        {
+            labels[labelCount] = &symbols->items[i];
+            labelCount++;
+            stringBytes += strlen(symbols->items[i].name) + 1;
+        }
+    }
+
+    qsort(labels, labelCount, sizeof(Symbol *), compareSymbolAddresses);
+
+    for (i = 0; i < fileCount; i++)
+    {
+        stringBytes += strlen(files[i]) + 1;
+    }
+
+    for (i = 0; i < originCount; i++)
+    {
+        stringBytes += strlen(originNames[i]) + 1;
     }
 
-    writeU64LittleEndian(file, fileType);
-    writeU64LittleEndian(file, codeBegin);
-    writeU64LittleEndian(file, codeSize);
-    writeU64LittleEndian(file, dataBegin);
-    writeU64LittleEndian(file, dataSize);
+    if (stringBytes > UINT32_MAX || labelCount >= UINT32_MAX)
+    {
+        failBuild("too many labels for --map");
+    }
 
+    /* A range ends where any field changes, including the label. */
     for (i = 0; i < code->count; i++)
     {
-        writeU32LittleEndian(file, words[i]);
+        while (nextLabel < labelCount && labels[nextLabel]->address <= code->items[i].address)
+        {
+            nextLabel++;
+        }
+
+        if (i == 0 || !sameMapRange(&code->items[i - 1], &code->items[i]) || (nextLabel != 0 && labels[nextLabel - 1]->address == code->items[i].address))
+        {
+            rangeCount++;
+        }
+    }
+
+    memcpy(mapPath, programPath, pathLength);
+    memcpy(mapPath + pathLength, ".map", 5);
+
+    file = fopen(mapPath, "wb");
+    if (file == NULL)
+    {
+        failBuildWithName("cannot open output file %s", mapPath);
     }
 
-    for (i = 0; i < data->count; i++)
+    writeU64LittleEndian(file, sourceMapMagic);
+    writeU64LittleEndian(file, sourceMapVersion);
+    writeU64LittleEndian(file, rangeCount);
+    writeU64LittleEndian(file, labelCount);
+    writeU64LittleEndian(file, fileCount);
+    writeU64LittleEndian(file, originCount);
+    writeU64LittleEndian(file, stringBytes);
+
+    nextLabel = 0;
+    for (i = 0; i < code->count;)
     {
-        if (data->items[i].text != NULL)
+        const ProgramRecord *first = &code->items[i];
+        size_t end = i + 1;
+
+        while (nextLabel < labelCount && labels[nextLabel]->address <= first->address)
         {
-            uint64_t address = 0;
+            nextLabel++;
+        }
 
-            if (!findSymbol(symbols, data->items[i].text, &address))
-            {
-                fclose(file);
-                failBuildWithName("undefined label reference %s", data->items[i].text);
-            }
+        while (end < code->count && sameMapRange(first, &code->items[end]) &&
+               (nextLabel == labelCount || labels[nextLabel]->address > code->items[end].address))
+        {
+            end++;
+        }
+
+        writeU64LittleEndian(file, first->address);
+        writeU32LittleEndian(file, (uint32_t)(4 * (end - i)));
+        writeU32LittleEndian(file, first->line);
+        writeU32LittleEndian(file, (nextLabel == 0) ? UINT32_MAX : (uint32_t)(nextLabel - 1));
+        writeU32LittleEndian(file, (uint32_t)first->file | ((uint32_t)first->origin << 16));
+        i = end;
+    }
+
+    stringBytes = 0;
+    for (i = 0; i < labelCount; i++)
+    {
+        writeU64LittleEndian(file, labels[i]->address);
+        writeU32LittleEndian(file, (uint32_t)stringBytes);
+        writeU32LittleEndian(file, 0);
+        stringBytes += strlen(labels[i]->name) + 1;
+    }
+
+    for (i = 0; i < fileCount; i++)
+    {
+        writeU32LittleEndian(file, (uint32_t)stringBytes);
+        stringBytes += strlen(files[i]) + 1;
+    }
+
+    for (i = 0; i < originCount; i++)
+    {
+        writeU32LittleEndian(file, (uint32_t)stringBytes);
+        stringBytes += strlen(originNames[i]) + 1;
+    }
+
+    for (i = 0; i < labelCount; i++)
+    {
+        fwrite(labels[i]->name, 1, strlen(labels[i]->name) + 1, file);
+    }
+
+    for (i = 0; i < fileCount; i++)
+    {
+        fwrite(files[i], 1, strlen(files[i]) + 1, file);
+    }
+
+    for (i = 0; i < originCount; i++)
+    {
+        fwrite(originNames[i], 1, strlen(originNames[i]) + 1, file);
+    }
+
+    if (fclose(file) != 0)
+    {
+        failBuildWithName("cannot write output file %s", mapPath);
+    }
+
+    free(mapPath);
+    free(labels);
+}
+
+/*
+ * libtinkerasm (tinker-asm.h). A context lends its arenas to this thread's
+ * assemblyArena and lineArena for the length of a call and owns every list
+ * the build grows, so a failure longjmps back here and is cleaned up like
+ * a success. Builds are serial; -j, --cache-dir, -c and --map stay in the
+ * command-line tools.
+ */
+struct TinkerAsm
+{
+    Arena assemblyArena;
+    Arena lineArena;
+    ProgramRecordList code;
+    ProgramRecordList data;
+    SymbolTable symbols;
+    SourceFile source;
+    SourceState state;
+    uint32_t *words;
+    unsigned char *image;
+    size_t imageSize;
+    size_t imageCapacity;
+    BuildFailure failure;
+    TinkerAsmError error;
+};
+
+#if TINKER_THREADS
+static pthread_once_t mnemonicSlotsOnce = PTHREAD_ONCE_INIT;
+#endif
+
+static void prepareMnemonicSlots(void)
+{
+    lookupMnemonic("");
+}
+
+TinkerAsm *tinkerAsmCreate(void)
+{
+    TinkerAsm *context = (TinkerAsm *)calloc(1, sizeof(TinkerAsm));
+
+    if (context == NULL)
+    {
+        return NULL;
+    }
+
+#if TINKER_THREADS
+    pthread_once(&mnemonicSlotsOnce, prepareMnemonicSlots);
+#else
+    prepareMnemonicSlots();
+#endif
+
+    context->assemblyArena.blockBytes = 1u << 16;
+    context->lineArena.blockBytes = 1u << 12;
+    context->error.status = tinkerAsmOk;
+    return context;
+}
+
+void tinkerAsmDestroy(TinkerAsm *context)
+{
+    if (context == NULL)
+    {
+        return;
+    }
+
+    arenaRelease(&context->assemblyArena);
+    arenaRelease(&context->lineArena);
+    freeRecordList(&context->code);
+    freeRecordList(&context->data);
+    free(context->image);
+    free(context->failure.message);
+    free(context);
+}
+
+static void buildTkoImage(TinkerAsm *context, const char *source, size_t size, unsigned flags)
+{
+    bool sawCodeDirective = false;
 
-            writeU64LittleEndian(file, address);
+    context->source.text = source;
+    context->source.size = size;
+    expandSourceMacros(&context->source);
+
+    parseSourceText(&context->state, &context->source);
+    sawCodeDirective = finishBuild(&context->state);
+
+    /* Errors from here on are about the whole program, not a line. */
+    context->state.line = 0;
+    layoutProgram(&context->code, &context->symbols, sawCodeDirective, (flags & tinkerAsmOptimize) != 0);
+    context->words = assembleProgramWords(&context->code, &context->symbols, 1);
+
+    context->imageSize = tkoImageBytes(&context->code, &context->data);
+    if (context->imageSize > context->imageCapacity)
+    {
+        free(context->image);
+        context->image = (unsigned char *)malloc(context->imageSize);
+        context->imageCapacity = (context->image != NULL) ? context->imageSize : 0;
+        if (context->image == NULL)
+        {
+            failBuild("out of memory");
         }
-        else
+    }
+
+    formatTkoImage(context->image, &context->code, &context->data, context->words, &context->symbols);
+}
+
+TinkerAsmStatus tinkerAsmAssemble(TinkerAsm *context, const char *source, size_t size, unsigned flags)
+{
+    BuildFailure *outerFailure = buildFailure;
+    Arena outerAssembly = assemblyArena;
+    Arena outerLine = lineArena;
+    InternPool outerLabels = labelNames;
+
+    assemblyArena = context->assemblyArena;
+    lineArena = context->lineArena;
+    memset(&labelNames, 0, sizeof(labelNames));
+    memset(&context->source, 0, sizeof(context->source));
+
+    context->code.count = 0;
+    context->data.count = 0;
+    context->imageSize = 0;
+    free(context->failure.message);
+    context->failure.message = NULL;
+    context->failure.line = 0;
+    initSourceState(&context->state, &context->code, &context->data, &context->symbols);
+
+    buildFailure = &context->failure;
+    if (setjmp(context->failure.jump) == 0)
+    {
+        buildTkoImage(context, source, size, flags);
+        context->error.status = tinkerAsmOk;
+        context->error.line = 0;
+        context->error.message = NULL;
+    }
+    else
+    {
+        uint32_t line = (context->failure.line != 0) ? context->failure.line : context->state.line;
+
+        if (context->failure.line == 0 && line >= 1 && line <= context->source.lineOriginCount)
         {
-            writeU64LittleEndian(file, data->items[i].data);
+            line = context->source.lineOrigins[line - 1];
         }
+
+        context->imageSize = 0;
+        context->error.status = tinkerAsmFailed;
+        context->error.line = line;
+        context->error.message = (context->failure.message != NULL) ? context->failure.message : "out of memory";
     }
 
-    fclose(file);
+    buildFailure = outerFailure;
+
+    free(context->words);
+    context->words = NULL;
+    freeUnattachedLabels(&context->state.pendingLabels);
+    freeSymbolTable(&context->symbols);
+    closeSourceFile(&context->source);
+    releaseInternPool(&labelNames);
+
+    arenaReset(&assemblyArena);
+    arenaReset(&lineArena);
+    context->assemblyArena = assemblyArena;
+    context->lineArena = lineArena;
+    assemblyArena = outerAssembly;
+    lineArena = outerLine;
+    labelNames = outerLabels;
+
+    return context->error.status;
 }
 
-int main(int argc, char **argv)
+const unsigned char *tinkerAsmImage(const TinkerAsm *context, size_t *outSize)
+{
+    *outSize = context->imageSize;
+    return (context->imageSize != 0) ? context->image : NULL;
+}
+
+unsigned tinkerAsmVersion(void)
+{
+    return TINKER_ASM_VERSION;
+}
+
+void tinkerAsmHash(const void *bytes, size_t size, uint64_t seed, uint64_t *outA, uint64_t *outB)
+{
+    hashChunkText((const char *)bytes, size, seed, outA, outB);
+}
+
+const TinkerAsmError *tinkerAsmLastError(const TinkerAsm *context)
+{
+    return &context->error;
+}
+
+static int readThreadCount(const char *text)
+{
+    char *end = NULL;
+    long value = 0;
+
+    errno = 0;
+    value = strtol(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || value < 1 || value > 256)
+    {
+        return 0;
+    }
+
+    return (int)value;
+}
+
+static int assemblerMain(int argc, char **argv)
 {
     const char *inputPath = NULL;
     const char *outputPath = NULL;
+    const char *cacheDir = NULL;
+    bool optimize = false;
+    bool relocatable = false;
+    bool writeMap = false;
+    bool sawCodeDirective = false;
+    int threadCount = 1;
+    int argi = 1;
 
     ProgramRecordList code;
     ProgramRecordList data;
@@ -1945,14 +5338,194 @@ int main(int argc, char **argv)
 
     uint32_t *words = NULL;
 
-    if (argc != 3)
+    while (argi < argc && argv[argi][0] == '-')
+    {
+        const char *count = NULL;
+
+        if (strcmp(argv[argi], "-O") == 0)
+        {
+            optimize = true;
+            argi++;
+            continue;
+        }
+
+        if (strcmp(argv[argi], "-c") == 0)
+        {
+            relocatable = true;
+            argi++;
+            continue;
+        }
+
+        if (strcmp(argv[argi], "--map") == 0)
+        {
+            writeMap = true;
+            argi++;
+            continue;
+        }
+
+        if (strncmp(argv[argi], "--cache-dir=", 12) == 0 && argv[argi][12] != '\0')
+        {
+            cacheDir = argv[argi] + 12;
+            argi++;
+            continue;
+        }
+
+        if (strcmp(argv[argi], "--cache-dir") == 0 && argi + 1 < argc)
+        {
+            cacheDir = argv[argi + 1];
+            argi += 2;
+            continue;
+        }
+
+        if (strncmp(argv[argi], "-j", 2) != 0)
+        {
+            break;
+        }
+
+        count = argv[argi] + 2;
+        if (*count == '\0' && argi + 1 < argc)
+        {
+            argi++;
+            count = argv[argi];
+        }
+
+        threadCount = readThreadCount(count);
+        if (threadCount == 0)
+        {
+            argi = argc;
+            break;
+        }
+
+        argi++;
+    }
+
+    if (argc - argi != 2 || (relocatable && (optimize || writeMap)))
     {
-        fprintf(stderr, "Usage: %s input.tk output.tko\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-O | -c] [-j N] [--cache-dir DIR] [--map] input.tk output.tko\n", argv[0]);
         return 1;
     }
 
-    inputPath = argv[1];
-    outputPath = argv[2];
+    inputPath = argv[argi];
+    outputPath = argv[argi + 1];
+
+    code.items = NULL;
+    code.count = 0;
+    code.capacity = 0;
+
+    data.items = NULL;
+    data.count = 0;
+    data.capacity = 0;
+
+    symbols.items = NULL;
+    symbols.count = 0;
+    symbols.capacity = 0;
+    symbols.slots = NULL;
+    symbols.slotCount = 0;
+
+#if TINKER_MAPPED_SOURCE
+    if (cacheDir != NULL && mkdir(cacheDir, 0777) != 0 && errno != EEXIST)
+    {
+        failBuildWithName("cannot create cache directory %s", cacheDir);
+    }
+#endif
+
+    sawCodeDirective = buildFromSource(inputPath, threadCount, cacheDir, &code, &data, &symbols);
+
+    if (relocatable)
+    {
+        writeObjectFile(outputPath, inputPath, &code, &data, &symbols, sawCodeDirective);
+    }
+    else
+    {
+        layoutProgram(&code, &symbols, sawCodeDirective, optimize);
+        words = assembleProgramWords(&code, &symbols, threadCount);
+        writeOutputTko(outputPath, &code, &data, words, &symbols);
+
+        if (writeMap)
+        {
+            writeSourceMap(outputPath, &code, &symbols, &inputPath, 1);
+        }
+    }
+
+    free(words);
+    freeRecordList(&code);
+    freeRecordList(&data);
+    freeSymbolTable(&symbols);
+    releaseInternPool(&labelNames);
+    arenaRelease(&lineArena);
+    arenaRelease(&assemblyArena);
+
+    return 0;
+}
+
+static int linkerMain(int argc, char **argv)
+{
+    const char *outputPath = NULL;
+    const char **sourceNames = NULL;
+    bool optimize = false;
+    bool writeMap = false;
+    bool sawCodeDirective = false;
+    int threadCount = 1;
+    int argi = 1;
+
+    ProgramRecordList code;
+    ProgramRecordList data;
+    SymbolTable symbols;
+
+    uint32_t *words = NULL;
+
+    while (argi < argc && argv[argi][0] == '-')
+    {
+        const char *count = NULL;
+
+        if (strcmp(argv[argi], "-O") == 0)
+        {
+            optimize = true;
+            argi++;
+            continue;
+        }
+
+        if (strcmp(argv[argi], "--map") == 0)
+        {
+            writeMap = true;
+            argi++;
+            continue;
+        }
+
+        if (strcmp(argv[argi], "-o") == 0 && argi + 1 < argc)
+        {
+            outputPath = argv[argi + 1];
+            argi += 2;
+            continue;
+        }
+
+        if (strncmp(argv[argi], "-j", 2) != 0)
+        {
+            break;
+        }
+
+        count = argv[argi] + 2;
+        if (*count == '\0' && argi + 1 < argc)
+        {
+            argi++;
+            count = argv[argi];
+        }
+
+        threadCount = readThreadCount(count);
+        if (threadCount == 0)
+        {
+            argi = argc;
+            break;
+        }
+
+        argi++;
+    }
+
+    if (outputPath == NULL || argi >= argc)
+    {
+        fprintf(stderr, "Usage: %s [-O] [-j N] [--map] -o output.tko input.tko.o...\n", argv[0]);
+        return 1;
+    }
 
     code.items = NULL;
     code.count = 0;
@@ -1965,16 +5538,44 @@ int main(int argc, char **argv)
     symbols.items = NULL;
     symbols.count = 0;
     symbols.capacity = 0;
+    symbols.slots = NULL;
+    symbols.slotCount = 0;
+
+    sourceNames = (const char **)calloc((size_t)(argc - argi), sizeof(char *));
+    if (sourceNames == NULL)
+    {
+        failBuild("out of memory");
+    }
 
-    buildFromSource(inputPath, &code, &data, &symbols);
+    sawCodeDirective = linkObjects((const char **)(argv + argi), argc - argi, threadCount, sourceNames, &code, &data, &symbols);
+    layoutProgram(&code, &symbols, sawCodeDirective, optimize);
 
-    words = assembleProgramWords(&code, &symbols);
+    words = assembleProgramWords(&code, &symbols, threadCount);
     writeOutputTko(outputPath, &code, &data, words, &symbols);
 
+    if (writeMap)
+    {
+        writeSourceMap(outputPath, &code, &symbols, sourceNames, (size_t)(argc - argi));
+    }
+
+    free(sourceNames);
     free(words);
     freeRecordList(&code);
     freeRecordList(&data);
     freeSymbolTable(&symbols);
+    arenaRelease(&assemblyArena);
 
     return 0;
-}
\ No newline at end of file
+}
+
+#if !TINKER_LIBRARY
+int main(int argc, char **argv)
+{
+    if (TINKER_LINKER)
+    {
+        return linkerMain(argc, argv);
+    }
+
+    return assemblerMain(argc, argv);
+}
+#endif
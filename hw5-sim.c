@@ -1,23 +1,131 @@
+#if defined(__linux__)
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
-
-static const uint64_t ramSizeBytes = 512ULL * 1024ULL;
+#include <setjmp.h>
+
+/* build.sh compiles this file again with -DTINKER_LIBRARY=1, which leaves out main, for libtinkersim. */
+#ifndef TINKER_LIBRARY
+#define TINKER_LIBRARY 0
+#endif
+
+#include "tinker-isa.h"
+#include "tinker-sim.h"
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(TINKER_NO_JIT)
+#define TINKER_JIT 1
+#else
+#define TINKER_JIT 0
+#endif
+
+#if defined(__linux__) && defined(__LP64__) && !defined(TINKER_NO_GUARD_PAGES)
+#define TINKER_GUARD_PAGES 1
+#include <signal.h>
+#else
+#define TINKER_GUARD_PAGES 0
+#endif
+
+#if defined(__linux__)
+#define TINKER_SPARSE_RAM 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define TINKER_SPARSE_RAM 0
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TINKER_POSIX_IO 1
+#include <unistd.h>
+#else
+#define TINKER_POSIX_IO 0
+#endif
+
+static const uint64_t defaultRamSizeBytes = 512ULL * 1024ULL;
 static const uint64_t requiredCodeBase = 0x2000ULL;
 static const uint64_t requiredDataBase = 0x10000ULL;
+static const uint64_t maxFusedWords = 16ULL;
+static const uint64_t guardWindowBytes = 1ULL << 32;
+
+typedef struct CpuState CpuState;
+typedef struct DecodedInstruction DecodedInstruction;
+typedef struct InputReader InputReader;
+typedef struct OutputWriter OutputWriter;
+
+typedef void (*InstructionFn)(CpuState *, const DecodedInstruction *);
+
+typedef enum
+{
+    engineTable,
+    engineThreaded,
+    engineJit
+} EngineKind;
 
 typedef struct
+{
+    const char *path;
+    EngineKind engine;
+    uint64_t ramSize;
+    bool guardedMemory;
+    bool hugePages;
+    bool unbufferedOutput;
+} SimOptions;
+
+enum
+{
+    opcodeStale = 0x20,
+    opcodeConstant = 0x21,
+    opcodeOutsideCode = 0x22
+};
+
+/*
+ * imm is already sign-extended, masked or left raw as the opcode expects.
+ * A fused constant load keeps its final value in imm and covers span words.
+ * endsBlock marks records after which pc must be validated again.
+ */
+struct DecodedInstruction
+{
+    InstructionFn handler;
+    int64_t imm;
+    uint8_t opcode;
+    uint8_t rd;
+    uint8_t rs;
+    uint8_t rt;
+    uint8_t span;
+    bool endsBlock;
+};
+
+struct CpuState
 {
     uint8_t *ram;
+    uint64_t ramSize;
+    size_t ramMappingBytes;
+    size_t ramOffset;
     uint64_t regs[32];
     uint64_t pc;
     bool halted;
-} CpuState;
+    InstructionFn instructions[32];
+    DecodedInstruction *decoded;
+    uint64_t codeBase;
+    uint64_t codeBytes;
+    uint64_t codeWrites;
+    bool guardedMemory;
+    InputReader *input;
+    OutputWriter *output;
+    struct JitState *jit;
+};
 
-typedef void (*InstructionFn)(CpuState *, uint32_t);
+static void executeStaleDecoded(CpuState *cpu, const DecodedInstruction *decoded);
+static void executeOutsideCode(CpuState *cpu, const DecodedInstruction *decoded);
+static void flushStandardOutput(void);
 
 static void failBadFilepath(void)
 {
@@ -25,13 +133,22 @@ static void failBadFilepath(void)
     exit(1);
 }
 
+/* libtinkersim installs a jump here so a failing guest returns a status. */
+static _Thread_local jmp_buf *simulationFailure = NULL;
+
 static void failSimulation(void)
 {
+    if (simulationFailure != NULL)
+    {
+        longjmp(*simulationFailure, 1);
+    }
+
+    flushStandardOutput();
     fprintf(stderr, "Simulation error\n");
     exit(1);
 }
 
-static uint64_t requireValidAddress(int64_t signedAddress, uint64_t bytesNeeded)
+static uint64_t requireValidAddress(const CpuState *cpu, int64_t signedAddress, uint64_t bytesNeeded)
 {
     uint64_t address;
 
@@ -42,7 +159,7 @@ static uint64_t requireValidAddress(int64_t signedAddress, uint64_t bytesNeeded)
 
     address = (uint64_t)signedAddress;
 
-    if (address + bytesNeeded > ramSizeBytes)
+    if (address + bytesNeeded > cpu->ramSize)
     {
         failSimulation();
     }
@@ -50,6 +167,30 @@ static uint64_t requireValidAddress(int64_t signedAddress, uint64_t bytesNeeded)
     return address;
 }
 
+/*
+ * Guarded mode maps guest RAM at the start of a 4 GiB + one page PROT_NONE
+ * reservation. Any address with upper bits set is folded onto the window
+ * end, so every 8-byte access either lands in RAM or faults in the
+ * reservation; negative addresses are huge unsigned values and fold too.
+ */
+static uint64_t guardedAddress(int64_t signedAddress)
+{
+    uint64_t address;
+
+    address = (uint64_t)signedAddress;
+    return ((address >> 32) == 0ULL) ? address : guardWindowBytes;
+}
+
+static uint64_t resolveDataAddress(const CpuState *cpu, int64_t signedAddress)
+{
+    if (cpu->guardedMemory)
+    {
+        return guardedAddress(signedAddress);
+    }
+
+    return requireValidAddress(cpu, signedAddress, 8);
+}
+
 static uint32_t readU32LittleEndian(CpuState *cpu, uint64_t address)
 {
     uint32_t b0;
@@ -95,10 +236,52 @@ static uint64_t readU64LittleEndian(CpuState *cpu, uint64_t address)
     return value;
 }
 
+static void invalidateDecodedRange(CpuState *cpu, uint64_t address, uint64_t byteCount)
+{
+    uint64_t codeEnd;
+    uint64_t first;
+    uint64_t last;
+    uint64_t head;
+
+    codeEnd = cpu->codeBase + cpu->codeBytes;
+
+    if (address >= codeEnd || address + byteCount <= cpu->codeBase)
+    {
+        return;
+    }
+
+    cpu->codeWrites++;
+
+    first = (address > cpu->codeBase) ? address : cpu->codeBase;
+    last = (address + byteCount < codeEnd) ? address + byteCount : codeEnd;
+
+    first = (first - cpu->codeBase) >> 2;
+    last = (last - 1ULL - cpu->codeBase) >> 2;
+
+    head = (first >= maxFusedWords) ? first - maxFusedWords + 1ULL : 0ULL;
+    while (head <= last)
+    {
+        DecodedInstruction *decoded;
+
+        decoded = &cpu->decoded[head];
+
+        if (head >= first || (decoded->opcode == opcodeConstant && head + decoded->span > first))
+        {
+            decoded->handler = executeStaleDecoded;
+            decoded->opcode = opcodeStale;
+            decoded->endsBlock = true;
+        }
+
+        head++;
+    }
+}
+
 static void writeU64LittleEndian(CpuState *cpu, uint64_t address, uint64_t value)
 {
     int i;
 
+    invalidateDecodedRange(cpu, address, 8);
+
     i = 0;
     while (i < 8)
     {
@@ -189,44 +372,344 @@ static uint64_t float64ToBits(double value)
     return bits;
 }
 
-static uint64_t readUnsignedFromStdinStrict(void)
+/*
+ * Port-0 input keeps scanf("%255s") + strtoull semantics: tokens are split
+ * on C-locale whitespace and cut at 255 bytes, a token must be unsigned
+ * decimal digits (an embedded NUL ends it, as it ends strtoull), and
+ * overflow or EOF before a token is a simulation error.
+ */
+enum
+{
+    inputBufferBytes = 65536,
+    inputTokenLimit = 255
+};
+
+struct InputReader
+{
+    uint8_t bytes[inputBufferBytes];
+    size_t start;
+    size_t end;
+    bool atEof;
+    size_t (*read)(void *user, char *bytes, size_t size);
+    void *user;
+};
+
+/*
+ * Port 1 and port 3 output collects here and reaches fd 1 (or a library
+ * callback) when the buffer fills, before a blocking read of port-0 input,
+ * on halt and on failSimulation. --unbuffered writes every out instruction
+ * through.
+ */
+enum
+{
+    outputBufferBytes = 65536
+};
+
+struct OutputWriter
+{
+    uint8_t bytes[outputBufferBytes];
+    size_t used;
+    bool unbuffered;
+    void (*write)(void *user, const char *bytes, size_t count);
+    void *user;
+};
+
+static OutputWriter stdoutWriter;
+
+static void writeStandardOutput(void *user, const char *bytes, size_t count)
 {
-    char text[256];
-    char *end;
-    unsigned long long parsed;
-    uint64_t result;
+    size_t done;
+
+    (void)user;
+    done = 0;
 
-    if (scanf("%255s", text) != 1)
+#if TINKER_POSIX_IO
+    while (done < count)
     {
-        failSimulation();
+        ssize_t written;
+
+        written = write(1, bytes + done, count - done);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (written <= 0)
+        {
+            break;
+        }
+
+        done += (size_t)written;
     }
+#else
+    (void)done;
+    fwrite(bytes, 1, count, stdout);
+    fflush(stdout);
+#endif
+}
 
-    if (text[0] == '-' || text[0] == '+')
+static void flushOutput(OutputWriter *writer)
+{
+    if (writer->used != 0)
     {
-        failSimulation();
+        writer->write(writer->user, (const char *)writer->bytes, writer->used);
+    }
+
+    writer->used = 0;
+}
+
+static void flushStandardOutput(void)
+{
+    flushOutput(&stdoutWriter);
+}
+
+static void writeOutput(OutputWriter *writer, const uint8_t *bytes, size_t count)
+{
+    if (outputBufferBytes - writer->used < count)
+    {
+        flushOutput(writer);
+    }
+
+    memcpy(writer->bytes + writer->used, bytes, count);
+    writer->used += count;
+
+    if (writer->unbuffered)
+    {
+        flushOutput(writer);
+    }
+}
+
+static void writeUnsignedLine(OutputWriter *writer, uint64_t value)
+{
+    static const char digitPairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+                                     "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+                                     "8081828384858687888990919293949596979899";
+    uint8_t text[21];
+    size_t at;
+
+    at = sizeof(text);
+    text[--at] = '\n';
+
+    while (value >= 100ULL)
+    {
+        size_t pair;
+
+        pair = (size_t)(value % 100ULL) * 2;
+        value /= 100ULL;
+        text[--at] = (uint8_t)digitPairs[pair + 1];
+        text[--at] = (uint8_t)digitPairs[pair];
+    }
+
+    if (value >= 10ULL)
+    {
+        text[--at] = (uint8_t)digitPairs[value * 2 + 1];
+        text[--at] = (uint8_t)digitPairs[value * 2];
+    }
+    else
+    {
+        text[--at] = (uint8_t)('0' + value);
+    }
+
+    writeOutput(writer, text + at, sizeof(text) - at);
+}
+
+static bool isInputSpace(uint8_t c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static size_t readStandardInput(void *user, char *bytes, size_t size)
+{
+    (void)user;
+
+#if TINKER_POSIX_IO
+    {
+        ssize_t count;
+
+        do
+        {
+            count = read(0, bytes, size);
+        } while (count < 0 && errno == EINTR);
+
+        return (count > 0) ? (size_t)count : 0;
+    }
+#else
+    if (fgets(bytes, (int)size, stdin) == NULL)
+    {
+        return 0;
+    }
+
+    return strlen(bytes);
+#endif
+}
+
+static void refillInput(InputReader *reader, OutputWriter *writer)
+{
+    size_t got;
+
+    flushOutput(writer);
+
+    if (reader->start != 0)
+    {
+        memmove(reader->bytes, reader->bytes + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+
+    got = reader->read(reader->user, (char *)reader->bytes + reader->end, inputBufferBytes - reader->end);
+
+    if (got == 0)
+    {
+        reader->atEof = true;
+    }
+
+    reader->end += got;
+}
+
+static uint64_t loadEightDigits(const uint8_t *text)
+{
+    uint64_t chunk;
+    int i;
+
+    chunk = 0;
+    i = 0;
+    while (i < 8)
+    {
+        chunk |= ((uint64_t)text[i]) << (uint64_t)(8 * i);
+        i++;
+    }
+
+    return chunk;
+}
+
+static bool isEightDigits(uint64_t chunk)
+{
+    return ((chunk & 0xF0F0F0F0F0F0F0F0ULL) | (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ==
+           0x3333333333333333ULL;
+}
+
+static uint64_t parseEightDigits(uint64_t chunk)
+{
+    chunk -= 0x3030303030303030ULL;
+    chunk = (chunk * 10ULL) + (chunk >> 8);
+    chunk = (((chunk & 0x000000FF000000FFULL) * (100ULL + (1000000ULL << 32))) +
+             (((chunk >> 16) & 0x000000FF000000FFULL) * (1ULL + (10000ULL << 32)))) >>
+            32;
+    return chunk;
+}
+
+static uint64_t parseDecimalToken(const uint8_t *text, size_t length)
+{
+    static const char maxDigits[] = "18446744073709551615";
+    const uint8_t *nul;
+    uint64_t value;
+    size_t i;
+
+    nul = (const uint8_t *)memchr(text, '\0', length);
+    if (nul != NULL)
+    {
+        length = (size_t)(nul - text);
     }
 
-    errno = 0;
-    end = NULL;
-    parsed = strtoull(text, &end, 10);
+    while (length > 0 && *text == '0')
+    {
+        text++;
+        length--;
+    }
 
-    if (errno != 0)
+    if (length > 20)
     {
         failSimulation();
     }
 
-    if (end == NULL)
+    value = 0;
+    i = 0;
+    while (i + 8 <= length)
+    {
+        uint64_t chunk;
+
+        chunk = loadEightDigits(text + i);
+        if (!isEightDigits(chunk))
+        {
+            failSimulation();
+        }
+
+        value = value * 100000000ULL + parseEightDigits(chunk);
+        i += 8;
+    }
+
+    while (i < length)
+    {
+        if (text[i] < '0' || text[i] > '9')
+        {
+            failSimulation();
+        }
+
+        value = value * 10ULL + (uint64_t)(text[i] - '0');
+        i++;
+    }
+
+    if (length == 20 && memcmp(text, maxDigits, 20) > 0)
     {
         failSimulation();
     }
 
-    if (*end != '\0')
+    return value;
+}
+
+static uint64_t readUnsignedInputStrict(CpuState *cpu)
+{
+    InputReader *reader;
+    size_t length;
+    uint64_t value;
+
+    reader = cpu->input;
+
+    for (;;)
+    {
+        while (reader->start < reader->end && isInputSpace(reader->bytes[reader->start]))
+        {
+            reader->start++;
+        }
+
+        if (reader->start < reader->end)
+        {
+            break;
+        }
+
+        if (reader->atEof)
+        {
+            failSimulation();
+        }
+
+        refillInput(reader, cpu->output);
+    }
+
+    length = 0;
+    for (;;)
+    {
+        while (length < inputTokenLimit && reader->start + length < reader->end &&
+               !isInputSpace(reader->bytes[reader->start + length]))
+        {
+            length++;
+        }
+
+        if (length == inputTokenLimit || reader->start + length < reader->end || reader->atEof)
+        {
+            break;
+        }
+
+        refillInput(reader, cpu->output);
+    }
+
+    if (reader->bytes[reader->start] == '-' || reader->bytes[reader->start] == '+')
     {
         failSimulation();
     }
 
-    result = (uint64_t)parsed;
-    return result;
+    value = parseDecimalToken(reader->bytes + reader->start, length);
+    reader->start += length;
+    return value;
 }
 
 static uint64_t readU64LittleEndianFromFile(FILE *file)
@@ -269,246 +752,412 @@ static void readExactBytes(FILE *file, uint8_t *dst, uint64_t count)
     }
 }
 
-static void loadProgramImage(CpuState *cpu, const char *path)
+typedef struct
 {
-    FILE *file;
     uint64_t fileType;
     uint64_t codeBase;
     uint64_t codeBytes;
     uint64_t dataBase;
     uint64_t dataBytes;
+} ImageHeader;
+
+static const uint64_t imageHeaderBytes = 40ULL;
 
+static bool imageHeaderFits(const CpuState *cpu, const ImageHeader *header)
+{
     uint64_t codeEnd;
     uint64_t dataEnd;
 
-    file = fopen(path, "rb");
-    if (file == NULL)
-    {
-        failBadFilepath();
-    }
-
-    fileType = readU64LittleEndianFromFile(file);
-    codeBase = readU64LittleEndianFromFile(file);
-    codeBytes = readU64LittleEndianFromFile(file);
-    dataBase = readU64LittleEndianFromFile(file);
-    dataBytes = readU64LittleEndianFromFile(file);
-
-    if (fileType != 0ULL)
-    {
-        fclose(file);
-        failSimulation();
-    }
-
-    if (codeBase != requiredCodeBase)
-    {
-        fclose(file);
-        failSimulation();
-    }
-
-    if (dataBase != requiredDataBase)
+    if (header->fileType != 0ULL)
     {
-        fclose(file);
-        failSimulation();
+        return false;
     }
 
-    if ((codeBytes % 4ULL) != 0ULL)
+    if (header->codeBase != requiredCodeBase || header->dataBase != requiredDataBase)
     {
-        fclose(file);
-        failSimulation();
+        return false;
     }
 
-    if ((dataBytes % 8ULL) != 0ULL)
+    if ((header->codeBytes % 4ULL) != 0ULL || (header->dataBytes % 8ULL) != 0ULL)
     {
-        fclose(file);
-        failSimulation();
+        return false;
     }
 
-    codeEnd = codeBase + codeBytes;
-    dataEnd = dataBase + dataBytes;
-
-    if (codeEnd > ramSizeBytes)
-    {
-        fclose(file);
-        failSimulation();
-    }
+    codeEnd = header->codeBase + header->codeBytes;
+    dataEnd = header->dataBase + header->dataBytes;
 
-    if (dataEnd > ramSizeBytes)
+    if (codeEnd > cpu->ramSize || dataEnd > cpu->ramSize)
     {
-        fclose(file);
-        failSimulation();
+        return false;
     }
 
-    if (codeBytes != 0ULL && dataBytes != 0ULL)
+    if (header->codeBytes != 0ULL && header->dataBytes != 0ULL)
     {
-        if (codeBase < dataEnd && dataBase < codeEnd)
+        if (header->codeBase < dataEnd && header->dataBase < codeEnd)
         {
-            fclose(file);
-            failSimulation();
+            return false;
         }
     }
 
-    readExactBytes(file, cpu->ram + codeBase, codeBytes);
-    readExactBytes(file, cpu->ram + dataBase, dataBytes);
-
-    fclose(file);
-
-    cpu->pc = codeBase;
+    return true;
 }
 
-static void executeIllegal(CpuState *cpu, uint32_t instruction)
+static void finishProgramLoad(CpuState *cpu, const ImageHeader *header)
 {
-    (void)cpu;
-    (void)instruction;
-    failSimulation();
+    cpu->pc = header->codeBase;
+    cpu->codeBase = header->codeBase;
+    cpu->codeBytes = header->codeBytes;
 }
 
-static void executeAnd(CpuState *cpu, uint32_t instruction)
+static uint64_t readImageWord(const uint8_t *image, uint64_t offset)
 {
-    uint32_t rd;
-    uint32_t rs;
-    uint32_t rt;
+    uint64_t value;
+    int i;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    rt = getRt(instruction);
+    value = 0;
+    i = 0;
+    while (i < 8)
+    {
+        value |= ((uint64_t)image[offset + (uint64_t)i]) << (uint64_t)(8 * i);
+        i++;
+    }
 
-    cpu->regs[rd] = cpu->regs[rs] & cpu->regs[rt];
-    cpu->pc = cpu->pc + 4;
+    return value;
 }
 
-static void executeOr(CpuState *cpu, uint32_t instruction)
+static void readImageHeader(const uint8_t *image, ImageHeader *header)
 {
-    uint32_t rd;
+    header->fileType = readImageWord(image, 0);
+    header->codeBase = readImageWord(image, 8);
+    header->codeBytes = readImageWord(image, 16);
+    header->dataBase = readImageWord(image, 24);
+    header->dataBytes = readImageWord(image, 32);
+}
+
+#if TINKER_SPARSE_RAM
+
+/*
+ * Sparse RAM is mapped with a page of slack, so before anything is copied
+ * in, the guest base slides within it until every data-segment byte sits
+ * at a host address congruent with its file offset, whatever the code size.
+ * Guarded RAM stays put, since its end must fall on a page boundary.
+ */
+static void alignGuestRamToImage(CpuState *cpu, uint64_t fileOffset, const ImageHeader *header)
+{
+    uint64_t pageBytes;
+    size_t offset;
+
+    if (cpu->guardedMemory || cpu->ramMappingBytes == 0)
+    {
+        return;
+    }
+
+    pageBytes = (uint64_t)sysconf(_SC_PAGESIZE);
+    offset = (size_t)((fileOffset - header->dataBase) & (pageBytes - 1ULL));
+    cpu->ram = cpu->ram - cpu->ramOffset + offset;
+    cpu->ramOffset = offset;
+}
+
+/*
+ * Whole pages of the data segment are mapped copy-on-write straight from
+ * the image, so they are only read from disk when touched; only the ragged
+ * ends are copied. Guarded RAM, heap RAM and a failed mmap copy it all.
+ */
+static void placeDataSegment(CpuState *cpu, int fd, const uint8_t *image, uint64_t fileOffset, const ImageHeader *header)
+{
+    uint64_t pageBytes;
+    uint64_t fileStart;
+    uint64_t fileEnd;
+    uint64_t mapStart;
+    uint64_t mapEnd;
+    uint64_t dataEnd;
+    uint64_t hostData;
+    void *placed;
+
+    pageBytes = (uint64_t)sysconf(_SC_PAGESIZE);
+    dataEnd = header->dataBase + header->dataBytes;
+    fileStart = (fileOffset + pageBytes - 1ULL) & ~(pageBytes - 1ULL);
+    fileEnd = (fileOffset + header->dataBytes) & ~(pageBytes - 1ULL);
+    hostData = (uint64_t)(uintptr_t)(cpu->ram + header->dataBase);
+
+    if (cpu->ramMappingBytes == 0 || ((hostData - fileOffset) & (pageBytes - 1ULL)) != 0ULL || fileEnd <= fileStart)
+    {
+        memcpy(cpu->ram + header->dataBase, image + fileOffset, (size_t)header->dataBytes);
+        return;
+    }
+
+    mapStart = header->dataBase + (fileStart - fileOffset);
+    mapEnd = header->dataBase + (fileEnd - fileOffset);
+
+    placed = mmap(cpu->ram + mapStart, (size_t)(mapEnd - mapStart), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, (off_t)fileStart);
+    if (placed == MAP_FAILED)
+    {
+        memcpy(cpu->ram + header->dataBase, image + fileOffset, (size_t)header->dataBytes);
+        return;
+    }
+
+    memcpy(cpu->ram + header->dataBase, image + fileOffset, (size_t)(mapStart - header->dataBase));
+    memcpy(cpu->ram + mapEnd, image + fileOffset + (mapEnd - header->dataBase), (size_t)(dataEnd - mapEnd));
+}
+
+static bool mapProgramImage(CpuState *cpu, const char *path)
+{
+    int fd;
+    struct stat info;
+    void *mapping;
+    const uint8_t *image;
+    uint64_t imageBytes;
+    ImageHeader header;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || (uint64_t)info.st_size < imageHeaderBytes)
+    {
+        close(fd);
+        return false;
+    }
+
+    imageBytes = (uint64_t)info.st_size;
+    mapping = mmap(NULL, (size_t)imageBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+
+    image = (const uint8_t *)mapping;
+    readImageHeader(image, &header);
+
+    if (!imageHeaderFits(cpu, &header))
+    {
+        munmap(mapping, (size_t)imageBytes);
+        close(fd);
+        failSimulation();
+    }
+
+    if (imageBytes - imageHeaderBytes < header.codeBytes || imageBytes - imageHeaderBytes - header.codeBytes < header.dataBytes)
+    {
+        munmap(mapping, (size_t)imageBytes);
+        close(fd);
+        failBadFilepath();
+    }
+
+    alignGuestRamToImage(cpu, imageHeaderBytes + header.codeBytes, &header);
+    memcpy(cpu->ram + header.codeBase, image + imageHeaderBytes, (size_t)header.codeBytes);
+    placeDataSegment(cpu, fd, image, imageHeaderBytes + header.codeBytes, &header);
+
+    munmap(mapping, (size_t)imageBytes);
+    close(fd);
+
+    finishProgramLoad(cpu, &header);
+    return true;
+}
+
+#else
+
+static bool mapProgramImage(CpuState *cpu, const char *path)
+{
+    (void)cpu;
+    (void)path;
+    return false;
+}
+
+#endif
+
+static void loadProgramImage(CpuState *cpu, const char *path)
+{
+    FILE *file;
+    ImageHeader header;
+
+    if (mapProgramImage(cpu, path))
+    {
+        return;
+    }
+
+    file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        failBadFilepath();
+    }
+
+    header.fileType = readU64LittleEndianFromFile(file);
+    header.codeBase = readU64LittleEndianFromFile(file);
+    header.codeBytes = readU64LittleEndianFromFile(file);
+    header.dataBase = readU64LittleEndianFromFile(file);
+    header.dataBytes = readU64LittleEndianFromFile(file);
+
+    if (!imageHeaderFits(cpu, &header))
+    {
+        fclose(file);
+        failSimulation();
+    }
+
+    readExactBytes(file, cpu->ram + header.codeBase, header.codeBytes);
+    readExactBytes(file, cpu->ram + header.dataBase, header.dataBytes);
+
+    fclose(file);
+
+    finishProgramLoad(cpu, &header);
+}
+
+static void executeIllegal(CpuState *cpu, const DecodedInstruction *decoded)
+{
+    (void)cpu;
+    (void)decoded;
+    failSimulation();
+}
+
+static void executeAnd(CpuState *cpu, const DecodedInstruction *decoded)
+{
+    uint32_t rd;
+    uint32_t rs;
+    uint32_t rt;
+
+    rd = decoded->rd;
+    rs = decoded->rs;
+    rt = decoded->rt;
+
+    cpu->regs[rd] = cpu->regs[rs] & cpu->regs[rt];
+    cpu->pc = cpu->pc + 4;
+}
+
+static void executeOr(CpuState *cpu, const DecodedInstruction *decoded)
+{
+    uint32_t rd;
     uint32_t rs;
     uint32_t rt;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    rt = getRt(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
+    rt = decoded->rt;
 
     cpu->regs[rd] = cpu->regs[rs] | cpu->regs[rt];
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeXor(CpuState *cpu, uint32_t instruction)
+static void executeXor(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
     uint32_t rt;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    rt = getRt(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
+    rt = decoded->rt;
 
     cpu->regs[rd] = cpu->regs[rs] ^ cpu->regs[rt];
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeNot(CpuState *cpu, uint32_t instruction)
+static void executeNot(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
 
     cpu->regs[rd] = ~cpu->regs[rs];
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeShiftRightRegister(CpuState *cpu, uint32_t instruction)
+static void executeShiftRightRegister(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
     uint32_t rt;
     uint64_t shiftAmount;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    rt = getRt(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
+    rt = decoded->rt;
 
     shiftAmount = cpu->regs[rt] & 63ULL;
     cpu->regs[rd] = cpu->regs[rs] >> shiftAmount;
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeShiftRightImmediate(CpuState *cpu, uint32_t instruction)
+static void executeShiftRightImmediate(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint64_t shiftAmount;
 
-    rd = getRd(instruction);
+    rd = decoded->rd;
 
-    shiftAmount = (uint64_t)(getImm12(instruction) & 63u);
+    shiftAmount = (uint64_t)decoded->imm;
     cpu->regs[rd] = cpu->regs[rd] >> shiftAmount;
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeShiftLeftRegister(CpuState *cpu, uint32_t instruction)
+static void executeShiftLeftRegister(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
     uint32_t rt;
     uint64_t shiftAmount;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    rt = getRt(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
+    rt = decoded->rt;
 
     shiftAmount = cpu->regs[rt] & 63ULL;
     cpu->regs[rd] = cpu->regs[rs] << shiftAmount;
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeShiftLeftImmediate(CpuState *cpu, uint32_t instruction)
+static void executeShiftLeftImmediate(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint64_t shiftAmount;
 
-    rd = getRd(instruction);
+    rd = decoded->rd;
 
-    shiftAmount = (uint64_t)(getImm12(instruction) & 63u);
+    shiftAmount = (uint64_t)decoded->imm;
     cpu->regs[rd] = cpu->regs[rd] << shiftAmount;
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeBranchAbsolute(CpuState *cpu, uint32_t instruction)
+static void executeBranchAbsolute(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
 
-    rd = getRd(instruction);
+    rd = decoded->rd;
     cpu->pc = cpu->regs[rd];
 }
 
-static void executeBranchRelativeRegister(CpuState *cpu, uint32_t instruction)
+static void executeBranchRelativeRegister(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint64_t offset;
 
-    rd = getRd(instruction);
+    rd = decoded->rd;
     offset = cpu->regs[rd];
 
     cpu->pc = cpu->pc + offset;
 }
 
-static void executeBranchRelativeImmediate(CpuState *cpu, uint32_t instruction)
+static void executeBranchRelativeImmediate(CpuState *cpu, const DecodedInstruction *decoded)
 {
     int64_t offset;
     uint64_t nextPc;
 
-    offset = signExtendImm12(getImm12(instruction));
+    offset = decoded->imm;
     nextPc = (uint64_t)((int64_t)cpu->pc + offset);
 
     cpu->pc = nextPc;
 }
 
-static void executeBranchNotZero(CpuState *cpu, uint32_t instruction)
+static void executeBranchNotZero(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
 
     if (cpu->regs[rs] == 0ULL)
     {
@@ -520,44 +1169,44 @@ static void executeBranchNotZero(CpuState *cpu, uint32_t instruction)
     }
 }
 
-static void executeCall(CpuState *cpu, uint32_t instruction)
+static void executeCall(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint64_t stackPointer;
     int64_t returnAddrSlotSigned;
     uint64_t returnAddrSlot;
 
-    rd = getRd(instruction);
+    rd = decoded->rd;
     stackPointer = cpu->regs[31];
 
     returnAddrSlotSigned = (int64_t)stackPointer - 8;
-    returnAddrSlot = requireValidAddress(returnAddrSlotSigned, 8);
+    returnAddrSlot = resolveDataAddress(cpu, returnAddrSlotSigned);
 
     writeU64LittleEndian(cpu, returnAddrSlot, cpu->pc + 4);
 
     cpu->pc = cpu->regs[rd];
 }
 
-static void executeReturn(CpuState *cpu, uint32_t instruction)
+static void executeReturn(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint64_t stackPointer;
     int64_t returnAddrSlotSigned;
     uint64_t returnAddrSlot;
     uint64_t returnPc;
 
-    (void)instruction;
+    (void)decoded;
 
     stackPointer = cpu->regs[31];
 
     returnAddrSlotSigned = (int64_t)stackPointer - 8;
-    returnAddrSlot = requireValidAddress(returnAddrSlotSigned, 8);
+    returnAddrSlot = resolveDataAddress(cpu, returnAddrSlotSigned);
 
     returnPc = readU64LittleEndian(cpu, returnAddrSlot);
 
     cpu->pc = returnPc;
 }
 
-static void executeBranchGreaterThan(CpuState *cpu, uint32_t instruction)
+static void executeBranchGreaterThan(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
@@ -565,9 +1214,9 @@ static void executeBranchGreaterThan(CpuState *cpu, uint32_t instruction)
     int64_t left;
     int64_t right;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    rt = getRt(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
+    rt = decoded->rt;
 
     left = (int64_t)cpu->regs[rs];
     right = (int64_t)cpu->regs[rt];
@@ -582,16 +1231,16 @@ static void executeBranchGreaterThan(CpuState *cpu, uint32_t instruction)
     }
 }
 
-static void executePrivileged(CpuState *cpu, uint32_t instruction)
+static void executePrivileged(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
     uint32_t imm;
     uint64_t portValue;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    imm = getImm12(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
+    imm = (uint32_t)decoded->imm;
 
     if (imm == 0u)
     {
@@ -605,7 +1254,7 @@ static void executePrivileged(CpuState *cpu, uint32_t instruction)
 
         if (portValue == 0ULL)
         {
-            cpu->regs[rd] = readUnsignedFromStdinStrict();
+            cpu->regs[rd] = readUnsignedInputStrict(cpu);
         }
 
         cpu->pc = cpu->pc + 4;
@@ -618,12 +1267,14 @@ static void executePrivileged(CpuState *cpu, uint32_t instruction)
 
         if (portValue == 1ULL)
         {
-            printf("%llu\n", (unsigned long long)cpu->regs[rs]);
+            writeUnsignedLine(cpu->output, cpu->regs[rs]);
         }
         else if (portValue == 3ULL)
         {
-            putchar((int)(cpu->regs[rs] & 0xFFULL));
-            fflush(stdout);
+            uint8_t character;
+
+            character = (uint8_t)(cpu->regs[rs] & 0xFFULL);
+            writeOutput(cpu->output, &character, 1);
         }
 
         cpu->pc = cpu->pc + 4;
@@ -633,7 +1284,7 @@ static void executePrivileged(CpuState *cpu, uint32_t instruction)
     failSimulation();
 }
 
-static void executeLoad(CpuState *cpu, uint32_t instruction)
+static void executeLoad(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
@@ -641,38 +1292,38 @@ static void executeLoad(CpuState *cpu, uint32_t instruction)
     int64_t addrSigned;
     uint64_t addr;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
 
-    offset = signExtendImm12(getImm12(instruction));
+    offset = decoded->imm;
     addrSigned = (int64_t)cpu->regs[rs] + offset;
-    addr = requireValidAddress(addrSigned, 8);
+    addr = resolveDataAddress(cpu, addrSigned);
 
     cpu->regs[rd] = readU64LittleEndian(cpu, addr);
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeMoveRegister(CpuState *cpu, uint32_t instruction)
+static void executeMoveRegister(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
 
     cpu->regs[rd] = cpu->regs[rs];
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeMoveImmediate(CpuState *cpu, uint32_t instruction)
+static void executeMoveImmediate(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t imm;
     uint64_t current;
     uint64_t updated;
 
-    rd = getRd(instruction);
-    imm = getImm12(instruction);
+    rd = decoded->rd;
+    imm = (uint32_t)decoded->imm;
 
     current = cpu->regs[rd];
     updated = current & ~0xFFFULL;
@@ -682,7 +1333,7 @@ static void executeMoveImmediate(CpuState *cpu, uint32_t instruction)
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeStore(CpuState *cpu, uint32_t instruction)
+static void executeStore(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
@@ -690,18 +1341,18 @@ static void executeStore(CpuState *cpu, uint32_t instruction)
     int64_t addrSigned;
     uint64_t addr;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
 
-    offset = signExtendImm12(getImm12(instruction));
+    offset = decoded->imm;
     addrSigned = (int64_t)cpu->regs[rd] + offset;
-    addr = requireValidAddress(addrSigned, 8);
+    addr = resolveDataAddress(cpu, addrSigned);
 
     writeU64LittleEndian(cpu, addr, cpu->regs[rs]);
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeAddFloat(CpuState *cpu, uint32_t instruction)
+static void executeAddFloat(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
@@ -710,9 +1361,9 @@ static void executeAddFloat(CpuState *cpu, uint32_t instruction)
     double b;
     double result;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    rt = getRt(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
+    rt = decoded->rt;
 
     a = bitsToFloat64(cpu->regs[rs]);
     b = bitsToFloat64(cpu->regs[rt]);
@@ -722,7 +1373,7 @@ static void executeAddFloat(CpuState *cpu, uint32_t instruction)
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeSubFloat(CpuState *cpu, uint32_t instruction)
+static void executeSubFloat(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
@@ -731,9 +1382,9 @@ static void executeSubFloat(CpuState *cpu, uint32_t instruction)
     double b;
     double result;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    rt = getRt(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
+    rt = decoded->rt;
 
     a = bitsToFloat64(cpu->regs[rs]);
     b = bitsToFloat64(cpu->regs[rt]);
@@ -743,7 +1394,7 @@ static void executeSubFloat(CpuState *cpu, uint32_t instruction)
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeMulFloat(CpuState *cpu, uint32_t instruction)
+static void executeMulFloat(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
@@ -752,9 +1403,9 @@ static void executeMulFloat(CpuState *cpu, uint32_t instruction)
     double b;
     double result;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    rt = getRt(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
+    rt = decoded->rt;
 
     a = bitsToFloat64(cpu->regs[rs]);
     b = bitsToFloat64(cpu->regs[rt]);
@@ -764,7 +1415,7 @@ static void executeMulFloat(CpuState *cpu, uint32_t instruction)
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeDivFloat(CpuState *cpu, uint32_t instruction)
+static void executeDivFloat(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
@@ -773,9 +1424,9 @@ static void executeDivFloat(CpuState *cpu, uint32_t instruction)
     double b;
     double result;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    rt = getRt(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
+    rt = decoded->rt;
 
     a = bitsToFloat64(cpu->regs[rs]);
     b = bitsToFloat64(cpu->regs[rt]);
@@ -791,7 +1442,7 @@ static void executeDivFloat(CpuState *cpu, uint32_t instruction)
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeAddInt(CpuState *cpu, uint32_t instruction)
+static void executeAddInt(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
@@ -800,9 +1451,9 @@ static void executeAddInt(CpuState *cpu, uint32_t instruction)
     int64_t b;
     int64_t result;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    rt = getRt(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
+    rt = decoded->rt;
 
     a = (int64_t)cpu->regs[rs];
     b = (int64_t)cpu->regs[rt];
@@ -812,19 +1463,19 @@ static void executeAddInt(CpuState *cpu, uint32_t instruction)
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeAddImmediate(CpuState *cpu, uint32_t instruction)
+static void executeAddImmediate(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t imm;
 
-    rd = getRd(instruction);
-    imm = getImm12(instruction);
+    rd = decoded->rd;
+    imm = (uint32_t)decoded->imm;
 
     cpu->regs[rd] = cpu->regs[rd] + (uint64_t)imm;
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeSubInt(CpuState *cpu, uint32_t instruction)
+static void executeSubInt(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
@@ -833,9 +1484,9 @@ static void executeSubInt(CpuState *cpu, uint32_t instruction)
     int64_t b;
     int64_t result;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    rt = getRt(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
+    rt = decoded->rt;
 
     a = (int64_t)cpu->regs[rs];
     b = (int64_t)cpu->regs[rt];
@@ -845,19 +1496,19 @@ static void executeSubInt(CpuState *cpu, uint32_t instruction)
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeSubImmediate(CpuState *cpu, uint32_t instruction)
+static void executeSubImmediate(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t imm;
 
-    rd = getRd(instruction);
-    imm = getImm12(instruction);
+    rd = decoded->rd;
+    imm = (uint32_t)decoded->imm;
 
     cpu->regs[rd] = cpu->regs[rd] - (uint64_t)imm;
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeMulInt(CpuState *cpu, uint32_t instruction)
+static void executeMulInt(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
@@ -866,9 +1517,9 @@ static void executeMulInt(CpuState *cpu, uint32_t instruction)
     int64_t b;
     int64_t result;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    rt = getRt(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
+    rt = decoded->rt;
 
     a = (int64_t)cpu->regs[rs];
     b = (int64_t)cpu->regs[rt];
@@ -878,7 +1529,7 @@ static void executeMulInt(CpuState *cpu, uint32_t instruction)
     cpu->pc = cpu->pc + 4;
 }
 
-static void executeDivInt(CpuState *cpu, uint32_t instruction)
+static void executeDivInt(CpuState *cpu, const DecodedInstruction *decoded)
 {
     uint32_t rd;
     uint32_t rs;
@@ -887,9 +1538,9 @@ static void executeDivInt(CpuState *cpu, uint32_t instruction)
     int64_t b;
     int64_t result;
 
-    rd = getRd(instruction);
-    rs = getRs(instruction);
-    rt = getRt(instruction);
+    rd = decoded->rd;
+    rs = decoded->rs;
+    rt = decoded->rt;
 
     a = (int64_t)cpu->regs[rs];
     b = (int64_t)cpu->regs[rt];
@@ -916,87 +1567,2054 @@ static void buildInstructionTable(InstructionFn table[32])
         i++;
     }
 
-    table[0x00] = executeAnd;
-    table[0x01] = executeOr;
-    table[0x02] = executeXor;
-    table[0x03] = executeNot;
+#define TINKER_HANDLER_ENTRY(opcode, mnemonic, format, immKind, endsBlock, handler) table[opcode] = handler;
+    TINKER_OPCODES(TINKER_HANDLER_ENTRY)
+#undef TINKER_HANDLER_ENTRY
+}
+
+#define TINKER_IMM_ENTRY(opcode, mnemonic, format, immKind, endsBlock, handler) [opcode] = immKind,
+#define TINKER_FLOW_ENTRY(opcode, mnemonic, format, immKind, endsBlock, handler) [opcode] = endsBlock,
 
-    table[0x04] = executeShiftRightRegister;
-    table[0x05] = executeShiftRightImmediate;
-    table[0x06] = executeShiftLeftRegister;
-    table[0x07] = executeShiftLeftImmediate;
+static const uint8_t opcodeImmKinds[32] = {TINKER_OPCODES(TINKER_IMM_ENTRY)};
+static const bool opcodeEndsBlock[32] = {TINKER_OPCODES(TINKER_FLOW_ENTRY)};
 
-    table[0x08] = executeBranchAbsolute;
-    table[0x09] = executeBranchRelativeRegister;
-    table[0x0A] = executeBranchRelativeImmediate;
-    table[0x0B] = executeBranchNotZero;
-    table[0x0C] = executeCall;
-    table[0x0D] = executeReturn;
-    table[0x0E] = executeBranchGreaterThan;
+#undef TINKER_IMM_ENTRY
+#undef TINKER_FLOW_ENTRY
 
-    table[0x0F] = executePrivileged;
+static void decodeInstruction(const CpuState *cpu, uint32_t instruction, DecodedInstruction *decoded)
+{
+    uint32_t opcode;
+    uint32_t imm12;
 
-    table[0x10] = executeLoad;
-    table[0x11] = executeMoveRegister;
-    table[0x12] = executeMoveImmediate;
-    table[0x13] = executeStore;
+    opcode = getOpcode(instruction);
+    imm12 = getImm12(instruction);
 
-    table[0x14] = executeAddFloat;
-    table[0x15] = executeSubFloat;
-    table[0x16] = executeMulFloat;
-    table[0x17] = executeDivFloat;
+    decoded->handler = cpu->instructions[opcode];
+    decoded->opcode = (uint8_t)opcode;
+    decoded->rd = (uint8_t)getRd(instruction);
+    decoded->rs = (uint8_t)getRs(instruction);
+    decoded->rt = (uint8_t)getRt(instruction);
+    decoded->span = 1;
+    decoded->endsBlock = opcodeEndsBlock[opcode];
 
-    table[0x18] = executeAddInt;
-    table[0x19] = executeAddImmediate;
-    table[0x1A] = executeSubInt;
-    table[0x1B] = executeSubImmediate;
-    table[0x1C] = executeMulInt;
-    table[0x1D] = executeDivInt;
+    if (opcodeImmKinds[opcode] == tinkerImmSigned)
+    {
+        decoded->imm = signExtendImm12(imm12);
+    }
+    else if (opcodeImmKinds[opcode] == tinkerImmShift)
+    {
+        decoded->imm = (int64_t)(imm12 & 63u);
+    }
+    else
+    {
+        decoded->imm = (int64_t)imm12;
+    }
 }
 
-static void runMachine(CpuState *cpu)
+static void executeLoadConstant(CpuState *cpu, const DecodedInstruction *decoded)
 {
-    InstructionFn instructions[32];
+    cpu->regs[decoded->rd] = (uint64_t)decoded->imm;
+    cpu->pc = cpu->pc + 4ULL * decoded->span;
+}
 
-    buildInstructionTable(instructions);
+/*
+ * hw5-asm materialises constants and label addresses as "xor rd, rd, rd"
+ * followed by addi/shftli steps on rd. Replace the head of each such run
+ * with one record that writes the final value; the remaining words stay
+ * decoded so a branch into the middle of the run still executes exactly.
+ */
+static void fuseConstantLoads(CpuState *cpu)
+{
+    uint64_t wordCount;
+    uint64_t i;
 
-    while (cpu->halted == false)
+    wordCount = cpu->codeBytes / 4ULL;
+
+    i = 0;
+    while (i < wordCount)
+    {
+        DecodedInstruction *head;
+        uint64_t value;
+        uint64_t span;
+
+        head = &cpu->decoded[i];
+
+        if (head->opcode != 0x02u || head->rs != head->rd || head->rt != head->rd)
+        {
+            i++;
+            continue;
+        }
+
+        value = 0;
+        span = 1;
+
+        while (i + span < wordCount && span < maxFusedWords)
+        {
+            const DecodedInstruction *step;
+
+            step = &cpu->decoded[i + span];
+
+            if (step->rd != head->rd)
+            {
+                break;
+            }
+
+            if (step->opcode == 0x19u)
+            {
+                value = value + (uint64_t)step->imm;
+            }
+            else if (step->opcode == 0x07u)
+            {
+                value = value << (uint64_t)step->imm;
+            }
+            else if (step->opcode == 0x03u && step->rs == head->rd)
+            {
+                value = ~value;
+            }
+            else
+            {
+                break;
+            }
+
+            span++;
+        }
+
+        if (span > 1)
+        {
+            head->handler = executeLoadConstant;
+            head->opcode = opcodeConstant;
+            head->imm = (int64_t)value;
+            head->span = (uint8_t)span;
+        }
+
+        i += span;
+    }
+}
+
+static void decodeCodeSegment(CpuState *cpu)
+{
+    uint64_t wordCount;
+    uint64_t i;
+
+    wordCount = cpu->codeBytes / 4ULL;
+
+    cpu->decoded = (DecodedInstruction *)calloc((size_t)wordCount + 1, sizeof(DecodedInstruction));
+    if (cpu->decoded == NULL)
+    {
+        failSimulation();
+    }
+
+    i = 0;
+    while (i < wordCount)
     {
-        uint64_t safePc;
         uint32_t instruction;
-        uint32_t opcode;
 
-        safePc = requireValidAddress((int64_t)cpu->pc, 4);
-        instruction = readU32LittleEndian(cpu, safePc);
+        instruction = readU32LittleEndian(cpu, cpu->codeBase + i * 4ULL);
+        decodeInstruction(cpu, instruction, &cpu->decoded[i]);
+        i++;
+    }
+
+    cpu->decoded[wordCount].handler = executeOutsideCode;
+    cpu->decoded[wordCount].opcode = opcodeOutsideCode;
+    cpu->decoded[wordCount].span = 1;
+    cpu->decoded[wordCount].endsBlock = true;
+
+    fuseConstantLoads(cpu);
+}
+
+static void executeStaleDecoded(CpuState *cpu, const DecodedInstruction *decoded)
+{
+    DecodedInstruction *slot;
+    uint32_t instruction;
+
+    slot = cpu->decoded + (decoded - cpu->decoded);
+    instruction = readU32LittleEndian(cpu, cpu->pc);
+
+    decodeInstruction(cpu, instruction, slot);
+    slot->handler(cpu, slot);
+}
+
+static void stepInstruction(CpuState *cpu)
+{
+    const DecodedInstruction *decoded;
+    DecodedInstruction fetched;
+    uint64_t codeOffset;
+
+    codeOffset = cpu->pc - cpu->codeBase;
 
-        opcode = getOpcode(instruction);
-        instructions[opcode](cpu, instruction);
+    if (codeOffset < cpu->codeBytes && (codeOffset & 3ULL) == 0ULL)
+    {
+        decoded = &cpu->decoded[codeOffset >> 2];
+    }
+    else
+    {
+        uint64_t safePc;
+
+        safePc = requireValidAddress(cpu, (int64_t)cpu->pc, 4);
+        decodeInstruction(cpu, readU32LittleEndian(cpu, safePc), &fetched);
+        decoded = &fetched;
     }
+
+    decoded->handler(cpu, decoded);
 }
 
-int main(int argc, char **argv)
+/*
+ * The sentinel record after the last code word, and any pc that is not an
+ * aligned code address, run one instruction straight from RAM.
+ */
+static void executeOutsideCode(CpuState *cpu, const DecodedInstruction *decoded)
 {
-    CpuState cpu;
-    uint8_t *ram;
+    DecodedInstruction fetched;
+    uint64_t safePc;
+
+    (void)decoded;
+
+    safePc = requireValidAddress(cpu, (int64_t)cpu->pc, 4);
+    decodeInstruction(cpu, readU32LittleEndian(cpu, safePc), &fetched);
+    fetched.handler(cpu, &fetched);
+}
+
+static const DecodedInstruction *enterBlock(const CpuState *cpu, uint64_t pc)
+{
+    uint64_t codeOffset;
+
+    codeOffset = pc - cpu->codeBase;
 
-    if (argc != 2)
+    if (codeOffset < cpu->codeBytes && (codeOffset & 3ULL) == 0ULL)
     {
-        failBadFilepath();
+        return &cpu->decoded[codeOffset >> 2];
     }
 
-    ram = (uint8_t *)calloc((size_t)ramSizeBytes, 1);
-    if (ram == NULL)
+    return &cpu->decoded[cpu->codeBytes >> 2];
+}
+
+/*
+ * pc is validated once per block: straight-line records can only advance to
+ * the next record or to the sentinel, so only control transfers re-check.
+ */
+static void runTableEngine(CpuState *cpu)
+{
+    while (cpu->halted == false)
     {
-        failSimulation();
+        const DecodedInstruction *decoded;
+
+        decoded = enterBlock(cpu, cpu->pc);
+
+        for (;;)
+        {
+            decoded->handler(cpu, decoded);
+
+            if (decoded->endsBlock)
+            {
+                break;
+            }
+
+            decoded = decoded + decoded->span;
+        }
     }
+}
 
-    memset(&cpu, 0, sizeof(cpu));
-    cpu.ram = ram;
-    cpu.regs[31] = ramSizeBytes;
+/*
+ * The table engine with an instruction budget, for libtinkersim's counted
+ * runs. A fused constant load counts as the words it covers; when fewer
+ * remain, its first word runs alone straight from RAM.
+ */
+static uint64_t runCountedEngine(CpuState *cpu, uint64_t budget)
+{
+    uint64_t executed;
+
+    executed = 0;
+    while (cpu->halted == false && executed < budget)
+    {
+        const DecodedInstruction *decoded;
 
-    loadProgramImage(&cpu, argv[1]);
-    runMachine(&cpu);
+        decoded = enterBlock(cpu, cpu->pc);
 
-    free(ram);
-    return 0;
-}
\ No newline at end of file
+        for (;;)
+        {
+            if (decoded->span > budget - executed)
+            {
+                executeOutsideCode(cpu, decoded);
+                executed++;
+                break;
+            }
+
+            decoded->handler(cpu, decoded);
+            executed += decoded->span;
+
+            if (decoded->endsBlock || executed == budget)
+            {
+                break;
+            }
+
+            decoded = decoded + decoded->span;
+        }
+    }
+
+    return executed;
+}
+
+#if defined(__GNUC__) && !defined(TINKER_PORTABLE_DISPATCH)
+#define TINKER_COMPUTED_GOTO 1
+#else
+#define TINKER_COMPUTED_GOTO 0
+#endif
+
+/*
+ * Second interpreter core: pc and the register file live in locals and every
+ * handler ends in its own dispatch. With GNU C that dispatch is a computed
+ * goto; elsewhere it falls back to a switch inside a loop.
+ */
+#if TINKER_COMPUTED_GOTO
+#define THREADED_OP(opcode, label) label:
+#define THREADED_DISPATCH() goto *threadedLabels[decoded->opcode]
+#else
+#define THREADED_OP(opcode, label) case opcode:
+#define THREADED_DISPATCH() continue
+#endif
+
+/* Plain braces, not do/while: in the switch build THREADED_DISPATCH is a continue. */
+#define THREADED_ADVANCE(words)    \
+    {                              \
+        pc += 4ULL * (words);      \
+        decoded += (words);        \
+        THREADED_DISPATCH();       \
+    }
+
+#define THREADED_NEXT() THREADED_ADVANCE(1)
+
+#define THREADED_JUMP()                         \
+    {                                           \
+        decoded = enterBlock(cpu, pc);          \
+        THREADED_DISPATCH();                    \
+    }
+
+/*
+ * Faults write the local registers and pc back first, so a library caller
+ * sees the faulting instruction's state as it does with the table engine.
+ */
+#define THREADED_FAIL()                          \
+    {                                            \
+        memcpy(cpu->regs, regs, sizeof(regs));   \
+        cpu->pc = pc;                            \
+        failSimulation();                        \
+    }
+
+#define THREADED_RESOLVE(address, signedAddress)                                    \
+    {                                                                               \
+        int64_t signedTarget = (signedAddress);                                     \
+                                                                                    \
+        if (cpu->guardedMemory)                                                     \
+        {                                                                           \
+            address = guardedAddress(signedTarget);                                 \
+        }                                                                           \
+        else if (signedTarget < 0 || (uint64_t)signedTarget + 8ULL > cpu->ramSize)  \
+        {                                                                           \
+            THREADED_FAIL();                                                        \
+        }                                                                           \
+        else                                                                        \
+        {                                                                           \
+            address = (uint64_t)signedTarget;                                       \
+        }                                                                           \
+    }
+
+#define THREADED_RR(opcode, label, expression)  \
+    THREADED_OP(opcode, label)                  \
+    {                                           \
+        uint64_t a = regs[decoded->rs];         \
+        uint64_t b = regs[decoded->rt];         \
+        (void)b;                                \
+        regs[decoded->rd] = (expression);       \
+        THREADED_NEXT();                        \
+    }
+
+#if TINKER_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+static void runThreadedEngine(CpuState *cpu)
+{
+    uint64_t regs[32];
+    uint64_t pc;
+    DecodedInstruction *table;
+    const DecodedInstruction *decoded;
+
+#if TINKER_COMPUTED_GOTO
+    static void *const threadedLabels[35] = {
+        &&threadedAnd, &&threadedOr, &&threadedXor, &&threadedNot,
+        &&threadedShftr, &&threadedShftri, &&threadedShftl, &&threadedShftli,
+        &&threadedBr, &&threadedBrrReg, &&threadedBrrImm, &&threadedBrnz,
+        &&threadedCall, &&threadedReturn, &&threadedBrgt, &&threadedPriv,
+        &&threadedLoad, &&threadedMovReg, &&threadedMovImm, &&threadedStore,
+        &&threadedAddf, &&threadedSubf, &&threadedMulf, &&threadedDivf,
+        &&threadedAdd, &&threadedAddi, &&threadedSub, &&threadedSubi,
+        &&threadedMul, &&threadedDiv, &&threadedIllegal, &&threadedIllegal,
+        &&threadedStale, &&threadedConstant, &&threadedOutsideCode};
+#endif
+
+    memcpy(regs, cpu->regs, sizeof(regs));
+    pc = cpu->pc;
+    table = cpu->decoded;
+    decoded = enterBlock(cpu, pc);
+
+#if TINKER_COMPUTED_GOTO
+    THREADED_DISPATCH();
+#else
+    for (;;)
+    {
+        switch (decoded->opcode)
+        {
+#endif
+
+    THREADED_RR(0x00, threadedAnd, a & b)
+    THREADED_RR(0x01, threadedOr, a | b)
+    THREADED_RR(0x02, threadedXor, a ^ b)
+    THREADED_RR(0x03, threadedNot, ~a)
+    THREADED_RR(0x04, threadedShftr, a >> (b & 63ULL))
+    THREADED_RR(0x06, threadedShftl, a << (b & 63ULL))
+    THREADED_RR(0x11, threadedMovReg, a)
+    THREADED_RR(0x14, threadedAddf, float64ToBits(bitsToFloat64(a) + bitsToFloat64(b)))
+    THREADED_RR(0x15, threadedSubf, float64ToBits(bitsToFloat64(a) - bitsToFloat64(b)))
+    THREADED_RR(0x16, threadedMulf, float64ToBits(bitsToFloat64(a) * bitsToFloat64(b)))
+    THREADED_RR(0x18, threadedAdd, (uint64_t)((int64_t)a + (int64_t)b))
+    THREADED_RR(0x1A, threadedSub, (uint64_t)((int64_t)a - (int64_t)b))
+    THREADED_RR(0x1C, threadedMul, (uint64_t)((int64_t)a * (int64_t)b))
+
+    THREADED_OP(0x05, threadedShftri)
+    {
+        regs[decoded->rd] = regs[decoded->rd] >> (uint64_t)decoded->imm;
+        THREADED_NEXT();
+    }
+
+    THREADED_OP(0x07, threadedShftli)
+    {
+        regs[decoded->rd] = regs[decoded->rd] << (uint64_t)decoded->imm;
+        THREADED_NEXT();
+    }
+
+    THREADED_OP(0x08, threadedBr)
+    {
+        pc = regs[decoded->rd];
+        THREADED_JUMP();
+    }
+
+    THREADED_OP(0x09, threadedBrrReg)
+    {
+        pc = pc + regs[decoded->rd];
+        THREADED_JUMP();
+    }
+
+    THREADED_OP(0x0A, threadedBrrImm)
+    {
+        pc = (uint64_t)((int64_t)pc + decoded->imm);
+        THREADED_JUMP();
+    }
+
+    THREADED_OP(0x0B, threadedBrnz)
+    {
+        pc = (regs[decoded->rs] == 0ULL) ? pc + 4 : regs[decoded->rd];
+        THREADED_JUMP();
+    }
+
+    THREADED_OP(0x0C, threadedCall)
+    {
+        uint64_t slot = 0;
+        uint64_t target = regs[decoded->rd];
+
+        THREADED_RESOLVE(slot, (int64_t)regs[31] - 8);
+
+        writeU64LittleEndian(cpu, slot, pc + 4);
+        pc = target;
+        THREADED_JUMP();
+    }
+
+    THREADED_OP(0x0D, threadedReturn)
+    {
+        uint64_t slot = 0;
+
+        THREADED_RESOLVE(slot, (int64_t)regs[31] - 8);
+        pc = readU64LittleEndian(cpu, slot);
+        THREADED_JUMP();
+    }
+
+    THREADED_OP(0x0E, threadedBrgt)
+    {
+        pc = ((int64_t)regs[decoded->rs] > (int64_t)regs[decoded->rt]) ? regs[decoded->rd] : pc + 4;
+        THREADED_JUMP();
+    }
+
+    THREADED_OP(0x0F, threadedPriv)
+    {
+        memcpy(cpu->regs, regs, sizeof(regs));
+        cpu->pc = pc;
+
+        executePrivileged(cpu, decoded);
+
+        if (cpu->halted)
+        {
+            return;
+        }
+
+        memcpy(regs, cpu->regs, sizeof(regs));
+        pc = cpu->pc;
+        THREADED_JUMP();
+    }
+
+    THREADED_OP(0x10, threadedLoad)
+    {
+        uint64_t address = 0;
+
+        THREADED_RESOLVE(address, (int64_t)regs[decoded->rs] + decoded->imm);
+        regs[decoded->rd] = readU64LittleEndian(cpu, address);
+        THREADED_NEXT();
+    }
+
+    THREADED_OP(0x12, threadedMovImm)
+    {
+        regs[decoded->rd] = (regs[decoded->rd] & ~0xFFFULL) | (uint64_t)decoded->imm;
+        THREADED_NEXT();
+    }
+
+    THREADED_OP(0x13, threadedStore)
+    {
+        uint64_t address = 0;
+
+        THREADED_RESOLVE(address, (int64_t)regs[decoded->rd] + decoded->imm);
+        writeU64LittleEndian(cpu, address, regs[decoded->rs]);
+        THREADED_NEXT();
+    }
+
+    THREADED_OP(0x17, threadedDivf)
+    {
+        double divisor = bitsToFloat64(regs[decoded->rt]);
+
+        if (divisor == 0.0)
+        {
+            THREADED_FAIL();
+        }
+
+        regs[decoded->rd] = float64ToBits(bitsToFloat64(regs[decoded->rs]) / divisor);
+        THREADED_NEXT();
+    }
+
+    THREADED_OP(0x19, threadedAddi)
+    {
+        regs[decoded->rd] = regs[decoded->rd] + (uint64_t)decoded->imm;
+        THREADED_NEXT();
+    }
+
+    THREADED_OP(0x1B, threadedSubi)
+    {
+        regs[decoded->rd] = regs[decoded->rd] - (uint64_t)decoded->imm;
+        THREADED_NEXT();
+    }
+
+    THREADED_OP(0x1D, threadedDiv)
+    {
+        int64_t divisor = (int64_t)regs[decoded->rt];
+
+        if (divisor == 0)
+        {
+            THREADED_FAIL();
+        }
+
+        regs[decoded->rd] = (uint64_t)((int64_t)regs[decoded->rs] / divisor);
+        THREADED_NEXT();
+    }
+
+    THREADED_OP(opcodeConstant, threadedConstant)
+    {
+        regs[decoded->rd] = (uint64_t)decoded->imm;
+        THREADED_ADVANCE(decoded->span);
+    }
+
+    THREADED_OP(opcodeStale, threadedStale)
+    {
+        DecodedInstruction *slot = table + (decoded - table);
+
+        decodeInstruction(cpu, readU32LittleEndian(cpu, pc), slot);
+        THREADED_DISPATCH();
+    }
+
+    THREADED_OP(opcodeOutsideCode, threadedOutsideCode)
+    {
+        memcpy(cpu->regs, regs, sizeof(regs));
+        cpu->pc = pc;
+
+        executeOutsideCode(cpu, decoded);
+
+        if (cpu->halted)
+        {
+            return;
+        }
+
+        memcpy(regs, cpu->regs, sizeof(regs));
+        pc = cpu->pc;
+        THREADED_JUMP();
+    }
+
+#if TINKER_COMPUTED_GOTO
+threadedIllegal:
+#else
+        default:
+#endif
+    THREADED_FAIL();
+
+#if !TINKER_COMPUTED_GOTO
+        }
+    }
+#endif
+}
+
+#if TINKER_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+#if TINKER_JIT
+
+/*
+ * x86-64 basic-block JIT. Guest registers stay in cpu->regs, reached through
+ * a pinned pointer; generated code owns these host registers:
+ *
+ *   rbx  guest register file      r13  block entry table (one slot per word)
+ *   r12  guest RAM base           r14  ramSize - 8 (load/store limit)
+ *   r15  codeBase                 rbp  codeBytes
+ *
+ * With guarded memory r14 holds the window end instead and load/store
+ * addresses are folded onto it rather than checked.
+ *
+ * A block returns to C with rax = guest pc and rdx = exit info: dispatch,
+ * interpret (priv, faults, code writes, anything the JIT leaves to
+ * stepInstruction), or the address of a direct jump to patch once its
+ * target block exists.
+ */
+static const size_t jitBufferBytes = 32u * 1024u * 1024u;
+static const size_t jitBlockReserveBytes = 64u * 1024u;
+static const int jitMaxBlockInstructions = 128;
+
+enum
+{
+    jitMaxPendingExits = 512,
+    jitExitDispatch = 0,
+    jitExitInterpret = 1
+};
+
+enum
+{
+    hostRax = 0,
+    hostRcx = 1,
+    hostRdx = 2
+};
+
+typedef struct
+{
+    uint64_t *regs;
+    uint8_t *ram;
+    const uint8_t **blocks;
+    uint64_t ramLimit;
+    uint64_t codeBase;
+    uint64_t codeBytes;
+} JitContext;
+
+typedef struct
+{
+    uint64_t pc;
+    uint64_t info;
+} JitExit;
+
+typedef JitExit (*JitEntryFn)(const JitContext *, const uint8_t *);
+
+typedef struct
+{
+    size_t rel32Offset;
+    uint64_t pc;
+} JitPendingExit;
+
+typedef struct JitState
+{
+    uint8_t *buffer;
+    size_t used;
+    size_t codeStart;
+    size_t epilogue;
+    JitEntryFn enter;
+    JitContext context;
+    const uint8_t **blocks;
+    uint64_t wordCount;
+    uint64_t flushes;
+    uint64_t seenCodeWrites;
+    bool guardedMemory;
+    JitPendingExit pending[jitMaxPendingExits];
+    int pendingCount;
+} JitState;
+
+#define JIT_EMIT(jit, ...) \
+    jitEmitBytes((jit), (const uint8_t[]){__VA_ARGS__}, sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void jitEmitBytes(JitState *jit, const uint8_t *bytes, size_t count)
+{
+    memcpy(jit->buffer + jit->used, bytes, count);
+    jit->used += count;
+}
+
+static void jitEmitU32(JitState *jit, uint32_t value)
+{
+    memcpy(jit->buffer + jit->used, &value, sizeof(value));
+    jit->used += sizeof(value);
+}
+
+static void jitEmitU64(JitState *jit, uint64_t value)
+{
+    memcpy(jit->buffer + jit->used, &value, sizeof(value));
+    jit->used += sizeof(value);
+}
+
+static void jitPatchRel32(JitState *jit, size_t rel32Offset, size_t targetOffset)
+{
+    int32_t rel;
+
+    rel = (int32_t)((int64_t)targetOffset - (int64_t)(rel32Offset + 4));
+    memcpy(jit->buffer + rel32Offset, &rel, sizeof(rel));
+}
+
+static void jitEmitGuestOperand(JitState *jit, int hostReg, unsigned guestReg)
+{
+    uint32_t disp;
+
+    disp = guestReg * 8u;
+
+    if (disp < 128u)
+    {
+        JIT_EMIT(jit, (uint8_t)(0x43 | (hostReg << 3)), (uint8_t)disp);
+    }
+    else
+    {
+        JIT_EMIT(jit, (uint8_t)(0x83 | (hostReg << 3)));
+        jitEmitU32(jit, disp);
+    }
+}
+
+static void jitEmitGuestOp(JitState *jit, uint8_t opcode, int hostReg, unsigned guestReg)
+{
+    JIT_EMIT(jit, 0x48, opcode);
+    jitEmitGuestOperand(jit, hostReg, guestReg);
+}
+
+static void jitEmitGuestLoad(JitState *jit, int hostReg, unsigned guestReg)
+{
+    jitEmitGuestOp(jit, 0x8B, hostReg, guestReg);
+}
+
+static void jitEmitGuestStore(JitState *jit, int hostReg, unsigned guestReg)
+{
+    jitEmitGuestOp(jit, 0x89, hostReg, guestReg);
+}
+
+static void jitEmitGuestSse(JitState *jit, uint8_t opcode, int xmmReg, unsigned guestReg)
+{
+    JIT_EMIT(jit, 0xF2, 0x0F, opcode);
+    jitEmitGuestOperand(jit, xmmReg, guestReg);
+}
+
+static void jitEmitMovImm(JitState *jit, int hostReg, uint64_t value)
+{
+    if (value <= 0xFFFFFFFFULL)
+    {
+        JIT_EMIT(jit, (uint8_t)(0xB8 + hostReg));
+        jitEmitU32(jit, (uint32_t)value);
+    }
+    else
+    {
+        JIT_EMIT(jit, 0x48, (uint8_t)(0xB8 + hostReg));
+        jitEmitU64(jit, value);
+    }
+}
+
+static void jitEmitJumpToEpilogue(JitState *jit)
+{
+    size_t rel32Offset;
+
+    JIT_EMIT(jit, 0xE9);
+    rel32Offset = jit->used;
+    jitEmitU32(jit, 0);
+    jitPatchRel32(jit, rel32Offset, jit->epilogue);
+}
+
+static size_t jitEmitJcc(JitState *jit, uint8_t condition)
+{
+    size_t rel32Offset;
+
+    JIT_EMIT(jit, 0x0F, condition);
+    rel32Offset = jit->used;
+    jitEmitU32(jit, 0);
+    return rel32Offset;
+}
+
+static void jitEmitInterpretExit(JitState *jit, uint64_t pc)
+{
+    jitEmitMovImm(jit, hostRax, pc);
+    JIT_EMIT(jit, 0xBA);
+    jitEmitU32(jit, jitExitInterpret);
+    jitEmitJumpToEpilogue(jit);
+}
+
+static void jitEmitInterpretIf(JitState *jit, uint8_t condition, uint64_t pc)
+{
+    JitPendingExit *pending;
+
+    pending = &jit->pending[jit->pendingCount];
+    pending->rel32Offset = jitEmitJcc(jit, condition);
+    pending->pc = pc;
+    jit->pendingCount++;
+}
+
+static void jitEmitPendingExits(JitState *jit)
+{
+    int i;
+
+    i = 0;
+    while (i < jit->pendingCount)
+    {
+        jitPatchRel32(jit, jit->pending[i].rel32Offset, jit->used);
+        jitEmitInterpretExit(jit, jit->pending[i].pc);
+        i++;
+    }
+
+    jit->pendingCount = 0;
+}
+
+static void jitEmitDirectExit(JitState *jit, uint64_t targetPc)
+{
+    uint64_t codeOffset;
+    size_t site;
+    size_t leaEnd;
+    int32_t disp;
+
+    codeOffset = targetPc - jit->context.codeBase;
+
+    if (codeOffset >= jit->context.codeBytes || (codeOffset & 3ULL) != 0ULL)
+    {
+        jitEmitMovImm(jit, hostRax, targetPc);
+        JIT_EMIT(jit, 0x31, 0xD2);
+        jitEmitJumpToEpilogue(jit);
+        return;
+    }
+
+    if (jit->blocks[codeOffset >> 2] != NULL)
+    {
+        JIT_EMIT(jit, 0xE9);
+        site = jit->used;
+        jitEmitU32(jit, 0);
+        jitPatchRel32(jit, site, (size_t)(jit->blocks[codeOffset >> 2] - jit->buffer));
+        return;
+    }
+
+    site = jit->used;
+    JIT_EMIT(jit, 0xE9, 0x00, 0x00, 0x00, 0x00);
+
+    jitEmitMovImm(jit, hostRax, targetPc);
+    JIT_EMIT(jit, 0x48, 0x8D, 0x15);
+    leaEnd = jit->used + 4;
+    disp = (int32_t)((int64_t)site - (int64_t)leaEnd);
+    jitEmitU32(jit, (uint32_t)disp);
+    jitEmitJumpToEpilogue(jit);
+}
+
+static void jitEmitIndirectExit(JitState *jit)
+{
+    JIT_EMIT(jit, 0x48, 0x89, 0xC1);
+    JIT_EMIT(jit, 0x4C, 0x29, 0xF9);
+    JIT_EMIT(jit, 0x48, 0x39, 0xE9);
+    JIT_EMIT(jit, 0x73, 17);
+    JIT_EMIT(jit, 0xF6, 0xC1, 0x03);
+    JIT_EMIT(jit, 0x75, 12);
+    JIT_EMIT(jit, 0x49, 0x8B, 0x4C, 0x4D, 0x00);
+    JIT_EMIT(jit, 0x48, 0x85, 0xC9);
+    JIT_EMIT(jit, 0x74, 2);
+    JIT_EMIT(jit, 0xFF, 0xE1);
+    JIT_EMIT(jit, 0x31, 0xD2);
+    jitEmitJumpToEpilogue(jit);
+}
+
+static void jitEmitBranchTarget(JitState *jit, const bool known[32], const uint64_t knownValue[32], unsigned guestReg)
+{
+    if (known[guestReg])
+    {
+        jitEmitDirectExit(jit, knownValue[guestReg]);
+        return;
+    }
+
+    jitEmitGuestLoad(jit, hostRax, guestReg);
+    jitEmitIndirectExit(jit);
+}
+
+static void jitEmitBoundsCheck(JitState *jit, uint64_t pc)
+{
+    if (jit->guardedMemory)
+    {
+        JIT_EMIT(jit, 0x48, 0x89, 0xC1);
+        JIT_EMIT(jit, 0x48, 0xC1, 0xE9, 0x20);
+        JIT_EMIT(jit, 0x49, 0x0F, 0x45, 0xC6);
+        return;
+    }
+
+    JIT_EMIT(jit, 0x4C, 0x39, 0xF0);
+    jitEmitInterpretIf(jit, 0x87, pc);
+}
+
+static void jitEmitCodeWriteCheck(JitState *jit, uint64_t pc)
+{
+    JIT_EMIT(jit, 0x48, 0x89, 0xC1);
+    JIT_EMIT(jit, 0x4C, 0x29, 0xF9);
+    JIT_EMIT(jit, 0x48, 0x83, 0xC1, 0x07);
+    JIT_EMIT(jit, 0x49, 0xBB);
+    jitEmitU64(jit, jit->context.codeBytes + 7ULL);
+    JIT_EMIT(jit, 0x4C, 0x39, 0xD9);
+    jitEmitInterpretIf(jit, 0x82, pc);
+}
+
+static void jitEmitRegisterOp(JitState *jit, uint8_t opcode, const DecodedInstruction *decoded)
+{
+    jitEmitGuestLoad(jit, hostRax, decoded->rs);
+    jitEmitGuestOp(jit, opcode, hostRax, decoded->rt);
+    jitEmitGuestStore(jit, hostRax, decoded->rd);
+}
+
+static void jitEmitFloatOp(JitState *jit, uint8_t opcode, const DecodedInstruction *decoded)
+{
+    jitEmitGuestSse(jit, 0x10, 0, decoded->rs);
+    jitEmitGuestSse(jit, opcode, 0, decoded->rt);
+    jitEmitGuestSse(jit, 0x11, 0, decoded->rd);
+}
+
+static void jitEmitImmediateOp(JitState *jit, uint8_t opcode, const DecodedInstruction *decoded)
+{
+    jitEmitGuestLoad(jit, hostRax, decoded->rd);
+    JIT_EMIT(jit, 0x48, opcode);
+    jitEmitU32(jit, (uint32_t)decoded->imm);
+    jitEmitGuestStore(jit, hostRax, decoded->rd);
+}
+
+static void jitEmitShiftImmediate(JitState *jit, uint8_t modrm, const DecodedInstruction *decoded)
+{
+    jitEmitGuestLoad(jit, hostRax, decoded->rd);
+    JIT_EMIT(jit, 0x48, 0xC1, modrm, (uint8_t)decoded->imm);
+    jitEmitGuestStore(jit, hostRax, decoded->rd);
+}
+
+static void jitEmitShiftRegister(JitState *jit, uint8_t modrm, const DecodedInstruction *decoded)
+{
+    jitEmitGuestLoad(jit, hostRax, decoded->rs);
+    jitEmitGuestLoad(jit, hostRcx, decoded->rt);
+    JIT_EMIT(jit, 0x48, 0xD3, modrm);
+    jitEmitGuestStore(jit, hostRax, decoded->rd);
+}
+
+static void jitEmitEffectiveAddress(JitState *jit, unsigned baseReg, int64_t offset, uint64_t pc)
+{
+    jitEmitGuestLoad(jit, hostRax, baseReg);
+    JIT_EMIT(jit, 0x48, 0x05);
+    jitEmitU32(jit, (uint32_t)(int32_t)offset);
+    jitEmitBoundsCheck(jit, pc);
+}
+
+static void jitEmitStackSlot(JitState *jit, uint64_t pc)
+{
+    jitEmitGuestLoad(jit, hostRax, 31);
+    JIT_EMIT(jit, 0x48, 0x83, 0xE8, 0x08);
+    jitEmitBoundsCheck(jit, pc);
+}
+
+static const uint8_t *jitTranslateBlock(JitState *jit, CpuState *cpu, uint64_t pc)
+{
+    const uint8_t *entry;
+    bool known[32];
+    uint64_t knownValue[32];
+    uint64_t index;
+    int count;
+    bool open;
+
+    entry = jit->buffer + jit->used;
+    memset(known, 0, sizeof(known));
+    memset(knownValue, 0, sizeof(knownValue));
+
+    index = (pc - cpu->codeBase) >> 2;
+    count = 0;
+    open = true;
+
+    while (open)
+    {
+        DecodedInstruction *decoded;
+
+        if (index >= jit->wordCount || count >= jitMaxBlockInstructions)
+        {
+            jitEmitDirectExit(jit, pc);
+            break;
+        }
+
+        decoded = &cpu->decoded[index];
+        if (decoded->opcode == opcodeStale)
+        {
+            decodeInstruction(cpu, readU32LittleEndian(cpu, pc), decoded);
+        }
+
+        if (decoded->opcode != 0x13u && (decoded->opcode < 0x08u || decoded->opcode > 0x0Fu))
+        {
+            known[decoded->rd] = false;
+        }
+
+        switch (decoded->opcode)
+        {
+        case 0x00:
+            jitEmitRegisterOp(jit, 0x23, decoded);
+            break;
+        case 0x01:
+            jitEmitRegisterOp(jit, 0x0B, decoded);
+            break;
+        case 0x02:
+            jitEmitRegisterOp(jit, 0x33, decoded);
+            break;
+        case 0x03:
+            jitEmitGuestLoad(jit, hostRax, decoded->rs);
+            JIT_EMIT(jit, 0x48, 0xF7, 0xD0);
+            jitEmitGuestStore(jit, hostRax, decoded->rd);
+            break;
+        case 0x04:
+            jitEmitShiftRegister(jit, 0xE8, decoded);
+            break;
+        case 0x05:
+            jitEmitShiftImmediate(jit, 0xE8, decoded);
+            break;
+        case 0x06:
+            jitEmitShiftRegister(jit, 0xE0, decoded);
+            break;
+        case 0x07:
+            jitEmitShiftImmediate(jit, 0xE0, decoded);
+            break;
+        case 0x08:
+            jitEmitBranchTarget(jit, known, knownValue, decoded->rd);
+            open = false;
+            break;
+        case 0x09:
+            jitEmitGuestLoad(jit, hostRax, decoded->rd);
+            jitEmitMovImm(jit, hostRcx, pc);
+            JIT_EMIT(jit, 0x48, 0x01, 0xC8);
+            jitEmitIndirectExit(jit);
+            open = false;
+            break;
+        case 0x0A:
+            jitEmitDirectExit(jit, (uint64_t)((int64_t)pc + decoded->imm));
+            open = false;
+            break;
+        case 0x0B:
+        {
+            size_t taken;
+
+            jitEmitGuestLoad(jit, hostRax, decoded->rs);
+            JIT_EMIT(jit, 0x48, 0x85, 0xC0);
+            taken = jitEmitJcc(jit, 0x85);
+            jitEmitDirectExit(jit, pc + 4);
+            jitPatchRel32(jit, taken, jit->used);
+            jitEmitBranchTarget(jit, known, knownValue, decoded->rd);
+            open = false;
+            break;
+        }
+        case 0x0C:
+            jitEmitStackSlot(jit, pc);
+            jitEmitCodeWriteCheck(jit, pc);
+            jitEmitMovImm(jit, hostRcx, pc + 4);
+            JIT_EMIT(jit, 0x49, 0x89, 0x0C, 0x04);
+            jitEmitBranchTarget(jit, known, knownValue, decoded->rd);
+            open = false;
+            break;
+        case 0x0D:
+            jitEmitStackSlot(jit, pc);
+            JIT_EMIT(jit, 0x49, 0x8B, 0x04, 0x04);
+            jitEmitIndirectExit(jit);
+            open = false;
+            break;
+        case 0x0E:
+        {
+            size_t taken;
+
+            jitEmitGuestLoad(jit, hostRax, decoded->rs);
+            jitEmitGuestOp(jit, 0x3B, hostRax, decoded->rt);
+            taken = jitEmitJcc(jit, 0x8F);
+            jitEmitDirectExit(jit, pc + 4);
+            jitPatchRel32(jit, taken, jit->used);
+            jitEmitBranchTarget(jit, known, knownValue, decoded->rd);
+            open = false;
+            break;
+        }
+        case 0x10:
+            jitEmitEffectiveAddress(jit, decoded->rs, decoded->imm, pc);
+            JIT_EMIT(jit, 0x49, 0x8B, 0x04, 0x04);
+            jitEmitGuestStore(jit, hostRax, decoded->rd);
+            break;
+        case 0x11:
+            jitEmitGuestLoad(jit, hostRax, decoded->rs);
+            jitEmitGuestStore(jit, hostRax, decoded->rd);
+            break;
+        case 0x12:
+            jitEmitGuestLoad(jit, hostRax, decoded->rd);
+            JIT_EMIT(jit, 0x48, 0x25, 0x00, 0xF0, 0xFF, 0xFF);
+            JIT_EMIT(jit, 0x48, 0x0D);
+            jitEmitU32(jit, (uint32_t)decoded->imm);
+            jitEmitGuestStore(jit, hostRax, decoded->rd);
+            break;
+        case 0x13:
+            jitEmitEffectiveAddress(jit, decoded->rd, decoded->imm, pc);
+            jitEmitCodeWriteCheck(jit, pc);
+            jitEmitGuestLoad(jit, hostRcx, decoded->rs);
+            JIT_EMIT(jit, 0x49, 0x89, 0x0C, 0x04);
+            break;
+        case 0x14:
+            jitEmitFloatOp(jit, 0x58, decoded);
+            break;
+        case 0x15:
+            jitEmitFloatOp(jit, 0x5C, decoded);
+            break;
+        case 0x16:
+            jitEmitFloatOp(jit, 0x59, decoded);
+            break;
+        case 0x17:
+            jitEmitGuestSse(jit, 0x10, 1, decoded->rt);
+            JIT_EMIT(jit, 0x66, 0x0F, 0x57, 0xD2);
+            JIT_EMIT(jit, 0x66, 0x0F, 0x2E, 0xCA);
+            JIT_EMIT(jit, 0x7A, 0x06);
+            jitEmitInterpretIf(jit, 0x84, pc);
+            jitEmitGuestSse(jit, 0x10, 0, decoded->rs);
+            JIT_EMIT(jit, 0xF2, 0x0F, 0x5E, 0xC1);
+            jitEmitGuestSse(jit, 0x11, 0, decoded->rd);
+            break;
+        case 0x18:
+            jitEmitRegisterOp(jit, 0x03, decoded);
+            break;
+        case 0x19:
+            jitEmitImmediateOp(jit, 0x05, decoded);
+            break;
+        case 0x1A:
+            jitEmitRegisterOp(jit, 0x2B, decoded);
+            break;
+        case 0x1B:
+            jitEmitImmediateOp(jit, 0x2D, decoded);
+            break;
+        case 0x1C:
+            jitEmitGuestLoad(jit, hostRax, decoded->rs);
+            JIT_EMIT(jit, 0x48, 0x0F, 0xAF);
+            jitEmitGuestOperand(jit, hostRax, decoded->rt);
+            jitEmitGuestStore(jit, hostRax, decoded->rd);
+            break;
+        case 0x1D:
+            jitEmitGuestLoad(jit, hostRcx, decoded->rt);
+            JIT_EMIT(jit, 0x48, 0x8D, 0x51, 0x01);
+            JIT_EMIT(jit, 0x48, 0x83, 0xFA, 0x01);
+            jitEmitInterpretIf(jit, 0x86, pc);
+            jitEmitGuestLoad(jit, hostRax, decoded->rs);
+            JIT_EMIT(jit, 0x48, 0x99);
+            JIT_EMIT(jit, 0x48, 0xF7, 0xF9);
+            jitEmitGuestStore(jit, hostRax, decoded->rd);
+            break;
+        case opcodeConstant:
+            jitEmitMovImm(jit, hostRax, (uint64_t)decoded->imm);
+            jitEmitGuestStore(jit, hostRax, decoded->rd);
+            known[decoded->rd] = true;
+            knownValue[decoded->rd] = (uint64_t)decoded->imm;
+            pc += 4ULL * (decoded->span - 1u);
+            index += decoded->span - 1u;
+            break;
+        default:
+            jitEmitInterpretExit(jit, pc);
+            open = false;
+            break;
+        }
+
+        pc += 4;
+        index++;
+        count++;
+    }
+
+    jitEmitPendingExits(jit);
+    return entry;
+}
+
+static void jitFlush(JitState *jit)
+{
+    jit->used = jit->codeStart;
+    memset(jit->blocks, 0, (size_t)(jit->wordCount + 1) * sizeof(*jit->blocks));
+    jit->flushes++;
+}
+
+static const uint8_t *jitBlockFor(JitState *jit, CpuState *cpu, uint64_t pc)
+{
+    uint64_t codeOffset;
+    uint64_t index;
+
+    codeOffset = pc - cpu->codeBase;
+
+    if (codeOffset >= cpu->codeBytes || (codeOffset & 3ULL) != 0ULL)
+    {
+        return NULL;
+    }
+
+    index = codeOffset >> 2;
+
+    if (jit->blocks[index] == NULL)
+    {
+        if (jitBufferBytes - jit->used < jitBlockReserveBytes)
+        {
+            jitFlush(jit);
+        }
+
+        jit->blocks[index] = jitTranslateBlock(jit, cpu, pc);
+    }
+
+    return jit->blocks[index];
+}
+
+static void jitEmitTrampoline(JitState *jit)
+{
+    const void *entry;
+
+    entry = jit->buffer + jit->used;
+
+    JIT_EMIT(jit, 0x55, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+    JIT_EMIT(jit, 0x48, 0x8B, 0x5F, (uint8_t)offsetof(JitContext, regs));
+    JIT_EMIT(jit, 0x4C, 0x8B, 0x67, (uint8_t)offsetof(JitContext, ram));
+    JIT_EMIT(jit, 0x4C, 0x8B, 0x6F, (uint8_t)offsetof(JitContext, blocks));
+    JIT_EMIT(jit, 0x4C, 0x8B, 0x77, (uint8_t)offsetof(JitContext, ramLimit));
+    JIT_EMIT(jit, 0x4C, 0x8B, 0x7F, (uint8_t)offsetof(JitContext, codeBase));
+    JIT_EMIT(jit, 0x48, 0x8B, 0x6F, (uint8_t)offsetof(JitContext, codeBytes));
+    JIT_EMIT(jit, 0xFF, 0xE6);
+
+    jit->epilogue = jit->used;
+    JIT_EMIT(jit, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0x5D, 0xC3);
+
+    memcpy(&jit->enter, &entry, sizeof(jit->enter));
+    jit->codeStart = jit->used;
+}
+
+static JitState *jitCreate(CpuState *cpu)
+{
+    JitState *jit;
+    void *buffer;
+
+    jit = (JitState *)calloc(1, sizeof(JitState));
+    if (jit == NULL)
+    {
+        return NULL;
+    }
+
+    buffer = mmap(NULL, jitBufferBytes, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+        free(jit);
+        return NULL;
+    }
+
+    jit->buffer = (uint8_t *)buffer;
+    jit->wordCount = cpu->codeBytes / 4ULL;
+    jit->blocks = (const uint8_t **)calloc((size_t)jit->wordCount + 1, sizeof(*jit->blocks));
+    if (jit->blocks == NULL)
+    {
+        munmap(buffer, jitBufferBytes);
+        free(jit);
+        return NULL;
+    }
+
+    jit->context.regs = cpu->regs;
+    jit->context.ram = cpu->ram;
+    jit->context.blocks = jit->blocks;
+    jit->context.ramLimit = cpu->guardedMemory ? guardWindowBytes : cpu->ramSize - 8ULL;
+    jit->context.codeBase = cpu->codeBase;
+    jit->context.codeBytes = cpu->codeBytes;
+    jit->seenCodeWrites = cpu->codeWrites;
+    jit->guardedMemory = cpu->guardedMemory;
+
+    jitEmitTrampoline(jit);
+    return jit;
+}
+
+static void jitDestroy(JitState *jit)
+{
+    munmap(jit->buffer, jitBufferBytes);
+    free(jit->blocks);
+    free(jit);
+}
+
+static void jitLink(JitState *jit, CpuState *cpu, uint8_t *site)
+{
+    const uint8_t *target;
+    uint64_t flushesBefore;
+
+    flushesBefore = jit->flushes;
+    target = jitBlockFor(jit, cpu, cpu->pc);
+
+    if (target != NULL && jit->flushes == flushesBefore)
+    {
+        jitPatchRel32(jit, (size_t)(site - jit->buffer) + 1, (size_t)(target - jit->buffer));
+    }
+}
+
+static void runJitEngine(CpuState *cpu)
+{
+    JitState *jit;
+
+    jit = jitCreate(cpu);
+    if (jit == NULL)
+    {
+        runThreadedEngine(cpu);
+        return;
+    }
+
+    cpu->jit = jit;
+
+    while (cpu->halted == false)
+    {
+        const uint8_t *entry;
+        JitExit exit;
+
+        entry = jitBlockFor(jit, cpu, cpu->pc);
+
+        if (entry == NULL)
+        {
+            stepInstruction(cpu);
+        }
+        else
+        {
+            exit = jit->enter(&jit->context, entry);
+            cpu->pc = exit.pc;
+
+            if (exit.info == jitExitInterpret)
+            {
+                stepInstruction(cpu);
+            }
+            else if (exit.info != jitExitDispatch)
+            {
+                jitLink(jit, cpu, (uint8_t *)(uintptr_t)exit.info);
+            }
+        }
+
+        if (cpu->codeWrites != jit->seenCodeWrites)
+        {
+            jitFlush(jit);
+            jit->seenCodeWrites = cpu->codeWrites;
+        }
+    }
+
+    cpu->jit = NULL;
+    jitDestroy(jit);
+}
+
+#else
+
+static void runJitEngine(CpuState *cpu)
+{
+    runThreadedEngine(cpu);
+}
+
+#endif
+
+#if TINKER_SPARSE_RAM
+
+static void adviseHugePages(void *ram, uint64_t bytes, bool hugePages)
+{
+#if defined(MADV_HUGEPAGE)
+    if (hugePages)
+    {
+        madvise(ram, (size_t)bytes, MADV_HUGEPAGE);
+    }
+#else
+    (void)ram;
+    (void)bytes;
+    (void)hugePages;
+#endif
+}
+
+static uint8_t *mapSparseRam(CpuState *cpu, bool hugePages)
+{
+    void *mapping;
+    size_t bytes;
+
+    /* The extra page is the slack alignGuestRamToImage slides the base within. */
+    bytes = (size_t)cpu->ramSize + (size_t)sysconf(_SC_PAGESIZE);
+    mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    adviseHugePages(mapping, bytes, hugePages);
+    cpu->ramMappingBytes = bytes;
+    cpu->ramOffset = 0;
+    return (uint8_t *)mapping;
+}
+
+#else
+
+static uint8_t *mapSparseRam(CpuState *cpu, bool hugePages)
+{
+    (void)cpu;
+    (void)hugePages;
+    return NULL;
+}
+
+#endif
+
+#if TINKER_GUARD_PAGES
+
+static sigjmp_buf guardFaultJump;
+static uint8_t *guardReservation;
+static size_t guardReservationBytes;
+
+static void handleGuardFault(int signalNumber, siginfo_t *info, void *context)
+{
+    uint8_t *address;
+
+    (void)context;
+    address = (uint8_t *)info->si_addr;
+
+    if (address >= guardReservation && address < guardReservation + guardReservationBytes)
+    {
+        siglongjmp(guardFaultJump, 1);
+    }
+
+    signal(signalNumber, SIG_DFL);
+}
+
+static uint8_t *mapGuardedRam(CpuState *cpu, bool hugePages)
+{
+    struct sigaction action;
+    void *reservation;
+
+    if (cpu->ramSize > guardWindowBytes)
+    {
+        return NULL;
+    }
+
+    guardReservationBytes = (size_t)guardWindowBytes + (size_t)sysconf(_SC_PAGESIZE);
+    reservation = mmap(NULL, guardReservationBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reservation == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    if (mprotect(reservation, (size_t)cpu->ramSize, PROT_READ | PROT_WRITE) != 0)
+    {
+        munmap(reservation, guardReservationBytes);
+        return NULL;
+    }
+
+    adviseHugePages(reservation, cpu->ramSize, hugePages);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handleGuardFault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, NULL);
+    sigaction(SIGBUS, &action, NULL);
+
+    guardReservation = (uint8_t *)reservation;
+    cpu->ramMappingBytes = guardReservationBytes;
+    return guardReservation;
+}
+
+#else
+
+static uint8_t *mapGuardedRam(CpuState *cpu, bool hugePages)
+{
+    (void)cpu;
+    (void)hugePages;
+    return NULL;
+}
+
+#endif
+
+static void allocateGuestRam(CpuState *cpu, bool guarded, bool hugePages)
+{
+    cpu->guardedMemory = false;
+    cpu->ramMappingBytes = 0;
+    cpu->ramOffset = 0;
+
+    if (cpu->ramSize > (uint64_t)SIZE_MAX)
+    {
+        failSimulation();
+    }
+
+    if (guarded)
+    {
+        cpu->ram = mapGuardedRam(cpu, hugePages);
+        cpu->guardedMemory = (cpu->ram != NULL);
+    }
+
+    if (cpu->ram == NULL)
+    {
+        cpu->ram = mapSparseRam(cpu, hugePages);
+    }
+
+    if (cpu->ram == NULL)
+    {
+        cpu->ram = (uint8_t *)calloc((size_t)cpu->ramSize, 1);
+    }
+
+    if (cpu->ram == NULL)
+    {
+        failSimulation();
+    }
+}
+
+static void releaseGuestRam(CpuState *cpu)
+{
+#if TINKER_GUARD_PAGES
+    if (cpu->guardedMemory)
+    {
+        signal(SIGSEGV, SIG_DFL);
+        signal(SIGBUS, SIG_DFL);
+        guardReservation = NULL;
+    }
+#endif
+
+#if TINKER_SPARSE_RAM
+    if (cpu->ramMappingBytes != 0)
+    {
+        munmap(cpu->ram - cpu->ramOffset, cpu->ramMappingBytes);
+        cpu->ram = NULL;
+        return;
+    }
+#endif
+
+    free(cpu->ram);
+    cpu->ram = NULL;
+}
+
+static void runMachine(CpuState *cpu, EngineKind engine)
+{
+    buildInstructionTable(cpu->instructions);
+    decodeCodeSegment(cpu);
+
+#if TINKER_GUARD_PAGES
+    if (cpu->guardedMemory)
+    {
+        if (sigsetjmp(guardFaultJump, 1) != 0)
+        {
+            failSimulation();
+        }
+    }
+#endif
+
+    if (engine == engineJit)
+    {
+        runJitEngine(cpu);
+    }
+    else if (engine == engineThreaded)
+    {
+        runThreadedEngine(cpu);
+    }
+    else
+    {
+        runTableEngine(cpu);
+    }
+
+    free(cpu->decoded);
+    cpu->decoded = NULL;
+}
+
+static bool parseRamSize(const char *text, uint64_t *outBytes)
+{
+    uint64_t value;
+    uint64_t scale;
+
+    value = 0;
+    if (*text < '0' || *text > '9')
+    {
+        return false;
+    }
+
+    while (*text >= '0' && *text <= '9')
+    {
+        if (value > (UINT64_MAX - 9ULL) / 10ULL)
+        {
+            return false;
+        }
+
+        value = value * 10ULL + (uint64_t)(*text - '0');
+        text++;
+    }
+
+    scale = 1ULL;
+    if (*text == 'K' || *text == 'k')
+    {
+        scale = 1ULL << 10;
+        text++;
+    }
+    else if (*text == 'M' || *text == 'm')
+    {
+        scale = 1ULL << 20;
+        text++;
+    }
+    else if (*text == 'G' || *text == 'g')
+    {
+        scale = 1ULL << 30;
+        text++;
+    }
+
+    if (*text != '\0' || value == 0ULL || value > (1ULL << 47) / scale)
+    {
+        return false;
+    }
+
+    value = value * scale;
+    if ((value % 4096ULL) != 0ULL)
+    {
+        return false;
+    }
+
+    *outBytes = value;
+    return true;
+}
+
+static void parseArguments(int argc, char **argv, SimOptions *options)
+{
+    int i;
+
+    memset(options, 0, sizeof(*options));
+    options->engine = engineTable;
+    options->ramSize = defaultRamSizeBytes;
+
+    i = 1;
+    while (i < argc)
+    {
+        const char *arg;
+
+        arg = argv[i];
+
+        if (strcmp(arg, "--engine=table") == 0)
+        {
+            options->engine = engineTable;
+        }
+        else if (strcmp(arg, "--engine=threaded") == 0)
+        {
+            options->engine = engineThreaded;
+        }
+        else if (strcmp(arg, "--engine=jit") == 0)
+        {
+            options->engine = engineJit;
+        }
+        else if (strcmp(arg, "--memory=checked") == 0)
+        {
+            options->guardedMemory = false;
+        }
+        else if (strcmp(arg, "--memory=guarded") == 0)
+        {
+            options->guardedMemory = true;
+        }
+        else if (strncmp(arg, "--ram-size=", 11) == 0)
+        {
+            if (!parseRamSize(arg + 11, &options->ramSize))
+            {
+                failBadFilepath();
+            }
+        }
+        else if (strcmp(arg, "--hugepages") == 0)
+        {
+            options->hugePages = true;
+        }
+        else if (strcmp(arg, "--unbuffered") == 0)
+        {
+            options->unbufferedOutput = true;
+        }
+        else if (arg[0] == '-' && arg[1] == '-')
+        {
+            failBadFilepath();
+        }
+        else if (options->path == NULL)
+        {
+            options->path = arg;
+        }
+        else
+        {
+            failBadFilepath();
+        }
+
+        i++;
+    }
+
+    if (options->path == NULL)
+    {
+        failBadFilepath();
+    }
+}
+
+/*
+ * libtinkersim (tinker-sim.h). A VM decodes its image once at load and
+ * keeps the table across runs; failSimulation longjmps back to the run or
+ * load that installed simulationFailure, which releases any JIT and leaves
+ * the VM failed until the next load.
+ */
+struct TinkerVm
+{
+    CpuState cpu;
+    InputReader input;
+    OutputWriter output;
+    TinkerSimEngine engine;
+    TinkerSimStatus status;
+    const char *inputText;
+    size_t inputSize;
+    size_t inputUsed;
+    char *outputText;
+    size_t outputSize;
+    size_t outputCapacity;
+    bool outputLost;
+};
+
+static size_t readInputText(void *user, char *bytes, size_t size)
+{
+    TinkerVm *vm;
+    size_t count;
+
+    vm = (TinkerVm *)user;
+    count = vm->inputSize - vm->inputUsed;
+    if (count > size)
+    {
+        count = size;
+    }
+
+    memcpy(bytes, vm->inputText + vm->inputUsed, count);
+    vm->inputUsed += count;
+    return count;
+}
+
+static void collectOutputText(void *user, const char *bytes, size_t count)
+{
+    TinkerVm *vm;
+
+    vm = (TinkerVm *)user;
+
+    if (vm->outputCapacity - vm->outputSize < count)
+    {
+        size_t newCapacity;
+        char *bigger;
+
+        newCapacity = (vm->outputCapacity == 0) ? 4096 : vm->outputCapacity;
+        while (newCapacity - vm->outputSize < count)
+        {
+            newCapacity *= 2;
+        }
+
+        bigger = (char *)realloc(vm->outputText, newCapacity);
+        if (bigger == NULL)
+        {
+            vm->outputLost = true;
+            return;
+        }
+
+        vm->outputText = bigger;
+        vm->outputCapacity = newCapacity;
+    }
+
+    memcpy(vm->outputText + vm->outputSize, bytes, count);
+    vm->outputSize += count;
+}
+
+static void clearGuestRam(CpuState *cpu)
+{
+#if TINKER_SPARSE_RAM
+    if (cpu->ramMappingBytes != 0 && madvise(cpu->ram - cpu->ramOffset, cpu->ramMappingBytes, MADV_DONTNEED) == 0)
+    {
+        return;
+    }
+#endif
+
+    memset(cpu->ram, 0, (size_t)cpu->ramSize);
+}
+
+static void releaseJit(CpuState *cpu)
+{
+#if TINKER_JIT
+    if (cpu->jit != NULL)
+    {
+        jitDestroy(cpu->jit);
+        cpu->jit = NULL;
+    }
+#else
+    (void)cpu;
+#endif
+}
+
+static bool allocateVmRam(CpuState *cpu)
+{
+    jmp_buf failure;
+    jmp_buf *outerFailure;
+
+    outerFailure = simulationFailure;
+    simulationFailure = &failure;
+    if (setjmp(failure) != 0)
+    {
+        simulationFailure = outerFailure;
+        return false;
+    }
+
+    allocateGuestRam(cpu, false, false);
+    simulationFailure = outerFailure;
+    return true;
+}
+
+TinkerVm *tinkerVmCreate(const TinkerSimOptions *options)
+{
+    TinkerVm *vm;
+
+    vm = (TinkerVm *)calloc(1, sizeof(TinkerVm));
+    if (vm == NULL)
+    {
+        return NULL;
+    }
+
+    vm->cpu.ramSize = defaultRamSizeBytes;
+    vm->engine = tinkerSimTable;
+    if (options != NULL)
+    {
+        vm->cpu.ramSize = (options->ramSize != 0) ? options->ramSize : defaultRamSizeBytes;
+        vm->engine = options->engine;
+    }
+
+    if ((vm->cpu.ramSize % 4096ULL) != 0ULL || vm->cpu.ramSize > (1ULL << 47) || !allocateVmRam(&vm->cpu))
+    {
+        free(vm);
+        return NULL;
+    }
+
+    buildInstructionTable(vm->cpu.instructions);
+    vm->cpu.input = &vm->input;
+    vm->cpu.output = &vm->output;
+    vm->input.read = readInputText;
+    vm->input.user = vm;
+    vm->output.write = collectOutputText;
+    vm->output.user = vm;
+    vm->status = tinkerSimBadImage;
+    return vm;
+}
+
+void tinkerVmDestroy(TinkerVm *vm)
+{
+    if (vm == NULL)
+    {
+        return;
+    }
+
+    free(vm->cpu.decoded);
+    releaseGuestRam(&vm->cpu);
+    free(vm->outputText);
+    free(vm);
+}
+
+static void rewindInput(TinkerVm *vm)
+{
+    vm->input.start = 0;
+    vm->input.end = 0;
+    vm->input.atEof = false;
+    vm->inputUsed = 0;
+}
+
+TinkerSimStatus tinkerVmLoad(TinkerVm *vm, const void *image, size_t size)
+{
+    CpuState *cpu;
+    ImageHeader header;
+    jmp_buf failure;
+    jmp_buf *outerFailure;
+
+    cpu = &vm->cpu;
+    free(cpu->decoded);
+    cpu->decoded = NULL;
+
+    clearGuestRam(cpu);
+    memset(cpu->regs, 0, sizeof(cpu->regs));
+    cpu->regs[31] = cpu->ramSize;
+    cpu->halted = false;
+    cpu->codeWrites = 0;
+
+    rewindInput(vm);
+    vm->output.used = 0;
+    vm->outputSize = 0;
+    vm->outputLost = false;
+    vm->status = tinkerSimBadImage;
+
+    if ((uint64_t)size < imageHeaderBytes)
+    {
+        return vm->status;
+    }
+
+    readImageHeader((const uint8_t *)image, &header);
+    if (!imageHeaderFits(cpu, &header) || (uint64_t)size - imageHeaderBytes < header.codeBytes ||
+        (uint64_t)size - imageHeaderBytes - header.codeBytes < header.dataBytes)
+    {
+        return vm->status;
+    }
+
+    memcpy(cpu->ram + header.codeBase, (const uint8_t *)image + imageHeaderBytes, (size_t)header.codeBytes);
+    memcpy(cpu->ram + header.dataBase, (const uint8_t *)image + imageHeaderBytes + header.codeBytes, (size_t)header.dataBytes);
+    finishProgramLoad(cpu, &header);
+
+    outerFailure = simulationFailure;
+    simulationFailure = &failure;
+    if (setjmp(failure) == 0)
+    {
+        decodeCodeSegment(cpu);
+        vm->status = tinkerSimRunning;
+    }
+    else
+    {
+        vm->status = tinkerSimFailed;
+    }
+
+    simulationFailure = outerFailure;
+    return vm->status;
+}
+
+TinkerSimStatus tinkerVmRun(TinkerVm *vm, uint64_t maxInstructions)
+{
+    jmp_buf failure;
+    jmp_buf *outerFailure;
+
+    if (vm->status != tinkerSimRunning)
+    {
+        return vm->status;
+    }
+
+    outerFailure = simulationFailure;
+    simulationFailure = &failure;
+    if (setjmp(failure) == 0)
+    {
+        if (maxInstructions != 0)
+        {
+            runCountedEngine(&vm->cpu, maxInstructions);
+        }
+        else if (vm->engine == tinkerSimJit)
+        {
+            runJitEngine(&vm->cpu);
+        }
+        else if (vm->engine == tinkerSimThreaded)
+        {
+            runThreadedEngine(&vm->cpu);
+        }
+        else
+        {
+            runTableEngine(&vm->cpu);
+        }
+
+        vm->status = vm->cpu.halted ? tinkerSimHalted : tinkerSimRunning;
+    }
+    else
+    {
+        releaseJit(&vm->cpu);
+        vm->status = tinkerSimFailed;
+    }
+
+    simulationFailure = outerFailure;
+
+    flushOutput(&vm->output);
+    if (vm->outputLost)
+    {
+        vm->status = tinkerSimFailed;
+    }
+
+    return vm->status;
+}
+
+TinkerSimStatus tinkerVmStatus(const TinkerVm *vm)
+{
+    return vm->status;
+}
+
+void tinkerVmSetIo(TinkerVm *vm, const TinkerSimIo *io)
+{
+    vm->input.read = (io->read != NULL) ? io->read : readInputText;
+    vm->input.user = (io->read != NULL) ? io->user : vm;
+    vm->output.write = (io->write != NULL) ? io->write : collectOutputText;
+    vm->output.user = (io->write != NULL) ? io->user : vm;
+}
+
+void tinkerVmSetInput(TinkerVm *vm, const char *text, size_t size)
+{
+    vm->inputText = text;
+    vm->inputSize = size;
+    rewindInput(vm);
+}
+
+const char *tinkerVmOutput(const TinkerVm *vm, size_t *outSize)
+{
+    *outSize = vm->outputSize;
+    return vm->outputText;
+}
+
+uint64_t tinkerVmPc(const TinkerVm *vm)
+{
+    return vm->cpu.pc;
+}
+
+uint64_t tinkerVmRegister(const TinkerVm *vm, unsigned index)
+{
+    return (index < 32u) ? vm->cpu.regs[index] : 0ULL;
+}
+
+void tinkerVmSetRegister(TinkerVm *vm, unsigned index, uint64_t value)
+{
+    if (index < 32u)
+    {
+        vm->cpu.regs[index] = value;
+    }
+}
+
+bool tinkerVmReadMemory(const TinkerVm *vm, uint64_t address, void *bytes, size_t count)
+{
+    if (address > vm->cpu.ramSize || (uint64_t)count > vm->cpu.ramSize - address)
+    {
+        return false;
+    }
+
+    memcpy(bytes, vm->cpu.ram + address, count);
+    return true;
+}
+
+bool tinkerVmWriteMemory(TinkerVm *vm, uint64_t address, const void *bytes, size_t count)
+{
+    if (address > vm->cpu.ramSize || (uint64_t)count > vm->cpu.ramSize - address)
+    {
+        return false;
+    }
+
+    if (vm->cpu.decoded != NULL)
+    {
+        invalidateDecodedRange(&vm->cpu, address, (uint64_t)count);
+    }
+
+    memcpy(vm->cpu.ram + address, bytes, count);
+    return true;
+}
+
+#if !TINKER_LIBRARY
+int main(int argc, char **argv)
+{
+    static InputReader stdinReader;
+    CpuState cpu;
+    SimOptions options;
+
+    parseArguments(argc, argv, &options);
+    stdinReader.read = readStandardInput;
+    stdoutWriter.write = writeStandardOutput;
+    stdoutWriter.unbuffered = options.unbufferedOutput;
+
+    memset(&cpu, 0, sizeof(cpu));
+    cpu.input = &stdinReader;
+    cpu.output = &stdoutWriter;
+    cpu.ramSize = options.ramSize;
+    allocateGuestRam(&cpu, options.guardedMemory, options.hugePages);
+    cpu.regs[31] = cpu.ramSize;
+
+    loadProgramImage(&cpu, options.path);
+    runMachine(&cpu, options.engine);
+    flushStandardOutput();
+
+    releaseGuestRam(&cpu);
+    return 0;
+}
+#endif
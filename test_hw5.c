@@ -1,3 +1,7 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -289,12 +293,12 @@ static void endRedirect(StdioBackup *backup)
 {
     fflush(stdout);
 
-    if (dup2Fd(backup->savedStdin, filenoOf(stdin)) != 0)
+    if (dup2Fd(backup->savedStdin, filenoOf(stdin)) < 0)
     {
         failHarness("restore stdin failed");
     }
 
-    if (dup2Fd(backup->savedStdout, filenoOf(stdout)) != 0)
+    if (dup2Fd(backup->savedStdout, filenoOf(stdout)) < 0)
     {
         failHarness("restore stdout failed");
     }
@@ -324,6 +328,15 @@ static const char *simulatorExe(void)
 #endif
 }
 
+static const char *linkerExe(void)
+{
+#if defined(_WIN32)
+    return "hw5-ld.exe";
+#else
+    return "./hw5-ld";
+#endif
+}
+
 static int runCommand(const char *commandLine)
 {
     int rc;
@@ -342,7 +355,7 @@ static int assembleFile(const char *tkPath, const char *tkoPath, const char *tkT
     return runCommand(cmd);
 }
 
-static char *runSimulatorCapture(const char *tkoPath, const char *stdinPath, const char *stdoutPath, const char *stdinText)
+static char *runSimulatorCaptureWithArgs(const char *simArgs, const char *tkoPath, const char *stdinPath, const char *stdoutPath, const char *stdinText)
 {
     char cmd[1024];
     StdioBackup backup;
@@ -352,7 +365,7 @@ static char *runSimulatorCapture(const char *tkoPath, const char *stdinPath, con
 
     beginRedirect(&backup, stdinPath, stdoutPath);
 
-    snprintf(cmd, sizeof(cmd), "%s %s", simulatorExe(), tkoPath);
+    snprintf(cmd, sizeof(cmd), "%s %s %s", simulatorExe(), simArgs, tkoPath);
     rc = runCommand(cmd);
     (void)rc;
 
@@ -361,6 +374,19 @@ static char *runSimulatorCapture(const char *tkoPath, const char *stdinPath, con
     return readAllFile(stdoutPath);
 }
 
+static char *runSimulatorCapture(const char *tkoPath, const char *stdinPath, const char *stdoutPath, const char *stdinText)
+{
+    return runSimulatorCaptureWithArgs("", tkoPath, stdinPath, stdoutPath, stdinText);
+}
+
+static int assembleExistingFile(const char *tkPath, const char *tkoPath)
+{
+    char cmd[1024];
+
+    snprintf(cmd, sizeof(cmd), "%s %s %s", assemblerExe(), tkPath, tkoPath);
+    return runCommand(cmd);
+}
+
 static uint64_t doubleBits(double value)
 {
     uint64_t bits;
@@ -571,6 +597,7 @@ static bool testIntegrationFibonacci(void)
         return false;
     }
 
+    /* Input n prints the nth term of 0, 1, 1, 2, 3, 5, ...; 0 prints 0. */
     o0 = runSimulatorCapture(tkoPath, inPath, outPath, "0\n");
     if (!expectStrEqAt(__FILE__, __LINE__, o0, "0\n"))
     {
@@ -580,7 +607,7 @@ static bool testIntegrationFibonacci(void)
     free(o0);
 
     o1 = runSimulatorCapture(tkoPath, inPath, outPath, "1\n");
-    if (!expectStrEqAt(__FILE__, __LINE__, o1, "1\n"))
+    if (!expectStrEqAt(__FILE__, __LINE__, o1, "0\n"))
     {
         free(o1);
         return false;
@@ -756,6 +783,632 @@ static bool testIntegrationMatrixMulN1(void)
     return true;
 }
 
+static bool expectEnginesAgree(const char *tkPath, const char *stdinText)
+{
+    const char *engines[4] = {"--engine=threaded", "--engine=jit", "--engine=jit --memory=guarded", "--ram-size=64M --hugepages"};
+    const char *tkoPath = "tmp_engine.tko";
+    const char *inPath = "tmp_in.txt";
+    const char *outPath = "tmp_out.txt";
+
+    int rc;
+    int i;
+    bool same;
+    char *tableOut;
+
+    rc = assembleExistingFile(tkPath, tkoPath);
+    if (!expectEqIntAt(__FILE__, __LINE__, rc, 0, "assembler rc", "0"))
+    {
+        return false;
+    }
+
+    tableOut = runSimulatorCaptureWithArgs("--engine=table", tkoPath, inPath, outPath, stdinText);
+    same = expectFalseAt(__FILE__, __LINE__, tableOut[0] == '\0', "table engine produced output");
+
+    for (i = 0; i < 4 && same; i++)
+    {
+        char *engineOut;
+
+        engineOut = runSimulatorCaptureWithArgs(engines[i], tkoPath, inPath, outPath, stdinText);
+        same = expectStrEqAt(__FILE__, __LINE__, engineOut, tableOut);
+        free(engineOut);
+    }
+
+    free(tableOut);
+    return same;
+}
+
+static bool testEnginesMatchTable(void)
+{
+    char matrixInput[256];
+
+    snprintf(matrixInput, sizeof(matrixInput), "2 %llu %llu %llu %llu %llu %llu %llu %llu\n",
+             (unsigned long long)doubleBits(1.0), (unsigned long long)doubleBits(2.0),
+             (unsigned long long)doubleBits(3.0), (unsigned long long)doubleBits(4.0),
+             (unsigned long long)doubleBits(0.5), (unsigned long long)doubleBits(-1.0),
+             (unsigned long long)doubleBits(2.5), (unsigned long long)doubleBits(8.0));
+
+    if (!expectEnginesAgree("fibonacci.tk", "40\n"))
+    {
+        return false;
+    }
+
+    if (!expectEnginesAgree("binary_search.tk", "6 2 3 5 8 13 21 13\n"))
+    {
+        return false;
+    }
+
+    return expectEnginesAgree("matrix_multiplication.tk", matrixInput);
+}
+
+static bool testLoadImmediateSequences(void)
+{
+    const char *tk =
+        ".code\n"
+        "\tld r1, 1\n"
+        ":start\n"
+        "\tld r2, 0\n"
+        "\tld r3, 4095\n"
+        "\tld r4, 18446744073709551614\n"
+        "\tld r5, 81985529216486895\n"
+        "\tld r6, :start\n"
+        "\tld r7, :value\n"
+        "\tout r1, r2\n"
+        "\tout r1, r3\n"
+        "\tout r1, r4\n"
+        "\tout r1, r5\n"
+        "\tout r1, r6\n"
+        "\tout r1, r7\n"
+        "\thalt\n"
+        ".data\n"
+        ":value\n"
+        "\t7\n";
+
+    const char *tkPath = "tmp_ld.tk";
+    const char *tkoPath = "tmp_ld.tko";
+    const char *inPath = "tmp_in.txt";
+    const char *outPath = "tmp_out.txt";
+
+    int rc;
+    bool ok;
+    char *out;
+
+    rc = assembleFile(tkPath, tkoPath, tk);
+    if (!expectEqIntAt(__FILE__, __LINE__, rc, 0, "assembler rc", "0"))
+    {
+        return false;
+    }
+
+    out = runSimulatorCapture(tkoPath, inPath, outPath, "");
+    ok = expectStrEqAt(__FILE__, __LINE__, out, "0\n4095\n18446744073709551614\n81985529216486895\n8200\n65536\n");
+    free(out);
+
+    return ok;
+}
+
+static bool testOptimizedMatchesPlain(void)
+{
+    const char *programs[2] = {"fibonacci.tk", "binary_search.tk"};
+    const char *inputs[2] = {"40\n", "6 2 3 5 8 13 21 13\n"};
+    const char *inPath = "tmp_in.txt";
+    const char *outPath = "tmp_out.txt";
+
+    int i;
+    bool same;
+
+    same = true;
+
+    for (i = 0; i < 2 && same; i++)
+    {
+        char cmd[1024];
+        char *plainOut;
+        char *optimizedOut;
+        int rc;
+
+        rc = assembleExistingFile(programs[i], "tmp_plain.tko");
+        if (!expectEqIntAt(__FILE__, __LINE__, rc, 0, "assembler rc", "0"))
+        {
+            return false;
+        }
+
+        snprintf(cmd, sizeof(cmd), "%s -O %s %s", assemblerExe(), programs[i], "tmp_opt.tko");
+        rc = runCommand(cmd);
+        if (!expectEqIntAt(__FILE__, __LINE__, rc, 0, "assembler -O rc", "0"))
+        {
+            return false;
+        }
+
+        plainOut = runSimulatorCapture("tmp_plain.tko", inPath, outPath, inputs[i]);
+        optimizedOut = runSimulatorCapture("tmp_opt.tko", inPath, outPath, inputs[i]);
+        same = expectStrEqAt(__FILE__, __LINE__, optimizedOut, plainOut);
+
+        free(plainOut);
+        free(optimizedOut);
+    }
+
+    return same;
+}
+
+static bool testThreadedMatchesSerial(void)
+{
+    const char *programs[4] = {"fibonacci.tk", "binary_search.tk", "matrix_multiplication.tk", "tmp_many_blocks.tk"};
+    char cmd[1024];
+    char *blocks;
+    size_t used;
+    int rc;
+    int i;
+    bool same;
+
+    /* Enough labelled blocks that every -j chunk holds forward and backward references. */
+    blocks = (char *)malloc(64 * 1024);
+    if (blocks == NULL)
+    {
+        return false;
+    }
+
+    used = (size_t)snprintf(blocks, 64 * 1024, ".code\n\tld r1, 1\n\tclr r2\n");
+    for (i = 0; i < 300; i++)
+    {
+        used += (size_t)snprintf(blocks + used, 64 * 1024 - used, ":block%d\n\taddi r2, %d\n\tld r20, :block%d\n\tbrgt r20, r0, r2\n", i, i % 7,
+                                 (i * 37 + 11) % 300);
+    }
+    snprintf(blocks + used, 64 * 1024 - used, "\tout r1, r2\n\thalt\n.data\n\t:block7\n\t%d\n", 12345);
+    writeTextFile("tmp_many_blocks.tk", blocks);
+    free(blocks);
+
+    same = true;
+
+    for (i = 0; i < 4 && same; i++)
+    {
+        rc = assembleExistingFile(programs[i], "tmp_serial.tko");
+        same = expectEqIntAt(__FILE__, __LINE__, rc, 0, "assembler rc", "0");
+
+        snprintf(cmd, sizeof(cmd), "%s -j 3 %s %s", assemblerExe(), programs[i], "tmp_threaded.tko");
+        same = same && expectEqIntAt(__FILE__, __LINE__, runCommand(cmd), 0, "assembler -j 3 rc", "0");
+        same = same && expectEqIntAt(__FILE__, __LINE__, runCommand("cmp -s tmp_serial.tko tmp_threaded.tko"), 0, "-j 3 matches -j 1", "0");
+
+        snprintf(cmd, sizeof(cmd), "%s -O %s %s", assemblerExe(), programs[i], "tmp_serial.tko");
+        same = same && expectEqIntAt(__FILE__, __LINE__, runCommand(cmd), 0, "assembler -O rc", "0");
+
+        snprintf(cmd, sizeof(cmd), "%s -j 7 -O %s %s", assemblerExe(), programs[i], "tmp_threaded.tko");
+        same = same && expectEqIntAt(__FILE__, __LINE__, runCommand(cmd), 0, "assembler -j 7 -O rc", "0");
+        same = same && expectEqIntAt(__FILE__, __LINE__, runCommand("cmp -s tmp_serial.tko tmp_threaded.tko"), 0, "-j 7 -O matches -O", "0");
+    }
+
+    return same;
+}
+
+/* Pads each block with a comment so the source spans several 64 KiB cache chunks. */
+static void writeCacheTestSource(const char *path, int editedBlock)
+{
+    char *text;
+    size_t used;
+    size_t capacity;
+    int i;
+
+    capacity = 1024 * 1024;
+    text = (char *)malloc(capacity);
+    if (text == NULL)
+    {
+        return;
+    }
+
+    used = (size_t)snprintf(text, capacity, ".code\n\tld r1, 1\n\tclr r2\n");
+    for (i = 0; i < 400; i++)
+    {
+        used += (size_t)snprintf(text + used, capacity - used, ":block%d\n\taddi r2, %d\n\t; %0600d\n\tld r20, :block%d\n\tbrgt r20, r0, r2\n", i,
+                                 (i == editedBlock) ? 9 : i % 5, i, (i * 13 + 5) % 400);
+    }
+    snprintf(text + used, capacity - used, "\tout r1, r2\n\thalt\n");
+
+    writeTextFile(path, text);
+    free(text);
+}
+
+static bool testCacheDirMatchesClean(void)
+{
+    char cmd[1024];
+    bool ok;
+
+    runCommand("rm -rf tmp_asm_cache");
+    writeCacheTestSource("tmp_cached.tk", -1);
+
+    ok = expectEqIntAt(__FILE__, __LINE__, assembleExistingFile("tmp_cached.tk", "tmp_clean.tko"), 0, "clean build rc", "0");
+
+    snprintf(cmd, sizeof(cmd), "%s --cache-dir tmp_asm_cache tmp_cached.tk tmp_cached.tko", assemblerExe());
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand(cmd), 0, "cold build rc", "0");
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand("cmp -s tmp_cached.tko tmp_clean.tko"), 0, "cold build matches clean", "0");
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand("test $(ls tmp_asm_cache | wc -l) -ge 3"), 0, "source spans several chunks", "0");
+
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand(cmd), 0, "warm build rc", "0");
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand("cmp -s tmp_cached.tko tmp_clean.tko"), 0, "warm build matches clean", "0");
+
+    writeCacheTestSource("tmp_cached.tk", 200);
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, assembleExistingFile("tmp_cached.tk", "tmp_clean.tko"), 0, "clean build rc", "0");
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand(cmd), 0, "edited build rc", "0");
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand("cmp -s tmp_cached.tko tmp_clean.tko"), 0, "edited build matches clean", "0");
+
+    /* Byte 122 is the first record's rd register. */
+    runCommand("for f in tmp_asm_cache/*.tkc; do printf '\\177' | dd of=\"$f\" bs=1 seek=122 conv=notrunc 2> /dev/null; done");
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand(cmd), 0, "build over damaged cache rc", "0");
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand("cmp -s tmp_cached.tko tmp_clean.tko"), 0, "damaged cache ignored", "0");
+
+    runCommand("for f in tmp_asm_cache/*.tkc; do dd if=\"$f\" of=tmp_cut.tkc bs=150 count=1 2> /dev/null; mv tmp_cut.tkc \"$f\"; done");
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand(cmd), 0, "build over truncated cache rc", "0");
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand("cmp -s tmp_cached.tko tmp_clean.tko"), 0, "truncated cache ignored", "0");
+
+    runCommand("rm -rf tmp_asm_cache");
+    return ok;
+}
+
+static bool testLinkedObjects(void)
+{
+    const char *mainTk =
+        ".code\n"
+        "\tld r1, 1\n"
+        "\tld r2, :value\n"
+        "\tmov r3, (r2)(0)\n"
+        "\tld r20, :triple\n"
+        "\tbr r20\n"
+        ":back\n"
+        "\tout r1, r3\n"
+        "\tld r2, :resume\n"
+        "\tmov r3, (r2)(0)\n"
+        "\tout r1, r3\n"
+        "\thalt\n"
+        ".data\n"
+        ":value\n"
+        "\t14\n";
+    const char *libTk =
+        ".code\n"
+        ":triple\n"
+        "\tadd r4, r3, r3\n"
+        "\tadd r3, r4, r3\n"
+        "\tld r20, :back\n"
+        "\tbr r20\n"
+        ".data\n"
+        ":resume\n"
+        "\t:back\n";
+    const char *inPath = "tmp_in.txt";
+    const char *outPath = "tmp_out.txt";
+
+    char cmd[1024];
+    int rc;
+    bool ok;
+    char *out;
+
+    writeTextFile("tmp_main.tk", mainTk);
+    writeTextFile("tmp_lib.tk", libTk);
+
+    snprintf(cmd, sizeof(cmd), "%s -c tmp_main.tk tmp_main.tko.o", assemblerExe());
+    rc = runCommand(cmd);
+    if (!expectEqIntAt(__FILE__, __LINE__, rc, 0, "assembler -c rc", "0"))
+    {
+        return false;
+    }
+
+    snprintf(cmd, sizeof(cmd), "%s -c tmp_lib.tk tmp_lib.tko.o", assemblerExe());
+    rc = runCommand(cmd);
+    if (!expectEqIntAt(__FILE__, __LINE__, rc, 0, "assembler -c rc", "0"))
+    {
+        return false;
+    }
+
+    snprintf(cmd, sizeof(cmd), "%s -j 2 -o tmp_linked.tko tmp_main.tko.o tmp_lib.tko.o", linkerExe());
+    rc = runCommand(cmd);
+    if (!expectEqIntAt(__FILE__, __LINE__, rc, 0, "linker rc", "0"))
+    {
+        return false;
+    }
+
+    out = runSimulatorCapture("tmp_linked.tko", inPath, outPath, "");
+    ok = expectStrEqAt(__FILE__, __LINE__, out, "42\n8232\n");
+    free(out);
+
+    return ok;
+}
+
+static bool testMacroExpansion(void)
+{
+    const char *tk =
+        ".macro addto dst, src, times\n"
+        ".rept \\times\n"
+        "\tadd \\dst, \\dst, \\src\n"
+        ".endr\n"
+        ".endm\n"
+        ".macro countdown reg\n"
+        ":loop\n"
+        "\tsubi \\reg, 1\n"
+        "\tld r20, :loop\n"
+        "\tbrnz r20, \\reg\n"
+        ".endm\n"
+        ".code\n"
+        "\tld r1, 1\n"
+        "\tld r2, 0\n"
+        "\tld r3, 5\n"
+        "\taddto r2, r3, 4\n"
+        "\tout r1, r2\n"
+        ".irp reg, r4, r5\n"
+        "\tld \\reg, 3\n"
+        "\tcountdown \\reg\n"
+        "\tout r1, \\reg\n"
+        ".endr\n"
+        "\thalt\n";
+
+    const char *tkPath = "tmp_macro.tk";
+    const char *tkoPath = "tmp_macro.tko";
+    const char *inPath = "tmp_in.txt";
+    const char *outPath = "tmp_out.txt";
+
+    char cmd[1024];
+    int rc;
+    bool ok;
+    char *out;
+
+    rc = assembleFile(tkPath, tkoPath, tk);
+    if (!expectEqIntAt(__FILE__, __LINE__, rc, 0, "assembler rc", "0"))
+    {
+        return false;
+    }
+
+    out = runSimulatorCapture(tkoPath, inPath, outPath, "");
+    ok = expectStrEqAt(__FILE__, __LINE__, out, "20\n0\n0\n");
+    free(out);
+
+    writeTextFile(tkPath, ".code\n.rept -1\n\thalt\n.endr\n");
+    snprintf(cmd, sizeof(cmd), "%s %s %s 2> tmp_err.txt", assemblerExe(), tkPath, tkoPath);
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand(cmd) != 0, 1, "negative .rept fails", "1");
+
+    out = readAllFile("tmp_err.txt");
+    ok = ok && expectStrEqAt(__FILE__, __LINE__, out, "Error: .rept expects a count\n");
+    free(out);
+
+    writeTextFile(tkPath, ".code\n.rept 4000000000\n\thalt\n.endr\n");
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand(cmd) != 0, 1, "huge .rept fails", "1");
+
+    out = readAllFile("tmp_err.txt");
+    ok = ok && expectStrEqAt(__FILE__, __LINE__, out, "Error: .rept count too large\n");
+    free(out);
+
+    return ok;
+}
+
+static uint64_t readLittleEndian(const char *bytes, int count)
+{
+    uint64_t value;
+    int i;
+
+    value = 0;
+    for (i = count - 1; i >= 0; i--)
+    {
+        value = (value << 8) | (unsigned char)bytes[i];
+    }
+
+    return value;
+}
+
+static bool testSourceMap(void)
+{
+    const char *tk =
+        ".code\n"
+        "\tld r1, 1\n"
+        ":spin\n"
+        "\tout r1, r1\n"
+        "\thalt\n";
+
+    const char *range;
+    char cmd[1024];
+    char *map;
+    int rc;
+    bool ok;
+
+    writeTextFile("tmp_map.tk", tk);
+
+    snprintf(cmd, sizeof(cmd), "%s --map tmp_map.tk tmp_map.tko", assemblerExe());
+    rc = runCommand(cmd);
+    if (!expectEqIntAt(__FILE__, __LINE__, rc, 0, "assembler --map rc", "0"))
+    {
+        return false;
+    }
+
+    map = readAllFile("tmp_map.tko.map");
+    range = map + 56 + 24;
+
+    ok = expectEqU64At(__FILE__, __LINE__, readLittleEndian(map + 16, 8), 3, "range count", "3");
+    ok = ok && expectEqU64At(__FILE__, __LINE__, readLittleEndian(map + 56 + 12, 4), 2, "ld line", "2");
+    ok = ok && expectEqU64At(__FILE__, __LINE__, readLittleEndian(range, 8), 0x2008, "out address", "0x2008");
+    ok = ok && expectEqU64At(__FILE__, __LINE__, readLittleEndian(range + 12, 4), 4, "out line", "4");
+    ok = ok && expectEqU64At(__FILE__, __LINE__, readLittleEndian(range + 16, 4), 0, "out label", "0");
+
+    free(map);
+    return ok;
+}
+
+static bool testAssemblerLibrary(void)
+{
+    const char *driver =
+        "#include <stdio.h>\n"
+        "#include \"tinker-asm.h\"\n"
+        "int main(void)\n"
+        "{\n"
+        "    static const char good[] = \".code\\n\\tld r1, 1\\n\\tld r2, 7\\n\\tout r1, r2\\n\\thalt\\n\";\n"
+        "    static const char bad[] = \".code\\n\\thalt\\n\\tadd r1, r2\\n\";\n"
+        "    TinkerAsm *context = tinkerAsmCreate();\n"
+        "    const unsigned char *image;\n"
+        "    size_t size;\n"
+        "    FILE *file;\n"
+        "    if (tinkerAsmAssemble(context, bad, sizeof(bad) - 1, 0) != tinkerAsmFailed)\n"
+        "        return 1;\n"
+        "    printf(\"%u %s\\n\", tinkerAsmLastError(context)->line, tinkerAsmLastError(context)->message);\n"
+        "    if (tinkerAsmAssemble(context, good, sizeof(good) - 1, 0) != tinkerAsmOk)\n"
+        "        return 1;\n"
+        "    image = tinkerAsmImage(context, &size);\n"
+        "    file = fopen(\"tmp_asmlib.tko\", \"wb\");\n"
+        "    fwrite(image, 1, size, file);\n"
+        "    fclose(file);\n"
+        "    tinkerAsmDestroy(context);\n"
+        "    return 0;\n"
+        "}\n";
+
+    char *out;
+    int rc;
+    bool ok;
+
+    writeTextFile("tmp_asmlib.c", driver);
+
+    rc = runCommand("cc -std=c11 -I. tmp_asmlib.c libtinkerasm.a -pthread -o tmp_asmlib");
+    if (!expectEqIntAt(__FILE__, __LINE__, rc, 0, "library driver build rc", "0"))
+    {
+        return false;
+    }
+
+    rc = runCommand("./tmp_asmlib > tmp_out.txt");
+    if (!expectEqIntAt(__FILE__, __LINE__, rc, 0, "library driver rc", "0"))
+    {
+        return false;
+    }
+
+    out = readAllFile("tmp_out.txt");
+    ok = expectStrEqAt(__FILE__, __LINE__, out, "3 malformed operand separators\n");
+    free(out);
+
+    rc = assembleFile("tmp_asmlib.tk", "tmp_asmlib_cli.tko", ".code\n\tld r1, 1\n\tld r2, 7\n\tout r1, r2\n\thalt\n");
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, rc, 0, "assembler rc", "0");
+
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand("cmp -s tmp_asmlib.tko tmp_asmlib_cli.tko"), 0, "library image matches hw5-asm", "0");
+
+    out = runSimulatorCapture("tmp_asmlib.tko", "tmp_in.txt", "tmp_out.txt", "");
+    ok = ok && expectStrEqAt(__FILE__, __LINE__, out, "7\n");
+    free(out);
+
+    return ok;
+}
+
+static bool testSimulatorLibrary(void)
+{
+    const char *driver =
+        "#include <stdio.h>\n"
+        "#include <stdlib.h>\n"
+        "#include \"tinker-sim.h\"\n"
+        "int main(int argc, char **argv)\n"
+        "{\n"
+        "    static const char junk[] = \"not an image\";\n"
+        "    static char image[4096];\n"
+        "    TinkerSimOptions options = {0, tinkerSimTable};\n"
+        "    TinkerVm *vm;\n"
+        "    const char *output;\n"
+        "    size_t size;\n"
+        "    FILE *file = fopen(argv[1], \"rb\");\n"
+        "    size = fread(image, 1, sizeof(image), file);\n"
+        "    fclose(file);\n"
+        "    options.engine = (TinkerSimEngine)atoi(argv[2]);\n"
+        "    vm = tinkerVmCreate(&options);\n"
+        "    if (tinkerVmLoad(vm, junk, sizeof(junk)) != tinkerSimBadImage)\n"
+        "        return 1;\n"
+        "    tinkerVmSetInput(vm, \"7\\n\", 2);\n"
+        "    if (tinkerVmLoad(vm, image, size) != tinkerSimRunning)\n"
+        "        return 1;\n"
+        "    if (tinkerVmRun(vm, 1) != tinkerSimRunning || tinkerVmPc(vm) != 0x2004)\n"
+        "        return 1;\n"
+        "    if (tinkerVmRun(vm, 0) != tinkerSimHalted)\n"
+        "        return 1;\n"
+        "    output = tinkerVmOutput(vm, &size);\n"
+        "    printf(\"%.*s%llu\\n\", (int)size, output, (unsigned long long)tinkerVmRegister(vm, 1));\n"
+        "    file = fopen(argv[3], \"rb\");\n"
+        "    size = fread(image, 1, sizeof(image), file);\n"
+        "    fclose(file);\n"
+        "    if (tinkerVmLoad(vm, image, size) != tinkerSimRunning || tinkerVmRun(vm, 0) != tinkerSimFailed)\n"
+        "        return 1;\n"
+        "    printf(\"%llx %llu\\n\", (unsigned long long)tinkerVmPc(vm), (unsigned long long)tinkerVmRegister(vm, 5));\n"
+        "    tinkerVmDestroy(vm);\n"
+        "    return 0;\n"
+        "}\n";
+
+    char *out;
+    int rc;
+    bool ok;
+    int engine;
+
+    writeTextFile("tmp_simlib.c", driver);
+
+    rc = runCommand("cc -std=c11 -I. tmp_simlib.c libtinkersim.a -lm -o tmp_simlib");
+    if (!expectEqIntAt(__FILE__, __LINE__, rc, 0, "library driver build rc", "0"))
+    {
+        return false;
+    }
+
+    rc = assembleFile("tmp_simlib.tk", "tmp_simlib.tko", ".code\n\tld r2, 0\n\tin r1, r2\n\taddi r1, 5\n\tld r3, 1\n\tout r3, r1\n\thalt\n");
+    /* A fault leaves the faulting load's pc and the earlier results behind on every engine. */
+    rc |= assembleFile("tmp_simlib_fault.tk", "tmp_simlib_fault.tko", ".code\n\taddi r5, 42\n\txor r2, r2, r2\n\tsubi r2, 64\n\tmov r3, (r2)(0)\n\thalt\n");
+    if (!expectEqIntAt(__FILE__, __LINE__, rc, 0, "assembler rc", "0"))
+    {
+        return false;
+    }
+
+    ok = true;
+    engine = 0;
+    while (ok && engine < 3)
+    {
+        char command[96];
+
+        snprintf(command, sizeof(command), "./tmp_simlib tmp_simlib.tko %d tmp_simlib_fault.tko > tmp_out.txt", engine);
+        rc = runCommand(command);
+        ok = expectEqIntAt(__FILE__, __LINE__, rc, 0, "library driver rc", "0");
+
+        out = readAllFile("tmp_out.txt");
+        ok = ok && expectStrEqAt(__FILE__, __LINE__, out, "12\n12\n200c 42\n");
+        free(out);
+
+        engine += 1;
+    }
+
+    return ok;
+}
+
+static bool testRunDriver(void)
+{
+    const char *source = ".code\n\tld r2, 0\n\tin r1, r2\n\taddi r1, 5\n\tld r3, 1\n\tout r3, r1\n\thalt\n";
+    char *out;
+    int rc;
+    bool ok;
+    int run;
+
+    runCommand("rm -rf tmp_run_cache");
+
+    rc = assembleFile("tmp_run.tk", "tmp_run_cli.tko", source);
+    rc |= assembleFile("tmp_run_other.tk", "tmp_run_other.tko", ".code\n\tld r1, 1\n\tld r2, 99\n\tout r1, r2\n\thalt\n");
+    if (!expectEqIntAt(__FILE__, __LINE__, rc, 0, "assembler rc", "0"))
+    {
+        return false;
+    }
+
+    ok = true;
+    run = 0;
+    while (ok && run < 3)
+    {
+        /* The third run finds another program's image under the old entry's hash. */
+        if (run == 2)
+        {
+            runCommand("f=$(ls tmp_run_cache/*.tko); { cat tmp_run_other.tko; tail -c 16 \"$f\"; } > tmp_run_entry; mv tmp_run_entry \"$f\"");
+        }
+
+        writeTextFile("tmp_in.txt", "7\n");
+        rc = runCommand("./tinker run --cache-dir tmp_run_cache tmp_run.tk < tmp_in.txt > tmp_out.txt");
+        ok = expectEqIntAt(__FILE__, __LINE__, rc, 0, "tinker run rc", "0");
+
+        out = readAllFile("tmp_out.txt");
+        ok = ok && expectStrEqAt(__FILE__, __LINE__, out, "12\n");
+        free(out);
+
+        run += 1;
+    }
+
+    runCommand("dd if=$(ls tmp_run_cache/*.tko) of=tmp_run_image.tko bs=$(($(wc -c < tmp_run_cli.tko))) count=1 2> /dev/null");
+    ok = ok && expectEqIntAt(__FILE__, __LINE__, runCommand("cmp -s tmp_run_image.tko tmp_run_cli.tko"), 0, "cached image matches hw5-asm", "0");
+
+    runCommand("rm -rf tmp_run_cache");
+    return ok;
+}
+
 static void runTestSuite(const TestCase *tests, int testCount)
 {
     int i;
@@ -787,7 +1440,7 @@ static void runTestSuite(const TestCase *tests, int testCount)
 
 int main(void)
 {
-    TestCase tests[3];
+    TestCase tests[14];
 
     memset(&g_stats, 0, sizeof(g_stats));
 
@@ -800,8 +1453,41 @@ int main(void)
     tests[2].name = "integration_matrix_mul_n1";
     tests[2].fn = testIntegrationMatrixMulN1;
 
+    tests[3].name = "engines_match_table";
+    tests[3].fn = testEnginesMatchTable;
+
+    tests[4].name = "load_immediate_sequences";
+    tests[4].fn = testLoadImmediateSequences;
+
+    tests[5].name = "optimized_matches_plain";
+    tests[5].fn = testOptimizedMatchesPlain;
+
+    tests[6].name = "threaded_matches_serial";
+    tests[6].fn = testThreadedMatchesSerial;
+
+    tests[7].name = "cache_dir_matches_clean";
+    tests[7].fn = testCacheDirMatchesClean;
+
+    tests[8].name = "linked_objects";
+    tests[8].fn = testLinkedObjects;
+
+    tests[9].name = "macro_expansion";
+    tests[9].fn = testMacroExpansion;
+
+    tests[10].name = "source_map";
+    tests[10].fn = testSourceMap;
+
+    tests[11].name = "assembler_library";
+    tests[11].fn = testAssemblerLibrary;
+
+    tests[12].name = "simulator_library";
+    tests[12].fn = testSimulatorLibrary;
+
+    tests[13].name = "run_driver";
+    tests[13].fn = testRunDriver;
+
     printf("HW5 Tests (integration)\n\n");
-    runTestSuite(tests, 3);
+    runTestSuite(tests, 14);
 
     printf("Tests run: %d\n", g_stats.total);
     printf("Failed:    %d\n", g_stats.failed);
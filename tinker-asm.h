@@ -0,0 +1,72 @@
+#ifndef TINKER_ASM_H
+#define TINKER_ASM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libtinkerasm: the hw5-asm assembler as a library. build.sh compiles
+ * hw5-asm.c with -DTINKER_LIBRARY=1 into libtinkerasm.a (link with
+ * -pthread where hw5-asm uses threads).
+ *
+ *   TinkerAsm *assembler = tinkerAsmCreate();
+ *   if (tinkerAsmAssemble(assembler, text, length, 0) == tinkerAsmOk)
+ *       image = tinkerAsmImage(assembler, &imageSize);
+ *   else
+ *       report(tinkerAsmLastError(assembler));
+ *   tinkerAsmDestroy(assembler);
+ *
+ * The image is the .tko file hw5-asm would write. The image and the error
+ * belong to the context and stay valid until its next assemble or destroy.
+ * A context keeps its arenas and record lists between calls, so reusing
+ * one is cheaper than creating one per program. Contexts are independent
+ * and may be used on different threads, one thread per context at a time.
+ */
+typedef struct TinkerAsm TinkerAsm;
+
+/*
+ * Bumped whenever the image hw5-asm writes for the same source and flags
+ * changes (ld planning, relaxation, encoding, .tko layout), so caches of
+ * assembled images can key on it. tinkerAsmVersion returns the value the
+ * linked library was built with.
+ */
+#define TINKER_ASM_VERSION 1
+
+unsigned tinkerAsmVersion(void);
+
+/*
+ * The 128-bit hash hw5-asm keys its chunk cache with, for callers that key
+ * their own caches on source text or images. Not cryptographic.
+ */
+void tinkerAsmHash(const void *bytes, size_t size, uint64_t seed, uint64_t *outA, uint64_t *outB);
+
+typedef enum
+{
+    tinkerAsmOk,
+    tinkerAsmFailed
+} TinkerAsmStatus;
+
+enum
+{
+    tinkerAsmOptimize = 1
+};
+
+typedef struct
+{
+    TinkerAsmStatus status;
+    uint32_t line;
+    const char *message;
+} TinkerAsmError;
+
+TinkerAsm *tinkerAsmCreate(void);
+void tinkerAsmDestroy(TinkerAsm *context);
+
+/* flags: tinkerAsmOptimize for hw5-asm -O. source need not be NUL-terminated. */
+TinkerAsmStatus tinkerAsmAssemble(TinkerAsm *context, const char *source, size_t size, unsigned flags);
+
+const unsigned char *tinkerAsmImage(const TinkerAsm *context, size_t *outSize);
+
+/* line is the 1-based source line, or 0 when the error is not tied to one. */
+const TinkerAsmError *tinkerAsmLastError(const TinkerAsm *context);
+
+#endif
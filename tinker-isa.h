@@ -0,0 +1,93 @@
+#ifndef TINKER_ISA_H
+#define TINKER_ISA_H
+
+#include <stdint.h>
+
+/*
+ * The Tinker instruction set, one row per opcode:
+ *
+ *   X(opcode, mnemonic, operand format, immediate kind, ends block, handler)
+ *
+ * hw5-asm builds its mnemonic lookup from these rows and hw5-sim its
+ * dispatch and decode tables, so a new opcode (0x1E and 0x1F are free) is
+ * added here once. Rows sharing a mnemonic must be adjacent, starting with
+ * the base opcode of the group: brr picks base + 1 for an immediate or
+ * label, mov picks base + 0..3 for load, register, immediate and store.
+ * The handler column names the hw5-sim execute function.
+ */
+typedef enum
+{
+    tinkerFormatRRR,
+    tinkerFormatRR,
+    tinkerFormatRI,
+    tinkerFormatR,
+    tinkerFormatNone,
+    tinkerFormatBrr,
+    tinkerFormatPriv,
+    tinkerFormatMov
+} TinkerFormat;
+
+typedef enum
+{
+    tinkerImmRaw,
+    tinkerImmSigned,
+    tinkerImmShift
+} TinkerImmKind;
+
+#define TINKER_OPCODES(X)                                                              \
+    X(0x00, and, tinkerFormatRRR, tinkerImmRaw, 0, executeAnd)                         \
+    X(0x01, or, tinkerFormatRRR, tinkerImmRaw, 0, executeOr)                           \
+    X(0x02, xor, tinkerFormatRRR, tinkerImmRaw, 0, executeXor)                         \
+    X(0x03, not, tinkerFormatRR, tinkerImmRaw, 0, executeNot)                          \
+    X(0x04, shftr, tinkerFormatRRR, tinkerImmRaw, 0, executeShiftRightRegister)        \
+    X(0x05, shftri, tinkerFormatRI, tinkerImmShift, 0, executeShiftRightImmediate)     \
+    X(0x06, shftl, tinkerFormatRRR, tinkerImmRaw, 0, executeShiftLeftRegister)         \
+    X(0x07, shftli, tinkerFormatRI, tinkerImmShift, 0, executeShiftLeftImmediate)      \
+    X(0x08, br, tinkerFormatR, tinkerImmRaw, 1, executeBranchAbsolute)                 \
+    X(0x09, brr, tinkerFormatBrr, tinkerImmRaw, 1, executeBranchRelativeRegister)      \
+    X(0x0A, brr, tinkerFormatBrr, tinkerImmSigned, 1, executeBranchRelativeImmediate)  \
+    X(0x0B, brnz, tinkerFormatRR, tinkerImmRaw, 1, executeBranchNotZero)               \
+    X(0x0C, call, tinkerFormatR, tinkerImmRaw, 1, executeCall)                         \
+    X(0x0D, return, tinkerFormatNone, tinkerImmRaw, 1, executeReturn)                  \
+    X(0x0E, brgt, tinkerFormatRRR, tinkerImmRaw, 1, executeBranchGreaterThan)          \
+    X(0x0F, priv, tinkerFormatPriv, tinkerImmRaw, 1, executePrivileged)                \
+    X(0x10, mov, tinkerFormatMov, tinkerImmSigned, 0, executeLoad)                     \
+    X(0x11, mov, tinkerFormatMov, tinkerImmRaw, 0, executeMoveRegister)                \
+    X(0x12, mov, tinkerFormatMov, tinkerImmRaw, 0, executeMoveImmediate)               \
+    X(0x13, mov, tinkerFormatMov, tinkerImmSigned, 0, executeStore)                    \
+    X(0x14, addf, tinkerFormatRRR, tinkerImmRaw, 0, executeAddFloat)                   \
+    X(0x15, subf, tinkerFormatRRR, tinkerImmRaw, 0, executeSubFloat)                   \
+    X(0x16, mulf, tinkerFormatRRR, tinkerImmRaw, 0, executeMulFloat)                   \
+    X(0x17, divf, tinkerFormatRRR, tinkerImmRaw, 0, executeDivFloat)                   \
+    X(0x18, add, tinkerFormatRRR, tinkerImmRaw, 0, executeAddInt)                      \
+    X(0x19, addi, tinkerFormatRI, tinkerImmRaw, 0, executeAddImmediate)                \
+    X(0x1A, sub, tinkerFormatRRR, tinkerImmRaw, 0, executeSubInt)                      \
+    X(0x1B, subi, tinkerFormatRI, tinkerImmRaw, 0, executeSubImmediate)                \
+    X(0x1C, mul, tinkerFormatRRR, tinkerImmRaw, 0, executeMulInt)                      \
+    X(0x1D, div, tinkerFormatRRR, tinkerImmRaw, 0, executeDivInt)
+
+/*
+ * Mnemonics hash as h = h * 67 + c over the lower-cased text, masked to
+ * tinkerMnemonicSlots. With the opcodes above plus hw5-asm's pseudo-ops the
+ * mapping is collision-free; lookups still probe linearly so a future
+ * collision costs a probe rather than correctness.
+ */
+enum
+{
+    tinkerMnemonicSlots = 128
+};
+
+static inline uint32_t tinkerHashMnemonic(const char *text)
+{
+    uint32_t hash = 0;
+
+    while (*text != '\0')
+    {
+        hash = hash * 67u + (uint32_t)(unsigned char)*text;
+        text++;
+    }
+
+    return hash & (tinkerMnemonicSlots - 1u);
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef TINKER_SIM_H
+#define TINKER_SIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libtinkersim: the hw5-sim machine as a library. build.sh compiles
+ * hw5-sim.c with -DTINKER_LIBRARY=1 into libtinkersim.a (link with -lm).
+ *
+ *   TinkerVm *vm = tinkerVmCreate(NULL);
+ *   tinkerVmSetInput(vm, "5\n", 2);
+ *   if (tinkerVmLoad(vm, image, imageSize) == tinkerSimRunning)
+ *       status = tinkerVmRun(vm, 0);
+ *   output = tinkerVmOutput(vm, &outputSize);
+ *   tinkerVmDestroy(vm);
+ *
+ * A VM owns its RAM and decoded code and is reused by loading the next
+ * image, which clears RAM, registers and output and rewinds input. Port 0
+ * reads decimal text and ports 1 and 3 write it, as in hw5-sim, either
+ * through callbacks or, by default, from the tinkerVmSetInput text and into
+ * a buffer read back with tinkerVmOutput. VMs are independent and may run
+ * on different threads, one thread per VM at a time. Guarded memory is
+ * hw5-sim only: it needs a process-wide SIGSEGV handler.
+ */
+typedef struct TinkerVm TinkerVm;
+
+typedef enum
+{
+    tinkerSimRunning,
+    tinkerSimHalted,
+    tinkerSimFailed,
+    tinkerSimBadImage
+} TinkerSimStatus;
+
+typedef enum
+{
+    tinkerSimTable,
+    tinkerSimThreaded,
+    tinkerSimJit
+} TinkerSimEngine;
+
+typedef struct
+{
+    uint64_t ramSize;
+    TinkerSimEngine engine;
+} TinkerSimOptions;
+
+typedef struct
+{
+    size_t (*read)(void *user, char *bytes, size_t size);
+    void (*write)(void *user, const char *bytes, size_t count);
+    void *user;
+} TinkerSimIo;
+
+/* NULL options, or a ramSize of 0, give hw5-sim's defaults: 512K of RAM and the table engine. */
+TinkerVm *tinkerVmCreate(const TinkerSimOptions *options);
+void tinkerVmDestroy(TinkerVm *vm);
+
+/* image is a .tko file's bytes; tinkerSimRunning means loaded and ready. */
+TinkerSimStatus tinkerVmLoad(TinkerVm *vm, const void *image, size_t size);
+
+/*
+ * Runs until halt or failure, or for at most maxInstructions when it is not
+ * 0 (a step is a run of 1); tinkerSimRunning means the budget ran out.
+ * Budgeted runs count on the table engine whatever the VM was created with.
+ */
+TinkerSimStatus tinkerVmRun(TinkerVm *vm, uint64_t maxInstructions);
+TinkerSimStatus tinkerVmStatus(const TinkerVm *vm);
+
+/*
+ * read returns 0 at end of input; a NULL read or write keeps the default.
+ * Input text is not copied and must outlive the runs that read it.
+ */
+void tinkerVmSetIo(TinkerVm *vm, const TinkerSimIo *io);
+void tinkerVmSetInput(TinkerVm *vm, const char *text, size_t size);
+const char *tinkerVmOutput(const TinkerVm *vm, size_t *outSize);
+
+uint64_t tinkerVmPc(const TinkerVm *vm);
+uint64_t tinkerVmRegister(const TinkerVm *vm, unsigned index);
+void tinkerVmSetRegister(TinkerVm *vm, unsigned index, uint64_t value);
+bool tinkerVmReadMemory(const TinkerVm *vm, uint64_t address, void *bytes, size_t count);
+bool tinkerVmWriteMemory(TinkerVm *vm, uint64_t address, const void *bytes, size_t count);
+
+#endif
@@ -0,0 +1,389 @@
+#if defined(__linux__)
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TINKER_POSIX_IO 1
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define TINKER_POSIX_IO 0
+#endif
+
+#include "tinker-asm.h"
+#include "tinker-sim.h"
+
+/*
+ * tinker run: hw5-asm followed by hw5-sim in one process. The source is
+ * assembled in memory by libtinkerasm and the image handed to libtinkersim,
+ * so no .tko is written or re-read. Images are also kept in a cache
+ * directory under a hash of the source text, the -O flag, the linked
+ * assembler's tinkerAsmVersion and imageCacheVersion; a run of unchanged
+ * source loads the cached image and skips the assembler. An entry is the
+ * image followed by a hash of it, and one whose hash does not match is
+ * reassembled. imageCacheVersion covers that entry layout.
+ */
+static const char *const defaultCacheDir = ".tinker-cache";
+static const uint64_t imageCacheVersion = 2;
+
+enum
+{
+    imageCheckBytes = 16
+};
+
+static char *readSourceFile(const char *path, size_t *outSize)
+{
+    FILE *file = NULL;
+    char *buffer = NULL;
+    size_t size = 0;
+    size_t capacity = 1u << 16;
+
+    file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    buffer = (char *)malloc(capacity);
+    while (buffer != NULL)
+    {
+        char *bigger = NULL;
+
+        size += fread(buffer + size, 1, capacity - size, file);
+        if (size < capacity)
+        {
+            break;
+        }
+
+        capacity *= 2;
+        bigger = (char *)realloc(buffer, capacity);
+        if (bigger == NULL)
+        {
+            free(buffer);
+        }
+
+        buffer = bigger;
+    }
+
+    if (ferror(file) != 0)
+    {
+        free(buffer);
+        buffer = NULL;
+    }
+
+    fclose(file);
+
+    *outSize = size;
+    return buffer;
+}
+
+static void storeU64LittleEndian(unsigned char *bytes, uint64_t value)
+{
+    int i = 0;
+
+    for (i = 0; i < 8; i++)
+    {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static void hashImage(const unsigned char *image, size_t size, unsigned char check[imageCheckBytes])
+{
+    uint64_t a = 0;
+    uint64_t b = 0;
+
+    tinkerAsmHash(image, size, imageCacheVersion, &a, &b);
+    storeU64LittleEndian(check, a);
+    storeU64LittleEndian(check + 8, b);
+}
+
+/* Returns the image size of a cache entry, or 0 when its hash does not match. */
+static size_t checkCachedImage(const char *entry, size_t entrySize)
+{
+    unsigned char check[imageCheckBytes];
+    size_t size = 0;
+
+    if (entrySize <= imageCheckBytes)
+    {
+        return 0;
+    }
+
+    size = entrySize - imageCheckBytes;
+    hashImage((const unsigned char *)entry, size, check);
+
+    return (memcmp(check, entry + size, imageCheckBytes) == 0) ? size : 0;
+}
+
+/* A cache that cannot be written only costs the next run an assemble. */
+static void writeCachedImage(const char *cacheDir, const char *path, const unsigned char *image, size_t size)
+{
+    char temporaryPath[4200];
+    unsigned char check[imageCheckBytes];
+    FILE *file = NULL;
+
+#if TINKER_POSIX_IO
+    if (mkdir(cacheDir, 0777) != 0 && errno != EEXIST)
+    {
+        return;
+    }
+
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.%ld", path, (long)getpid());
+#else
+    (void)cacheDir;
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", path);
+#endif
+
+    file = fopen(temporaryPath, "wb");
+    if (file == NULL)
+    {
+        return;
+    }
+
+    hashImage(image, size, check);
+    fwrite(image, 1, size, file);
+    fwrite(check, 1, sizeof(check), file);
+
+    if (ferror(file) != 0 || fclose(file) != 0 || rename(temporaryPath, path) != 0)
+    {
+        remove(temporaryPath);
+    }
+}
+
+static size_t readStandardInput(void *user, char *bytes, size_t size)
+{
+    (void)user;
+
+#if TINKER_POSIX_IO
+    for (;;)
+    {
+        ssize_t count = read(0, bytes, size);
+
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        return (count > 0) ? (size_t)count : 0;
+    }
+#else
+    return (fgets(bytes, (int)size, stdin) != NULL) ? strlen(bytes) : 0;
+#endif
+}
+
+static void writeStandardOutput(void *user, const char *bytes, size_t count)
+{
+    (void)user;
+
+    fwrite(bytes, 1, count, stdout);
+    fflush(stdout);
+}
+
+static bool parseEngine(const char *name, TinkerSimEngine *outEngine)
+{
+    if (strcmp(name, "table") == 0)
+    {
+        *outEngine = tinkerSimTable;
+    }
+    else if (strcmp(name, "threaded") == 0)
+    {
+        *outEngine = tinkerSimThreaded;
+    }
+    else if (strcmp(name, "jit") == 0)
+    {
+        *outEngine = tinkerSimJit;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+static int runMain(int argc, char **argv)
+{
+    const char *cacheDir = defaultCacheDir;
+    const char *inputPath = NULL;
+    unsigned flags = 0;
+    int argi = 2;
+
+    TinkerSimOptions options;
+    TinkerSimIo io;
+    TinkerSimStatus status = tinkerSimBadImage;
+    TinkerAsm *assembler = NULL;
+    TinkerVm *vm = NULL;
+
+    char *source = NULL;
+    size_t sourceSize = 0;
+    char cachePath[4096];
+    char *cached = NULL;
+    size_t cachedSize = 0;
+    const unsigned char *image = NULL;
+    size_t imageSize = 0;
+    uint64_t hashA = 0;
+    uint64_t hashB = 0;
+
+    options.ramSize = 0;
+    options.engine = tinkerSimTable;
+
+    while (argi < argc && argv[argi][0] == '-')
+    {
+        if (strcmp(argv[argi], "-O") == 0)
+        {
+            flags |= tinkerAsmOptimize;
+            argi++;
+            continue;
+        }
+
+        if (strncmp(argv[argi], "--engine=", 9) == 0 && parseEngine(argv[argi] + 9, &options.engine))
+        {
+            argi++;
+            continue;
+        }
+
+        if (strncmp(argv[argi], "--cache-dir=", 12) == 0 && argv[argi][12] != '\0')
+        {
+            cacheDir = argv[argi] + 12;
+            argi++;
+            continue;
+        }
+
+        if (strcmp(argv[argi], "--cache-dir") == 0 && argi + 1 < argc)
+        {
+            cacheDir = argv[argi + 1];
+            argi += 2;
+            continue;
+        }
+
+        if (strcmp(argv[argi], "--no-cache") == 0)
+        {
+            cacheDir = NULL;
+            argi++;
+            continue;
+        }
+
+        break;
+    }
+
+    if (argc - argi != 1)
+    {
+        fprintf(stderr, "Usage: %s run [-O] [--engine=table|threaded|jit] [--cache-dir DIR | --no-cache] program.tk\n", argv[0]);
+        return 1;
+    }
+
+    inputPath = argv[argi];
+    source = readSourceFile(inputPath, &sourceSize);
+    if (source == NULL)
+    {
+        fprintf(stderr, "Error: cannot open input file %s\n", inputPath);
+        return 1;
+    }
+
+    vm = tinkerVmCreate(&options);
+    if (vm == NULL)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        free(source);
+        return 1;
+    }
+
+    io.read = readStandardInput;
+    io.write = writeStandardOutput;
+    io.user = NULL;
+    tinkerVmSetIo(vm, &io);
+
+    if (cacheDir != NULL)
+    {
+        tinkerAsmHash(source, sourceSize, ((uint64_t)tinkerAsmVersion() << 32) ^ (imageCacheVersion * 2u + (flags & tinkerAsmOptimize)), &hashA, &hashB);
+        snprintf(cachePath, sizeof(cachePath), "%s/%016llx%016llx.tko", cacheDir, (unsigned long long)hashA, (unsigned long long)hashB);
+
+        cached = readSourceFile(cachePath, &cachedSize);
+        if (cached != NULL)
+        {
+            cachedSize = checkCachedImage(cached, cachedSize);
+            if (cachedSize != 0)
+            {
+                status = tinkerVmLoad(vm, cached, cachedSize);
+            }
+
+            if (status == tinkerSimBadImage)
+            {
+                remove(cachePath);
+            }
+        }
+    }
+
+    if (status == tinkerSimBadImage)
+    {
+        assembler = tinkerAsmCreate();
+        if (assembler == NULL || tinkerAsmAssemble(assembler, source, sourceSize, flags) != tinkerAsmOk)
+        {
+            const TinkerAsmError *error = (assembler != NULL) ? tinkerAsmLastError(assembler) : NULL;
+
+            if (error == NULL)
+            {
+                fprintf(stderr, "Error: out of memory\n");
+            }
+            else if (error->line != 0)
+            {
+                fprintf(stderr, "Error: line %u: %s\n", error->line, error->message);
+            }
+            else
+            {
+                fprintf(stderr, "Error: %s\n", error->message);
+            }
+
+            tinkerAsmDestroy(assembler);
+            tinkerVmDestroy(vm);
+            free(cached);
+            free(source);
+            return 1;
+        }
+
+        image = tinkerAsmImage(assembler, &imageSize);
+        status = tinkerVmLoad(vm, image, imageSize);
+
+        if (cacheDir != NULL && status == tinkerSimRunning)
+        {
+            writeCachedImage(cacheDir, cachePath, image, imageSize);
+        }
+
+        tinkerAsmDestroy(assembler);
+    }
+
+    free(cached);
+    free(source);
+
+    if (status == tinkerSimRunning)
+    {
+        status = tinkerVmRun(vm, 0);
+    }
+
+    tinkerVmDestroy(vm);
+
+    if (status != tinkerSimHalted)
+    {
+        fprintf(stderr, "Simulation error\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "run") == 0)
+    {
+        return runMain(argc, argv);
+    }
+
+    fprintf(stderr, "Usage: %s run [-O] [--engine=table|threaded|jit] [--cache-dir DIR | --no-cache] program.tk\n", argv[0]);
+    return 1;
+}